@@ -157,6 +157,7 @@ static const char *DYNAMIC = _DYNAMIC;
 
 static const char *YES = "Y";
 static const char *NO = "N";
+static const char *NONE = "None";
 
 #define _DEVS		"DEVS"
 #define _POOLS		"POOLS"
@@ -164,6 +165,7 @@ static const char *NO = "N";
 #define _STATUS		"STATUS"
 #define _VERSION	"VERSION"
 #define _MINECON	"CONFIG"
+#define _PROXY		"PROXY"
 
 #ifdef WANT_CPUMINE
 #define _CPU		"CPU"
@@ -188,6 +190,7 @@ static const char ISJSON = '{';
 #define JSON_STATUS	JSON1 _STATUS JSON2
 #define JSON_VERSION	JSON1 _VERSION JSON2
 #define JSON_MINECON	JSON1 _MINECON JSON2
+#define JSON_PROXY	JSON1 _PROXY JSON2
 #define JSON_GPU	JSON1 _GPU JSON2
 
 #ifdef WANT_CPUMINE
@@ -251,6 +254,8 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_MISFN 42
 #define MSG_BADFN 43
 #define MSG_SAVED 44
+#define MSG_CLIENTS 45
+#define MSG_NOCLIENTS 46
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -267,6 +272,7 @@ enum code_parameters {
 	PARAM_CPUMAX,
 	PARAM_PMAX,
 	PARAM_POOLMAX,
+	PARAM_CLIENTS,
 #ifdef WANT_CPUMINE
 	PARAM_GCMAX,
 #else
@@ -336,6 +342,8 @@ struct CODES {
  { SEVERITY_ERR,   MSG_MISFN,	PARAM_NONE,	"Missing save filename parameter" },
  { SEVERITY_ERR,   MSG_BADFN,	PARAM_STR,	"Can't open or create save file '%s'" },
  { SEVERITY_ERR,   MSG_SAVED,	PARAM_STR,	"Configuration saved to file '%s'" },
+ { SEVERITY_SUCC,  MSG_CLIENTS,	PARAM_CLIENTS,	"%d Proxy client(s)" },
+ { SEVERITY_ERR,   MSG_NOCLIENTS,	PARAM_NONE,	"No proxy clients" },
  { SEVERITY_FAIL }
 };
 
@@ -345,6 +353,30 @@ static bool ping = true;
 // All replies (except BYE) start with a message
 //  thus for JSON, message() inserts JSON_START at the front
 //  and send_result() adds JSON_END at the end
+/*
+ * Copy str to buf escaping the characters that would break the reply:
+ * quotes and backslashes in JSON, the field separators otherwise.
+ * Control characters are replaced outright
+ */
+static char *escape_string(char *buf, size_t size, const char *str, bool isjson)
+{
+	char *ptr = buf;
+
+	for (; *str && ptr + 2 < buf + size; str++) {
+		if ((unsigned char)*str < ' ') {
+			*ptr++ = '?';
+			continue;
+		}
+		if (isjson ? (*str == '"' || *str == '\\') :
+			     (*str == ',' || *str == '=' || *str == SEPARATOR || *str == '\\'))
+			*ptr++ = '\\';
+		*ptr++ = *str;
+	}
+	*ptr = '\0';
+
+	return buf;
+}
+
 static char *message(int messageid, int paramid, char *param2, bool isjson)
 {
 	char severity;
@@ -396,6 +428,9 @@ static char *message(int messageid, int paramid, char *param2, bool isjson)
 			case PARAM_POOLMAX:
 				sprintf(ptr, codes[i].description, paramid, total_pools - 1);
 				break;
+			case PARAM_CLIENTS:
+				sprintf(ptr, codes[i].description, total_proxy_clients);
+				break;
 #ifdef WANT_CPUMINE
 			case PARAM_GCMAX:
 				if (opt_n_threads > 0)
@@ -681,7 +716,9 @@ static void cpudev(SOCKETTYPE c, char *param, bool isjson)
 static void poolstatus(SOCKETTYPE c, char *param, bool isjson)
 {
 	char buf[BUFSIZ];
-	char *status, *lp;
+	char *status, *lp, *stratum;
+	char getlat[RPC_LAT_BUCKETS * 11], sublat[RPC_LAT_BUCKETS * 11];
+	size_t len;
 	int i;
 
 	if (total_pools == 0) {
@@ -696,6 +733,7 @@ static void poolstatus(SOCKETTYPE c, char *param, bool isjson)
 		strcat(io_buffer, JSON_POOLS);
 	}
 
+	len = strlen(io_buffer);
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
 
@@ -713,8 +751,16 @@ static void poolstatus(SOCKETTYPE c, char *param, bool isjson)
 		else
 			lp = (char *)NO;
 
+		if (pool->stratum_active)
+			stratum = (char *)YES;
+		else
+			stratum = (char *)NO;
+
+		rpc_stats_str(getlat, &pool->getwork_stats);
+		rpc_stats_str(sublat, &pool->submit_stats);
+
 		if (isjson)
-			sprintf(buf, "%s{\"POOL\":%d,\"URL\":\"%s\",\"Status\":\"%s\",\"Priority\":%d,\"Long Poll\":\"%s\",\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Remote Failures\":%d}",
+			snprintf(buf, sizeof(buf), "%s{\"POOL\":%d,\"URL\":\"%s\",\"Status\":\"%s\",\"Priority\":%d,\"Long Poll\":\"%s\",\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Remote Failures\":%d,\"Connections Reused\":%u,\"Fresh Connections\":%u,\"Request Queue\":%d,\"Requests In Flight\":%d,\"Getwork Batches\":%u,\"Submit Batches\":%u,\"Stratum Active\":\"%s\",\"Stratum Jobs\":%u,\"GBT Templates\":%u,\"Getwork Latency\":\"%s\",\"Getwork Errors\":%u,\"Submit Latency\":\"%s\",\"Submit Errors\":%u,\"Spool Depth\":%u,\"Spooled\":%u,\"Spool Replayed\":%u,\"Spool Dropped\":%u,\"Blocks Announced\":%u,\"Blocks First\":%u,\"Announce Lag\":%.0f,\"Getwork Throttle\":%.0f,\"Submit Throttle\":%.0f,\"Probe Throttle\":%.0f,\"Probes\":%u,\"Probe Latency\":%.0f,\"Probe Result\":\"%s\"}",
 				(i > 0) ? COMMA : "",
 				i, pool->rpc_url, status, pool->prio, lp,
 				pool->getwork_requested,
@@ -722,19 +768,99 @@ static void poolstatus(SOCKETTYPE c, char *param, bool isjson)
 				pool->discarded_work,
 				pool->stale_shares,
 				pool->getfail_occasions,
-				pool->remotefail_occasions);
+				pool->remotefail_occasions,
+				pool->curl_reused, pool->curl_fresh,
+				pool->workio_queued, pool->workio_inflight,
+				pool->getwork_batches,
+				pool->submit_batches,
+				stratum, pool->stratum_jobs,
+				pool->gbt_templates,
+				getlat, pool->getwork_stats.errors, sublat, pool->submit_stats.errors,
+				pool->spool_tail - pool->spool_head, pool->spooled, pool->spool_replayed, pool->spool_dropped,
+				pool->blocks_announced, pool->blocks_first, pool->blocks_announced ? pool->announce_lag / pool->blocks_announced : 0.0,
+				pool->net[NET_GETWORK].throttled, pool->net[NET_SUBMIT].throttled, pool->net[NET_PROBE].throttled,
+				pool->probes, pool->probe_ms, pool->probes ? (pool->probe_ok ? ALIVE : DEAD) : NONE);
 		else
-			sprintf(buf, "POOL=%d,URL=%s,Status=%s,Priority=%d,Long Poll=%s,Getworks=%d,Accepted=%d,Rejected=%d,Discarded=%d,Stale=%d,Get Failures=%d,Remote Failures=%d%c",
+			snprintf(buf, sizeof(buf), "POOL=%d,URL=%s,Status=%s,Priority=%d,Long Poll=%s,Getworks=%d,Accepted=%d,Rejected=%d,Discarded=%d,Stale=%d,Get Failures=%d,Remote Failures=%d,Connections Reused=%u,Fresh Connections=%u,Request Queue=%d,Requests In Flight=%d,Getwork Batches=%u,Submit Batches=%u,Stratum Active=%s,Stratum Jobs=%u,GBT Templates=%u,Getwork Latency=%s,Getwork Errors=%u,Submit Latency=%s,Submit Errors=%u,Spool Depth=%u,Spooled=%u,Spool Replayed=%u,Spool Dropped=%u,Blocks Announced=%u,Blocks First=%u,Announce Lag=%.0f,Getwork Throttle=%.0f,Submit Throttle=%.0f,Probe Throttle=%.0f,Probes=%u,Probe Latency=%.0f,Probe Result=%s%c",
 				i, pool->rpc_url, status, pool->prio, lp,
 				pool->getwork_requested,
 				pool->accepted, pool->rejected,
 				pool->discarded_work,
 				pool->stale_shares,
 				pool->getfail_occasions,
-				pool->remotefail_occasions, SEPARATOR);
+				pool->remotefail_occasions,
+				pool->curl_reused, pool->curl_fresh,
+				pool->workio_queued, pool->workio_inflight,
+				pool->getwork_batches,
+				pool->submit_batches,
+				stratum, pool->stratum_jobs,
+				pool->gbt_templates,
+				getlat, pool->getwork_stats.errors, sublat, pool->submit_stats.errors,
+				pool->spool_tail - pool->spool_head, pool->spooled, pool->spool_replayed, pool->spool_dropped,
+				pool->blocks_announced, pool->blocks_first, pool->blocks_announced ? pool->announce_lag / pool->blocks_announced : 0.0,
+				pool->net[NET_GETWORK].throttled, pool->net[NET_SUBMIT].throttled, pool->net[NET_PROBE].throttled,
+				pool->probes, pool->probe_ms, pool->probes ? (pool->probe_ok ? ALIVE : DEAD) : NONE, SEPARATOR);
+
+		/* Leave room for the closing of the reply */
+		if (len + strlen(buf) + 16 > MYBUFSIZ)
+			break;
+		strcat(io_buffer, buf);
+		len += strlen(buf);
+	}
 
+	if (isjson)
+		strcat(io_buffer, JSON_CLOSE);
+}
+
+static void proxystatus(SOCKETTYPE c, char *param, bool isjson)
+{
+	struct proxy_client *client;
+	char name[sizeof(client->name) * 2], addr[sizeof(client->addr) * 2];
+	char buf[BUFSIZ];
+	size_t len;
+
+	mutex_lock(&proxy_lock);
+	if (total_proxy_clients == 0) {
+		mutex_unlock(&proxy_lock);
+		strcpy(io_buffer, message(MSG_NOCLIENTS, 0, NULL, isjson));
+		return;
+	}
+
+	strcpy(io_buffer, message(MSG_CLIENTS, 0, NULL, isjson));
+
+	if (isjson) {
+		strcat(io_buffer, COMMA);
+		strcat(io_buffer, JSON_PROXY);
+	}
+
+	len = strlen(io_buffer);
+	for (client = proxy_clients; client; client = client->next) {
+		escape_string(name, sizeof(name), client->name, isjson);
+		escape_string(addr, sizeof(addr), client->addr, isjson);
+
+		if (isjson)
+			sprintf(buf, "%s{\"CLIENT\":%d,\"Name\":\"%s\",\"Address\":\"%s\",\"Getworks\":%u,\"Longpolls\":%u,\"Submits\":%u,\"Accepted\":%u,\"Rejected\":%u,\"Stale\":%u,\"Invalid\":%u,\"Last Seen\":%lu}",
+				client == proxy_clients ? "" : COMMA,
+				client->id, name, addr,
+				client->getworks, client->longpolls, client->submits,
+				client->accepted, client->rejected,
+				client->stale, client->invalid,
+				(unsigned long)client->last_seen);
+		else
+			sprintf(buf, "CLIENT=%d,Name=%s,Address=%s,Getworks=%u,Longpolls=%u,Submits=%u,Accepted=%u,Rejected=%u,Stale=%u,Invalid=%u,Last Seen=%lu%c",
+				client->id, name, addr,
+				client->getworks, client->longpolls, client->submits,
+				client->accepted, client->rejected,
+				client->stale, client->invalid,
+				(unsigned long)client->last_seen, SEPARATOR);
+
+		/* Leave room for the closing of the reply */
+		if (len + strlen(buf) + 16 > MYBUFSIZ)
+			break;
 		strcat(io_buffer, buf);
+		len += strlen(buf);
 	}
+	mutex_unlock(&proxy_lock);
 
 	if (isjson)
 		strcat(io_buffer, JSON_CLOSE);
@@ -755,34 +881,62 @@ static void summary(SOCKETTYPE c, char *param, bool isjson)
 
 #ifdef WANT_CPUMINE
 	if (isjson)
-		sprintf(io_buffer, "%s," JSON_SUMMARY "{\"Elapsed\":%.0f,\"Algorithm\":\"%s\",\"MHS av\":%.2f,\"Found Blocks\":%d,\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Hardware Errors\":%d,\"Utility\":%.2f,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Local Work\":%u,\"Remote Failures\":%u,\"Network Blocks\":%u}" JSON_CLOSE,
+		sprintf(io_buffer, "%s," JSON_SUMMARY "{\"Elapsed\":%.0f,\"Algorithm\":\"%s\",\"MHS av\":%.2f,\"Found Blocks\":%d,\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Hardware Errors\":%d,\"Utility\":%.2f,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Local Work\":%u,\"Remote Failures\":%u,\"Network Blocks\":%u,\"Request Queue\":%d,\"Requests In Flight\":%d,\"Queue Depth\":%d,\"Starvation Avoided\":%u,\"Hedged Getworks\":%u,\"Hedge Rescues\":%u,\"Pool Switches\":%u,\"Switch Gap\":%.0f,\"Device Idle\":%.0f,\"Work Allocs\":%lu,\"Work In Use\":%lu,\"Work Slabs\":%u,\"Cmd Allocs\":%lu,\"Cmd In Use\":%lu,\"Cmd Slabs\":%u}" JSON_CLOSE,
 			message(MSG_SUMM, 0, NULL, isjson),
 			total_secs, algo, mhs, found_blocks,
 			total_getworks, total_accepted, total_rejected,
 			hw_errors, utility, total_discarded, total_stale,
-			total_go, local_work, total_ro, new_blocks);
+			total_go, local_work, total_ro, new_blocks,
+			total_workio_queued, total_workio_inflight,
+			queue_depth, starvation_averted,
+			total_hedged, hedge_rescues,
+			pool_switches, pool_switches ? switch_idle / pool_switches : 0.0,
+			device_idle,
+			work_slab.allocs, work_slab.allocs - work_slab.frees, work_slab.slabs,
+			workio_slab.allocs, workio_slab.allocs - workio_slab.frees, workio_slab.slabs);
 	else
-		sprintf(io_buffer, "%s" _SUMMARY ",Elapsed=%.0f,Algorithm=%s,MHS av=%.2f,Found Blocks=%d,Getworks=%d,Accepted=%d,Rejected=%d,Hardware Errors=%d,Utility=%.2f,Discarded=%d,Stale=%d,Get Failures=%d,Local Work=%u,Remote Failures=%u,Network Blocks=%u%c",
+		sprintf(io_buffer, "%s" _SUMMARY ",Elapsed=%.0f,Algorithm=%s,MHS av=%.2f,Found Blocks=%d,Getworks=%d,Accepted=%d,Rejected=%d,Hardware Errors=%d,Utility=%.2f,Discarded=%d,Stale=%d,Get Failures=%d,Local Work=%u,Remote Failures=%u,Network Blocks=%u,Request Queue=%d,Requests In Flight=%d,Queue Depth=%d,Starvation Avoided=%u,Hedged Getworks=%u,Hedge Rescues=%u,Pool Switches=%u,Switch Gap=%.0f,Device Idle=%.0f,Work Allocs=%lu,Work In Use=%lu,Work Slabs=%u,Cmd Allocs=%lu,Cmd In Use=%lu,Cmd Slabs=%u%c",
 			message(MSG_SUMM, 0, NULL, isjson),
 			total_secs, algo, mhs, found_blocks,
 			total_getworks, total_accepted, total_rejected,
 			hw_errors, utility, total_discarded, total_stale,
-			total_go, local_work, total_ro, new_blocks, SEPARATOR);
+			total_go, local_work, total_ro, new_blocks,
+			total_workio_queued, total_workio_inflight,
+			queue_depth, starvation_averted,
+			total_hedged, hedge_rescues,
+			pool_switches, pool_switches ? switch_idle / pool_switches : 0.0,
+			device_idle,
+			work_slab.allocs, work_slab.allocs - work_slab.frees, work_slab.slabs,
+			workio_slab.allocs, workio_slab.allocs - workio_slab.frees, workio_slab.slabs, SEPARATOR);
 #else
 	if (isjson)
-		sprintf(io_buffer, "%s," JSON_SUMMARY "{\"Elapsed\":%.0f,\"MHS av\":%.2f,\"Found Blocks\":%d,\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Hardware Errors\":%d,\"Utility\":%.2f,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Local Work\":%u,\"Remote Failures\":%u,\"Network Blocks\":%u}" JSON_CLOSE,
+		sprintf(io_buffer, "%s," JSON_SUMMARY "{\"Elapsed\":%.0f,\"MHS av\":%.2f,\"Found Blocks\":%d,\"Getworks\":%d,\"Accepted\":%d,\"Rejected\":%d,\"Hardware Errors\":%d,\"Utility\":%.2f,\"Discarded\":%d,\"Stale\":%d,\"Get Failures\":%d,\"Local Work\":%u,\"Remote Failures\":%u,\"Network Blocks\":%u,\"Request Queue\":%d,\"Requests In Flight\":%d,\"Queue Depth\":%d,\"Starvation Avoided\":%u,\"Hedged Getworks\":%u,\"Hedge Rescues\":%u,\"Pool Switches\":%u,\"Switch Gap\":%.0f,\"Device Idle\":%.0f,\"Work Allocs\":%lu,\"Work In Use\":%lu,\"Work Slabs\":%u,\"Cmd Allocs\":%lu,\"Cmd In Use\":%lu,\"Cmd Slabs\":%u}" JSON_CLOSE,
 			message(MSG_SUMM, 0, NULL, isjson),
 			total_secs, mhs, found_blocks,
 			total_getworks, total_accepted, total_rejected,
 			hw_errors, utility, total_discarded, total_stale,
-			total_go, local_work, total_ro, new_blocks);
+			total_go, local_work, total_ro, new_blocks,
+			total_workio_queued, total_workio_inflight,
+			queue_depth, starvation_averted,
+			total_hedged, hedge_rescues,
+			pool_switches, pool_switches ? switch_idle / pool_switches : 0.0,
+			device_idle,
+			work_slab.allocs, work_slab.allocs - work_slab.frees, work_slab.slabs,
+			workio_slab.allocs, workio_slab.allocs - workio_slab.frees, workio_slab.slabs);
 	else
-		sprintf(io_buffer, "%s" _SUMMARY ",Elapsed=%.0f,MHS av=%.2f,Found Blocks=%d,Getworks=%d,Accepted=%d,Rejected=%d,Hardware Errors=%d,Utility=%.2f,Discarded=%d,Stale=%d,Get Failures=%d,Local Work=%u,Remote Failures=%u,Network Blocks=%u%c",
+		sprintf(io_buffer, "%s" _SUMMARY ",Elapsed=%.0f,MHS av=%.2f,Found Blocks=%d,Getworks=%d,Accepted=%d,Rejected=%d,Hardware Errors=%d,Utility=%.2f,Discarded=%d,Stale=%d,Get Failures=%d,Local Work=%u,Remote Failures=%u,Network Blocks=%u,Request Queue=%d,Requests In Flight=%d,Queue Depth=%d,Starvation Avoided=%u,Hedged Getworks=%u,Hedge Rescues=%u,Pool Switches=%u,Switch Gap=%.0f,Device Idle=%.0f,Work Allocs=%lu,Work In Use=%lu,Work Slabs=%u,Cmd Allocs=%lu,Cmd In Use=%lu,Cmd Slabs=%u%c",
 			message(MSG_SUMM, 0, NULL, isjson),
 			total_secs, mhs, found_blocks,
 			total_getworks, total_accepted, total_rejected,
 			hw_errors, utility, total_discarded, total_stale,
-			total_go, local_work, total_ro, new_blocks, SEPARATOR);
+			total_go, local_work, total_ro, new_blocks,
+			total_workio_queued, total_workio_inflight,
+			queue_depth, starvation_averted,
+			total_hedged, hedge_rescues,
+			pool_switches, pool_switches ? switch_idle / pool_switches : 0.0,
+			device_idle,
+			work_slab.allocs, work_slab.allocs - work_slab.frees, work_slab.slabs,
+			workio_slab.allocs, workio_slab.allocs - workio_slab.frees, workio_slab.slabs, SEPARATOR);
 #endif
 }
 
@@ -1140,6 +1294,7 @@ struct CMDS {
 	{ "config",		minerconfig },
 	{ "devs",		devstatus },
 	{ "pools",		poolstatus },
+	{ "proxy",		proxystatus },
 	{ "summary",		summary },
 	{ "gpuenable",		gpuenable },
 	{ "gpudisable",		gpudisable },
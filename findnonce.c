@@ -204,8 +204,8 @@ static void send_nonce(struct pc_data *pcd, cl_uint nonce)
 	} else {
 		if (opt_debug)
 			applog(LOG_DEBUG, "No best_g found! Error in OpenCL code?");
-		hw_errors++;
-		thr->cgpu->hw_errors++;
+		stat_inc(hw_errors);
+		stat_inc(thr->cgpu->hw_errors);
 	}
 }
 
@@ -224,13 +224,14 @@ static void *postcalc_hash(void *userdata)
 		}
 	} while (++entry < FOUND);
 
+	slab_free(&work_slab, pcd->work);
 	free(pcd);
 
 	if (unlikely(!nonces)) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "No nonces found! Error in OpenCL code?");
-		hw_errors++;
-		thr->cgpu->hw_errors++;
+		stat_inc(hw_errors);
+		stat_inc(thr->cgpu->hw_errors);
 	}
 
 	return NULL;
@@ -243,11 +244,7 @@ void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
 		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_hash_async");
 		return;
 	}
-	pcd->work = calloc(1, sizeof(struct work));
-	if (unlikely(!pcd->work)) {
-		applog(LOG_ERR, "Failed to malloc work in postcalc_hash_async");
-		return;
-	}
+	pcd->work = slab_alloc(&work_slab);
 
 	pcd->thr = thr;
 	memcpy(pcd->work, work, sizeof(struct work));
@@ -98,6 +98,32 @@ struct workio_cmd {
 		struct work	*work;
 	} u;
 	bool			lagging;
+
+	/* State while the workio event loop services the command */
+	struct list_head	list;
+	/* Further getworks sharing this command's batch request */
+	struct list_head	batch;
+	struct pool		*pool;
+	struct curl_ent		*ce;
+	struct rpc_transfer	*rt;
+	char			*rpc_req;
+	struct timeval		tv_due;
+	struct timeval		tv_start;
+	/* A share being replayed from its pool's spool, and its slot there */
+	bool			spooled;
+	unsigned int		spool_slot;
+	bool			fresh;
+	int			attempts;
+	int			failures;
+	/* Getworks in flight, when a duplicate goes to another pool if this
+	 * one is slow, and the duplicate and original of a hedged pair */
+	struct list_head	running;
+	struct timeval		tv_hedge;
+	bool			hedge;
+	bool			hedged;
+	struct workio_cmd	*partner;
+	/* A prefetch from the pool the next switch will move to */
+	bool			warm;
 };
 
 struct strategies strategies[] = {
@@ -105,6 +131,7 @@ struct strategies strategies[] = {
 	{ "Round Robin" },
 	{ "Rotate" },
 	{ "Load Balance" },
+	{ "Latency" },
 };
 
 #ifdef WANT_CPUMINE
@@ -176,7 +203,12 @@ static bool opt_realquiet = false;
 static bool opt_loginput = false;
 static int opt_retries = -1;
 static int opt_fail_pause = 5;
+int opt_fail_detect;
 static int fail_pause = 5;
+static int opt_pool_inflight = 8;
+static int opt_getwork_batch;
+static int opt_submit_batch;
+static int opt_submit_window = 50;
 int opt_log_interval = 5;
 bool opt_log_output = false;
 static int opt_queue = 1;
@@ -219,6 +251,7 @@ int mining_threads;
 int num_processors;
 bool use_curses = true;
 static bool opt_submit_stale;
+static int opt_hedge = 95;
 static int opt_shares;
 static bool opt_fail_only;
 bool opt_autofan;
@@ -230,6 +263,9 @@ bool opt_api_listen = false;
 bool opt_api_listen_v4 = false;
 bool opt_api_listen_v6 = false;
 bool opt_api_network = false;
+bool opt_proxy_listen = false;
+bool opt_proxy_network = false;
+int opt_proxy_port = 8330;
 bool opt_delaynet = false;
 
 char *opt_kernel_path;
@@ -245,16 +281,16 @@ static int watchdog_thr_id;
 static int input_thr_id;
 static int gpur_thr_id;
 static int api_thr_id;
+static int proxy_thr_id;
+static int probe_thr_id;
 static int total_threads;
 
 struct work_restart *work_restart = NULL;
 
 static pthread_mutex_t hash_lock;
-static pthread_mutex_t qd_lock;
 static pthread_mutex_t *stgd_lock;
 static pthread_mutex_t curses_lock;
 static pthread_rwlock_t blk_lock;
-pthread_rwlock_t netacc_lock;
 
 double total_mhashes_done;
 static struct timeval total_tv_start, total_tv_end;
@@ -264,7 +300,39 @@ pthread_mutex_t control_lock;
 int hw_errors;
 int total_accepted, total_rejected;
 int total_getworks, total_stale, total_discarded;
+int total_workio_queued, total_workio_inflight;
 static int total_queued;
+/* Work items to keep queued as set by the adaptive controller, never less
+ * than --queue, and the times a thread found work that only the extra depth
+ * had fetched */
+int queue_depth = 1;
+unsigned int total_hedged, hedge_rescues;
+static int getwork_waiting;
+/* Scans made while lock acquisitions are counted */
+static unsigned long lock_scans;
+
+/* Work prefetched from warm_pool ahead of switching to it, held back until
+ * the switch. Under control_lock */
+#define WARM_SECS 10
+static struct pool *warm_pool;
+static struct work *warm_work;
+/* Pool switches, and the ms devices waited for work after them until each
+ * mining thread has had work from the new pool. Under control_lock */
+unsigned int pool_switches;
+double switch_idle;
+static struct timeval tv_switched;
+static int switch_pops;
+static bool switch_settling;
+/* The ms devices have waited for work in all, and from longpolls announcing
+ * new blocks to a device having work on the new block. Under control_lock */
+double device_idle;
+static struct timeval tv_lp_block;
+static bool lp_restarting;
+static double restart_lag;
+static unsigned int restarts_timed;
+unsigned int starvation_averted;
+/* Decaying fraction of fetched work that could be rolled */
+static double roll_frac;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -281,7 +349,8 @@ static struct pool donationpool;
 int total_pools;
 enum pool_strategy pool_strategy = POOL_FAILOVER;
 int opt_rotate_period;
-static int total_urls, total_users, total_passes, total_userpasses;
+static int total_urls, total_users, total_passes, total_userpasses, total_net_rates;
+static int total_probe_times;
 
 static bool curses_active = false;
 
@@ -292,6 +361,9 @@ static char blocktime[30];
 
 struct block {
 	char hash[37];
+	/* When the block was first seen and the pools that have announced it */
+	struct timeval first_seen;
+	uint32_t announced;
 	UT_hash_handle hh;
 };
 
@@ -299,12 +371,17 @@ static struct block *blocks = NULL;
 
 static char *opt_kernel = NULL;
 char *opt_socks_proxy = NULL;
+static char *opt_btc_address = NULL;
+unsigned char btc_script[25];
+size_t btc_script_len;
 
 static const char def_conf[] = "cgminer.conf";
 static bool config_loaded = false;
 
 #if defined(unix)
 	static char *opt_stderr_cmd = NULL;
+	static char *opt_spool_dir = NULL;
+	static int opt_spool_size = 1024;
 #endif // defined(unix)
 
 enum cl_kernel chosen_kernel;
@@ -316,8 +393,43 @@ struct sigaction termhandler, inthandler;
 struct thread_q *getq;
 
 static int total_work;
-struct work *staged_work = NULL;
-static int staged_clones;
+struct slab_cache work_slab, workio_slab;
+
+/* Staged work is kept in binary heaps ordered by when it was staged, with
+ * the oldest or the freshest on top as --staged-order says. Work from the
+ * donation pool has a heap of its own so a new block can drop all the rest
+ * at once. Under stgd_lock */
+enum staged_order {
+	STAGED_OLDEST,
+	STAGED_FRESHEST,
+};
+
+struct staged_heap {
+	struct work **work;
+	int count, size;
+	int clones;
+};
+
+static enum staged_order opt_staged_order = STAGED_OLDEST;
+static struct staged_heap staged, staged_donor;
+
+/* Each mining thread also keeps a few staged works of its own in a
+ * Chase-Lev deque, so most get_works take no lock at all. The thread
+ * pushes and takes at the bottom, refilling in batches from the heaps and
+ * keeping the work it rolls, while idle threads steal from the top */
+#define CACHE_SIZE 16
+#define CACHE_BATCH 8
+
+struct work_cache {
+	long top;
+	char pad[64];
+	long bottom;
+	struct work *work[CACHE_SIZE];
+};
+
+static struct work_cache *work_caches;
+/* Work in the heaps and the caches, read without stgd_lock */
+static int total_staged;
 
 struct schedtime {
 	bool enable;
@@ -420,10 +532,15 @@ static void add_pool(void)
 	}
 	pool->pool_no = pool->prio = total_pools;
 	pools[total_pools++] = pool;
-	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL))) {
+	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL) ||
+		     pthread_mutex_init(&pool->stratum_lock, NULL) ||
+		     pthread_cond_init(&pool->gbt_cond, NULL) ||
+		     pthread_mutex_init(&pool->send_lock, NULL))) {
 		applog(LOG_ERR, "Failed to pthread_mutex_init in add_pool");
 		exit (1);
 	}
+	pool->sock = CURL_SOCKET_BAD;
+	setup_pool_curl(pool);
 	/* Make sure the pool doesn't think we've been idle since time 0 */
 	pool->tv_idle.tv_sec = ~0UL;
 }
@@ -461,14 +578,74 @@ static bool pool_isset(struct pool *pool, bool *var)
 	return ret;
 }
 
+/* Add a new curl handle to the pool's ring, must be called with pool_lock
+ * held */
+static void recruit_curl(struct pool *pool)
+{
+	struct curl_ent *ce = calloc(sizeof(struct curl_ent), 1);
+
+	if (unlikely(!ce))
+		quit(1, "Failed to calloc in recruit_curl");
+
+	ce->curl = pool_curl_init(pool);
+	if (unlikely(!ce->curl))
+		quit(1, "Failed to init curl in recruit_curl");
+
+	list_add(&ce->node, &pool->curlring);
+	pool->curls++;
+	if (opt_debug)
+		applog(LOG_DEBUG, "Recruited curl %d for pool %d", pool->curls, pool->pool_no);
+}
+
+/* Grab an available curl handle for this pool, creating one if there are
+ * none free and we are below the limit, otherwise wait for one to be
+ * returned. Handles are kept for the life of the pool so their connections
+ * and template options are reused. The workio event loop must never block
+ * and bounds its own usage with --pool-inflight so it never waits. */
+static struct curl_ent *pop_curl_entry(struct pool *pool, bool blocking)
+{
+	int curl_limit = (mining_threads + opt_queue) * 2;
+	struct curl_ent *ce;
+
+	if (curl_limit < 2)
+		curl_limit = 2;
+
+	mutex_lock(&pool->pool_lock);
+	while (list_empty(&pool->curlring)) {
+		if (pool->curls < curl_limit || !blocking)
+			recruit_curl(pool);
+		else
+			pthread_cond_wait(&pool->cr_cond, &pool->pool_lock);
+	}
+	ce = list_entry(pool->curlring.next, struct curl_ent, node);
+	list_del(&ce->node);
+	mutex_unlock(&pool->pool_lock);
+
+	return ce;
+}
+
+/* Return the most recently used handle to the head of the ring so it is
+ * the first one picked up again */
+static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
+{
+	mutex_lock(&pool->pool_lock);
+	list_add(&ce->node, &pool->curlring);
+	pthread_cond_signal(&pool->cr_cond);
+	mutex_unlock(&pool->pool_lock);
+}
+
+/* currentpool is only changed under control_lock but is published with a
+ * release store, so the many threads that only want to know which pool is
+ * current can read it without taking the lock. Pools are never freed while
+ * mining, so the pointer stays valid however stale it is */
 static struct pool *current_pool(void)
 {
-	struct pool *pool;
+	return __atomic_load_n(&currentpool, __ATOMIC_ACQUIRE);
+}
 
-	mutex_lock(&control_lock);
-	pool = currentpool;
-	mutex_unlock(&control_lock);
-	return pool;
+static void set_current_pool(struct pool *pool)
+{
+	__atomic_store_n(&currentpool, pool, __ATOMIC_RELEASE);
 }
 
 #ifdef WANT_CPUMINE
@@ -987,6 +1164,11 @@ static char *set_int_1_to_10(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 10);
 }
 
+static char *set_int_0_to_99(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 99);
+}
+
 static char *set_float_0_to_99(const char *arg, float *f)
 {
 	char *err = opt_set_floatval(arg, f);
@@ -1028,6 +1210,12 @@ static char *set_loadbalance(enum pool_strategy *strategy)
 	return NULL;
 }
 
+static char *set_latency(enum pool_strategy *strategy)
+{
+	*strategy = POOL_LATENCY;
+	return NULL;
+}
+
 static char *set_rotate(const char *arg, int *i)
 {
 	pool_strategy = POOL_ROTATE;
@@ -1040,6 +1228,32 @@ static char *set_rr(enum pool_strategy *strategy)
 	return NULL;
 }
 
+/* Stratum pools are given as stratum+tcp://host:port, curl is only used to
+ * make the connection so it gets an http:// URL for the same host */
+static bool detect_stratum(struct pool *pool, char *url)
+{
+	if (strncasecmp(url, "stratum+tcp://", 14))
+		return false;
+
+	pool->has_stratum = true;
+	pool->stratum_url = malloc(strlen(url + 14) + 8);
+	if (unlikely(!pool->stratum_url))
+		quit(1, "Failed to malloc stratum_url");
+	sprintf(pool->stratum_url, "http://%s", url + 14);
+	return true;
+}
+
+/* Solo mining pays blocks to this address, checked here so a typo can't
+ * cost a block */
+static char *set_btc_address(char *arg)
+{
+	btc_script_len = address_to_script(btc_script, arg);
+	if (!btc_script_len)
+		return "Invalid bitcoin address";
+	opt_set_charp(arg, &opt_btc_address);
+	return NULL;
+}
+
 static char *set_url(char *arg)
 {
 	struct pool *pool;
@@ -1050,6 +1264,8 @@ static char *set_url(char *arg)
 	pool = pools[total_urls - 1];
 
 	opt_set_charp(arg, &pool->rpc_url);
+	if (detect_stratum(pool, arg))
+		return NULL;
 	if (strncmp(arg, "http://", 7) &&
 	    strncmp(arg, "https://", 8)) {
 		char *httpinput;
@@ -1113,6 +1329,70 @@ static char *set_userpass(const char *arg)
 	return NULL;
 }
 
+static char *set_staged_order(const char *arg)
+{
+	if (!strcasecmp(arg, "oldest"))
+		opt_staged_order = STAGED_OLDEST;
+	else if (!strcasecmp(arg, "freshest"))
+		opt_staged_order = STAGED_FRESHEST;
+	else
+		return "Invalid value passed to staged-order";
+	return NULL;
+}
+
+static char *set_net_capture(const char *arg)
+{
+	if (!capture_open(arg))
+		return "Failed to open net-capture file";
+	return NULL;
+}
+
+/* Requests per second as getwork[:submit[:probe]], missing classes taking
+ * the last rate given and 0 meaning unlimited */
+static char *set_net_rate(const char *arg)
+{
+	double rate[NET_CLASSES];
+	struct pool *pool;
+	int i, n;
+
+	n = sscanf(arg, "%lf:%lf:%lf", &rate[NET_GETWORK], &rate[NET_SUBMIT], &rate[NET_PROBE]);
+	if (n < 1)
+		return "Invalid net rate, should be getwork[:submit[:probe]]";
+	for (i = 0; i < NET_CLASSES; i++) {
+		if (i >= n)
+			rate[i] = rate[n - 1];
+		if (rate[i] < 0)
+			return "Invalid negative net rate";
+	}
+	total_net_rates++;
+	if (total_net_rates > total_pools)
+		add_pool();
+
+	pool = pools[total_net_rates - 1];
+	for (i = 0; i < NET_CLASSES; i++)
+		pool->net[i].rate = rate[i];
+	pool->net_rate_set = true;
+
+	return NULL;
+}
+
+static char *set_probe_time(const char *arg)
+{
+	struct pool *pool;
+	int val;
+
+	if (sscanf(arg, "%d", &val) != 1 || val < 1 || val > 60000)
+		return "Invalid probe time, should be 1 - 60000 ms";
+	total_probe_times++;
+	if (total_probe_times > total_pools)
+		add_pool();
+
+	pool = pools[total_probe_times - 1];
+	pool->probe_time = val;
+
+	return NULL;
+}
+
 #ifdef HAVE_OPENCL
 static char *set_vector(const char *arg, int *i)
 {
@@ -1552,6 +1832,9 @@ static struct opt_table opt_config_table[] = {
 			opt_set_bool, &opt_autoengine,
 			"Automatically adjust all GPU engine clock speeds to maintain a target temperature"),
 #endif
+	OPT_WITH_ARG("--btc-address",
+		     set_btc_address, NULL, NULL,
+		     "Bitcoin address to solo mine to with getblocktemplate on pools that offer it"),
 #ifdef WANT_CPUMINE
 	OPT_WITH_ARG("--bench-algo|-b",
 		     set_int_0_to_9999, opt_show_intval, &opt_bench_algo,
@@ -1584,6 +1867,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--expiry|-E",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry,
 		     "Upper bound on how many seconds after getting work we consider a share from it stale"),
+	OPT_WITH_ARG("--fail-detect",
+		     set_int_0_to_9999, opt_show_intval, &opt_fail_detect,
+		     "Milliseconds a pool may take to accept a connection for work before the request fails (0 = no limit)"),
+	OPT_WITH_ARG("--getwork-batch",
+		     set_int_0_to_9999, opt_show_intval, &opt_getwork_batch,
+		     "Maximum number of getwork requests to send as one JSON-RPC batch (0 = no batching)"),
+	OPT_WITH_ARG("--hedge",
+		     set_int_0_to_99, opt_show_intval, &opt_hedge,
+		     "Latency percentile of its pool after which a getwork is duplicated to the next pool while devices wait (0 disables)"),
 #ifdef HAVE_OPENCL
 	OPT_WITHOUT_ARG("--failover-only",
 			opt_set_bool, &opt_fail_only,
@@ -1621,6 +1913,9 @@ static struct opt_table opt_config_table[] = {
 		     opt_set_charp, NULL, &opt_kernel,
 		     "Select kernel to use (poclbm or phatk - default: auto)"),
 #endif
+	OPT_WITHOUT_ARG("--latency-balance",
+		     set_latency, &pool_strategy,
+		     "Change multipool strategy from failover to favouring the fastest, least stale pools"),
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to even load balance"),
@@ -1632,9 +1927,15 @@ static struct opt_table opt_config_table[] = {
 		     opt_set_charp, NULL, &opt_stderr_cmd,
 		     "Use custom pipe cmd for output messages"),
 #endif // defined(unix)
+	OPT_WITH_ARG("--net-capture",
+		     set_net_capture, NULL, NULL,
+		     "Record all pool traffic with its timing to a file, for replaying with mockpool -R"),
 	OPT_WITHOUT_ARG("--net-delay",
 			opt_set_bool, &opt_delaynet,
 			"Impose small delays in networking to not overload slow routers"),
+	OPT_WITH_ARG("--net-rate",
+		     set_net_rate, NULL, NULL,
+		     "Pool requests per second as getwork[:submit[:probe]], one value for each pool"),
 #ifdef HAVE_ADL
 	OPT_WITHOUT_ARG("--no-adl",
 			opt_set_bool, &opt_noadl,
@@ -1654,12 +1955,27 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--per-device-stats",
 			opt_set_bool, &want_per_device_stats,
 			"Force verbose mode and output per-device statistics"),
+	OPT_WITH_ARG("--pool-inflight",
+		     set_int_1_to_65535, opt_show_intval, &opt_pool_inflight,
+		     "Maximum number of network requests in flight to each pool"),
+	OPT_WITH_ARG("--probe-time",
+		     set_probe_time, NULL, NULL,
+		     "Milliseconds allowed for a pool's recovery probes, one value for each pool (default: 15000)"),
 	OPT_WITHOUT_ARG("--protocol-dump|-P",
 			opt_set_bool, &opt_protocol,
 			"Verbose dump of protocol-level activities"),
+	OPT_WITHOUT_ARG("--proxy-listen",
+			opt_set_bool, &opt_proxy_listen,
+			"Serve getwork and longpoll to other miners, passing their shares upstream"),
+	OPT_WITHOUT_ARG("--proxy-network",
+			opt_set_bool, &opt_proxy_network,
+			"Allow the getwork proxy (if enabled) to serve any address, default: only 127.0.0.1"),
+	OPT_WITH_ARG("--proxy-port",
+		     set_int_1_to_65535, opt_show_intval, &opt_proxy_port,
+		     "Port number of the getwork proxy"),
 	OPT_WITH_ARG("--queue|-Q",
 		     set_int_0_to_10, opt_show_intval, &opt_queue,
-		     "Minimum number of work items to have queued (0 - 10)"),
+		     "Minimum number of work items to have queued, more are kept as hashrate and pool latency require (0 - 10)"),
 	OPT_WITHOUT_ARG("--quiet|-q",
 			opt_set_bool, &opt_quiet,
 			"Disable logging output, display status and errors"),
@@ -1701,9 +2017,26 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+#if defined(unix)
+	OPT_WITH_ARG("--spool-dir",
+		     opt_set_charp, NULL, &opt_spool_dir,
+		     "Directory to keep shares in on disk while their pool cannot be reached"),
+	OPT_WITH_ARG("--spool-size",
+		     set_int_1_to_65535, opt_show_intval, &opt_spool_size,
+		     "Disk space in KB for the shares kept of each pool"),
+#endif // defined(unix)
+	OPT_WITH_ARG("--staged-order",
+		     set_staged_order, NULL, NULL,
+		     "Hand out the oldest or the freshest staged work first: oldest, freshest (default: oldest)"),
+	OPT_WITH_ARG("--submit-batch",
+		     set_int_0_to_9999, opt_show_intval, &opt_submit_batch,
+		     "Maximum number of shares to submit to a pool as one JSON-RPC batch (0 = no batching)"),
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
 		        "Submit shares even if they would normally be considered stale"),
+	OPT_WITH_ARG("--submit-window",
+		     set_int_0_to_9999, opt_show_intval, &opt_submit_window,
+		     "Milliseconds to gather shares for a batched submit"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1728,7 +2061,7 @@ static struct opt_table opt_config_table[] = {
 			"Disable ncurses formatted screen output"),
 	OPT_WITH_ARG("--url|-o",
 		     set_url, NULL, NULL,
-		     "URL for bitcoin JSON-RPC server"),
+		     "URL for bitcoin JSON-RPC server or stratum+tcp:// pool"),
 	OPT_WITH_ARG("--user|-u",
 		     set_user, NULL, NULL,
 		     "Username for bitcoin JSON-RPC server"),
@@ -1857,6 +2190,126 @@ static char *print_ndevs_and_exit(int *ndevs)
 }
 #endif
 
+static char *bench_hex_and_exit(void *unused)
+{
+	bench_hex();
+	fflush(stdout);
+	exit(0);
+}
+
+static char *bench_tq_and_exit(void *unused)
+{
+	bench_tq();
+	fflush(stdout);
+	exit(0);
+}
+
+#if defined(unix)
+/* --bench-failover mines on BENCH_POOLS local mock pools, taking down the
+ * one in use each round and timing how long until work comes from the
+ * next one */
+#define BENCH_POOLS 5
+static bool opt_bench_failover;
+static pthread_t bench_thread;
+
+/* The benchmarks' mock pools. Their ports are taken while the options are
+ * parsed, but they are only started once all options have parsed, so an
+ * error in a later one leaves nothing running */
+static int bench_fds[BENCH_POOLS], bench_mocks;
+static pid_t bench_pids[BENCH_POOLS];
+static struct mock_pool_opts bench_opts, *bench_popts;
+
+static char *bench_failover_pools(void *unused)
+{
+	char *url;
+	int i, port;
+
+	if (bench_mocks)
+		return "Only one benchmark can be run at a time";
+	for (i = 0; i < BENCH_POOLS; i++) {
+		port = 0;
+		bench_fds[i] = mock_pool_listen(&port);
+		if (bench_fds[i] < 0)
+			return "Failed to start mock pool";
+		bench_mocks++;
+		url = malloc(32);
+		if (unlikely(!url))
+			quit(1, "Failed to malloc url in bench_failover_pools");
+		sprintf(url, "http://127.0.0.1:%d", port);
+		set_url(url);
+		set_user("bench");
+		set_pass("bench");
+	}
+	opt_bench_failover = true;
+	return NULL;
+}
+
+/* --bench-pipeline mines on a local mock pool for a number of seconds, with
+ * the latency, jitter, failure rate, block interval and share difficulty in
+ * bits given after them, and reports how well work flowed from getwork
+ * through to shares */
+static int opt_bench_pipeline;
+
+static char *bench_pipeline_pool(const char *arg, int *secs)
+{
+	struct mock_pool_opts opts = {
+		.latency = 50,
+		.jitter = 25,
+		.block_secs = 20,
+		.diff_bits = 16,
+	};
+	int port = 0;
+	char *url;
+
+	if (sscanf(arg, "%d:%d:%d:%d:%d:%d", secs, &opts.latency, &opts.jitter,
+		   &opts.fail, &opts.block_secs, &opts.diff_bits) < 1 || *secs < 1 ||
+	    opts.latency < 0 || opts.jitter < 0 || opts.fail < 0 ||
+	    opts.fail > 100 || opts.block_secs < 0 || opts.diff_bits < 0 ||
+	    opts.diff_bits > 256)
+		return "Invalid value passed to bench-pipeline";
+	if (bench_mocks)
+		return "Only one benchmark can be run at a time";
+
+	bench_fds[0] = mock_pool_listen(&port);
+	if (bench_fds[0] < 0)
+		return "Failed to start mock pool";
+	bench_mocks = 1;
+	bench_opts = opts;
+	bench_popts = &bench_opts;
+	url = malloc(32);
+	if (unlikely(!url))
+		quit(1, "Failed to malloc url in bench_pipeline_pool");
+	sprintf(url, "http://127.0.0.1:%d", port);
+	set_url(url);
+	set_user("bench");
+	set_pass("bench");
+	return NULL;
+}
+
+static void bench_start_pools(void)
+{
+	int i;
+
+	for (i = 0; i < bench_mocks; i++) {
+		bench_pids[i] = mock_pool_start(bench_fds[i], bench_popts);
+		if (bench_pids[i] < 0)
+			quit(1, "Failed to start mock pool");
+	}
+}
+
+/* The mock pools run in process groups of their own, so must be stopped
+ * on the way out or they would outlive cgminer */
+static void bench_stop_pools(void)
+{
+	int i;
+
+	for (i = 0; i < bench_mocks; i++) {
+		mock_pool_stop(bench_pids[i]);
+		bench_pids[i] = 0;
+	}
+}
+#endif
+
 extern const char *opt_argv0;
 
 static char *opt_verusage_and_exit(const char *extra)
@@ -1880,6 +2333,20 @@ static char *opt_verusage_and_exit(const char *extra)
 
 /* These options are available from commandline only */
 static struct opt_table opt_cmdline_table[] = {
+#if defined(unix)
+	OPT_WITHOUT_ARG("--bench-failover",
+			bench_failover_pools, NULL,
+			opt_hidden),
+	OPT_WITH_ARG("--bench-pipeline",
+		     bench_pipeline_pool, NULL, &opt_bench_pipeline,
+		     opt_hidden),
+#endif
+	OPT_WITHOUT_ARG("--bench-hex",
+			bench_hex_and_exit, NULL,
+			opt_hidden),
+	OPT_WITHOUT_ARG("--bench-tq",
+			bench_tq_and_exit, NULL,
+			opt_hidden),
 	OPT_WITH_ARG("--config|-c",
 		     load_config, NULL, NULL,
 		     "Load a JSON-format configuration file\n"
@@ -1921,15 +2388,11 @@ static bool jobj_binary(const json_t *obj, const char *key,
 	return true;
 }
 
-static bool work_decode(const json_t *val, struct work *work)
+/* Fill in what a getwork reply may leave out and put the work item into host
+ * byte order. 'fields' has the GW_ flags of what the reply contained. */
+static void work_complete(struct work *work, unsigned int fields)
 {
-	if (unlikely(!jobj_binary(val, "data", work->data, sizeof(work->data), true))) {
-		applog(LOG_ERR, "JSON inval data");
-		goto err_out;
-	}
-
-	if (likely(!jobj_binary(val, "midstate",
-			 work->midstate, sizeof(work->midstate), false))) {
+	if (likely(!(fields & GW_MIDSTATE))) {
 		// Calculate it ourselves
 		union {
 			unsigned char c[64];
@@ -1941,19 +2404,17 @@ static bool work_decode(const json_t *val, struct work *work)
 		sha2_context ctx;
 		sha2_starts( &ctx, 0 );
 		sha2_update( &ctx, data.c, 64 );
-		memcpy(work->midstate, ctx.state, sizeof(work->midstate));
+		/* ctx.state is unsigned long, wider than 32 bits on 64 bit
+		 * hosts, so it can't simply be copied over */
+		for (swapcounter = 0; swapcounter < 8; swapcounter++)
+			((uint32_t *)work->midstate)[swapcounter] = ctx.state[swapcounter];
 	}
 
-	if (likely(!jobj_binary(val, "hash1", work->hash1, sizeof(work->hash1), false))) {
+	if (likely(!(fields & GW_HASH1))) {
 		// Always the same anyway
 		memcpy(work->hash1, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\1\0\0", 64);
 	}
 
-	if (unlikely(!jobj_binary(val, "target", work->target, sizeof(work->target), true))) {
-		applog(LOG_ERR, "JSON inval target");
-		goto err_out;
-	}
-
 	memset(work->hash, 0, sizeof(work->hash));
 
 #ifdef __BIG_ENDIAN__
@@ -1969,11 +2430,31 @@ static bool work_decode(const json_t *val, struct work *work)
 #endif
 
 	gettimeofday(&work->tv_staged, NULL);
+}
 
-	return true;
+static bool work_decode(const json_t *val, struct work *work)
+{
+	unsigned int fields = GW_RESULT | GW_DATA | GW_TARGET;
 
-err_out:
-	return false;
+	if (unlikely(!jobj_binary(val, "data", work->data, sizeof(work->data), true))) {
+		applog(LOG_ERR, "JSON inval data");
+		return false;
+	}
+
+	if (jobj_binary(val, "midstate", work->midstate, sizeof(work->midstate), false))
+		fields |= GW_MIDSTATE;
+
+	if (jobj_binary(val, "hash1", work->hash1, sizeof(work->hash1), false))
+		fields |= GW_HASH1;
+
+	if (unlikely(!jobj_binary(val, "target", work->target, sizeof(work->target), true))) {
+		applog(LOG_ERR, "JSON inval target");
+		return false;
+	}
+
+	work_complete(work, fields);
+
+	return true;
 }
 
 static inline int dev_from_id(int thr_id)
@@ -2003,12 +2484,7 @@ static void decay_time(double *f, double fadd)
 
 static int requests_staged(void)
 {
-	int ret;
-
-	mutex_lock(stgd_lock);
-	ret = HASH_COUNT(staged_work);
-	mutex_unlock(stgd_lock);
-	return ret;
+	return __atomic_load_n(&total_staged, __ATOMIC_RELAXED);
 }
 
 static WINDOW *mainwin, *statuswin, *logwin;
@@ -2095,7 +2571,7 @@ static void curses_print_status(void)
 		total_queued, requests_staged(), total_stale, total_discarded, new_blocks,
 		local_work, total_go, total_ro);
 	wclrtoeol(statuswin);
-	if (pool_strategy == POOL_LOADBALANCE && total_pools > 1)
+	if ((pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_LATENCY) && total_pools > 1)
 		mvwprintw(statuswin, 4, 0, " Connected to multiple pools with%s LP",
 			have_longpoll ? "": "out");
 	else
@@ -2287,62 +2763,58 @@ static bool donor(struct pool *pool)
 	return (pool == &donationpool);
 }
 
-static bool submit_upstream_work(const struct work *work)
+/* Build the JSON-RPC getwork submission for a solved work item */
+static char *submit_upstream_req(struct work *work, int id)
 {
-	char *hexstr = NULL;
-	json_t *val, *res;
-	char s[345], sd[345];
-	bool rc = false;
-	int thr_id = work->thr_id;
-	struct cgpu_info *cgpu = thr_info[thr_id].cgpu;
-	CURL *curl = curl_easy_init();
-	struct pool *pool = work->pool;
-	bool rolltime;
-	uint32_t *hash32;
-	char hashshow[64+1] = "";
-	bool isblock;
-
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return rc;
-	}
-
-#ifdef __BIG_ENDIAN__
-        int swapcounter = 0;
-        for (swapcounter = 0; swapcounter < 32; swapcounter++)
-            (((uint32_t*) (work->data))[swapcounter]) = swab32(((uint32_t*) (work->data))[swapcounter]);
-#endif
+	char hexstr[sizeof(work->data) * 2 + 1], *s;
 
 	/* build hex string */
-	hexstr = bin2hex(work->data, sizeof(work->data));
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "submit_upstream_work OOM");
-		goto out_nofree;
-	}
+	__bin2hex(hexstr, work->data, sizeof(work->data));
 
 	/* build JSON-RPC request */
+	s = malloc(345);
+	if (unlikely(!s)) {
+		applog(LOG_ERR, "submit_upstream_work OOM");
+		return NULL;
+	}
 	sprintf(s,
-	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
-		hexstr);
-	sprintf(sd,
-	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}",
-		hexstr);
+	      "{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":%d}",
+		hexstr, id);
 
 	if (opt_debug)
-		applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, sd);
+		applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", work->pool->rpc_url, s);
+
+	return s;
+}
 
-	/* Force a fresh connection in case there are dead persistent
-	 * connections to this pool */
-	if (pool_isset(pool, &pool->submit_fail))
-		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
+/* Account for the reply to a share submission, val is consumed */
+static bool submit_upstream_result(const struct work *work, json_t *val)
+{
+	json_t *res;
+	bool rc = false;
+	int thr_id = work->thr_id;
+	struct proxy_client *client = work->client;
+	struct cgpu_info *cgpu = NULL;
+	struct pool *pool = work->pool;
+	uint32_t *hash32;
+	char hashshow[64+1] = "", source[96];
+	bool isblock, accepted;
+
+	/* Shares from the proxy are counted against the downstream miner,
+	 * ones replayed from a spool may no longer have a device */
+	if (client)
+		sprintf(source, "proxy client %s", client->name);
+	else if (thr_id < mining_threads) {
+		cgpu = thr_info[thr_id].cgpu;
+		sprintf(source, "%s %d thread %d", cgpu->api->name, cgpu->device_id, thr_id);
+	} else
+		strcpy(source, "spooled");
 
-	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool);
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
 		if (!pool_tset(pool, &pool->submit_fail)) {
-			total_ro++;
-			pool->remotefail_occasions++;
+			stat_inc(total_ro);
+			stat_inc(pool->remotefail_occasions);
 			if (!donor(pool))
 				applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
 		}
@@ -2353,36 +2825,47 @@ static bool submit_upstream_work(const struct work *work)
 	}
 
 	res = json_object_get(val, "result");
+	/* submitblock answers null for an accepted block, a reason otherwise */
+	if (work->gbt)
+		accepted = json_is_null(res);
+	else
+		accepted = json_is_true(res);
 
 	if (!QUIET) {
 		isblock = regeneratehash(work);
 		if (isblock)
-			found_blocks++;
+			stat_inc(found_blocks);
 		hash32 = (uint32_t *)(work->hash);
 		sprintf(hashshow, "%08lx.%08lx.%08lx%s",
 			(unsigned long)(hash32[7]), (unsigned long)(hash32[6]), (unsigned long)(hash32[5]),
 			isblock ? " BLOCK!" : "");
 	}
 
-	/* Theoretically threads could race when modifying accepted and
-	 * rejected values but the chance of two submits completing at the
-	 * same time is zero so there is no point adding extra locking */
-	if (json_is_true(res)) {
-		cgpu->accepted++;
-		total_accepted++;
-		pool->accepted++;
+	/* Replies are accounted from the workio thread and every stratum
+	 * thread at once, so the counters are bumped atomically */
+	if (accepted) {
+		if (work->gbt) {
+			mutex_lock(&pool->stratum_lock);
+			pool->gbt_refresh = true;
+			pthread_cond_signal(&pool->gbt_cond);
+			mutex_unlock(&pool->stratum_lock);
+		}
+		if (client)
+			stat_inc(client->accepted);
+		else if (cgpu)
+			stat_inc(cgpu->accepted);
+		stat_inc(total_accepted);
+		stat_inc(pool->accepted);
 		if (opt_debug)
 			applog(LOG_DEBUG, "PROOF OF WORK RESULT: true (yay!!!)");
 		if (!QUIET) {
 			if (donor(work->pool))
-				applog(LOG_NOTICE, "Accepted %s %s %d thread %d donate",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id);
+				applog(LOG_NOTICE, "Accepted %s %s donate", hashshow, source);
 			else if (total_pools > 1)
-				applog(LOG_NOTICE, "Accepted %s %s %d thread %d pool %d",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id, work->pool->pool_no);
+				applog(LOG_NOTICE, "Accepted %s %s pool %d",
+				       hashshow, source, work->pool->pool_no);
 			else
-				applog(LOG_NOTICE, "Accepted %s %s %d thread %d",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id);
+				applog(LOG_NOTICE, "Accepted %s %s", hashshow, source);
 		}
 		if (opt_shares && total_accepted >= opt_shares) {
 			applog(LOG_WARNING, "Successfully mined %d accepted shares as requested and exiting.", opt_shares);
@@ -2390,24 +2873,31 @@ static bool submit_upstream_work(const struct work *work)
 			goto out;
 		}
 	} else {
-		cgpu->rejected++;
-		total_rejected++;
-		pool->rejected++;
+		if (client)
+			stat_inc(client->rejected);
+		else if (cgpu)
+			stat_inc(cgpu->rejected);
+		stat_inc(total_rejected);
+		stat_inc(pool->rejected);
 		if (opt_debug)
 			applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
 			if (donor(work->pool))
-				applog(LOG_NOTICE, "Rejected %s %s %d thread %d donate",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id);
+				applog(LOG_NOTICE, "Rejected %s %s donate", hashshow, source);
 			else if (total_pools > 1)
-				applog(LOG_NOTICE, "Rejected %s %s %d thread %d pool %d",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id, work->pool->pool_no);
+				applog(LOG_NOTICE, "Rejected %s %s pool %d",
+				       hashshow, source, work->pool->pool_no);
 			else
-				applog(LOG_NOTICE, "Rejected %s %s %d thread %d",
-				       hashshow, cgpu->api->name, cgpu->device_id, thr_id);
+				applog(LOG_NOTICE, "Rejected %s %s", hashshow, source);
 		}
+		if (work->gbt && json_is_string(res))
+			applog(LOG_WARNING, "Pool %d rejected block: %s", pool->pool_no,
+			       json_string_value(res));
 	}
 
+	if (!cgpu)
+		goto done;
+
 	cgpu->utility = cgpu->accepted / ( total_secs ? total_secs : 1 ) * 60;
 
 	if (!opt_realquiet)
@@ -2418,20 +2908,55 @@ static bool submit_upstream_work(const struct work *work)
 		get_statline(logline, cgpu);
 		applog(LOG_INFO, "%s", logline);
 	}
-
-	json_decref(val);
-
+done:
 	rc = true;
 out:
-	free(hexstr);
-out_nofree:
-	curl_easy_cleanup(curl);
+	if (val)
+		json_decref(val);
 	return rc;
 }
 
 static const char *rpc_req =
 	"{\"method\": \"getwork\", \"params\": [], \"id\":0}\r\n";
 
+/* The latency strategy sends getworks to the alive pool that returns the
+ * slowest tenth of them the quickest, made to look slower the more of its
+ * requests fail and shares go stale. Pools yet to answer look fastest so
+ * they get measured, and 1 in LATENCY_EXPLORE requests still rotates */
+#define LATENCY_EXPLORE 10
+static unsigned int latency_turn;
+
+static struct pool *fastest_pool(void)
+{
+	struct pool *pool, *best = NULL;
+	double score, best_score = 0;
+	unsigned int shares;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct rpc_stats *stats;
+
+		pool = pools[i];
+		if (pool->idle || !pool->enabled)
+			continue;
+		stats = &pool->getwork_stats;
+		if (!stats->replies && stats->errors)
+			score = 1U << RPC_LAT_BUCKETS;
+		else {
+			score = rpc_stats_pct(stats, 90) + 1;
+			score *= 1 + 10.0 * stats->errors / (stats->replies + stats->errors);
+		}
+		shares = pool->accepted + pool->rejected + pool->stale_shares;
+		if (shares)
+			score *= 1 + 10.0 * pool->stale_shares / shares;
+		if (!best || score < best_score) {
+			best = pool;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
 /* Select any active pool in a rotating fashion when loadbalance is chosen */
 static inline struct pool *select_pool(bool lagging)
 {
@@ -2447,7 +2972,14 @@ static inline struct pool *select_pool(bool lagging)
 
 	cp = current_pool();
 
-	if (pool_strategy != POOL_LOADBALANCE && !lagging)
+	if (pool_strategy == POOL_LATENCY && !lagging) {
+		/* Every so often take the next pool in turn instead so the
+		 * figures of the others are kept current */
+		if (++latency_turn % LATENCY_EXPLORE)
+			pool = fastest_pool();
+		else
+			pool = NULL;
+	} else if (pool_strategy != POOL_LOADBALANCE && !lagging)
 		pool = cp;
 	else
 		pool = NULL;
@@ -2464,76 +2996,22 @@ static inline struct pool *select_pool(bool lagging)
 	return pool;
 }
 
-static bool get_upstream_work(struct work *work, bool lagging)
-{
-	struct pool *pool;
-	json_t *val = NULL;
-	bool rc = false;
-	int retries = 0;
-	CURL *curl;
-
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return rc;
-	}
-
-	pool = select_pool(lagging);
-	if (opt_debug)
-		applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
-
-retry:
-	/* A single failure response here might be reported as a dead pool and
-	 * there may be temporary denied messages etc. falsely reporting
-	 * failure so retry a few times before giving up */
-	while (!val && retries++ < 3) {
-		val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, rpc_req,
-			    false, false, &work->rolltime, pool);
-		if (donor(pool) && !val) {
-			if (opt_debug)
-				applog(LOG_DEBUG, "Donor pool lagging");
-			pool = select_pool(true);
-			if (opt_debug)
-				applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
-			retries = 0;
-		}
-	}
-	if (unlikely(!val)) {
-		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
-		goto out;
-	}
-
-	rc = work_decode(json_object_get(val, "result"), work);
-	if (!rc && retries < 3) {
-		/* Force a fresh connection in case there are dead persistent
-		 * connections */
-		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-		goto retry;
-	}
-	work->pool = pool;
-	total_getworks++;
-	pool->getwork_requested++;
-
-	json_decref(val);
-out:
-	curl_easy_cleanup(curl);
-
-	return rc;
-}
-
 static struct work *make_work(void)
 {
-	struct work *work = calloc(1, sizeof(struct work));
+	struct work *work = slab_alloc(&work_slab);
 
-	if (unlikely(!work))
-		quit(1, "Failed to calloc work in make_work");
-	work->id = total_work++;
+	work->id = __atomic_fetch_add(&total_work, 1, __ATOMIC_RELAXED);
 	return work;
 }
 
 static void free_work(struct work *work)
 {
-	free(work);
+	slab_free(&work_slab, work);
+}
+
+static struct workio_cmd *make_workio_cmd(void)
+{
+	return slab_alloc(&workio_slab);
 }
 
 static void workio_cmd_free(struct workio_cmd *wc)
@@ -2541,16 +3019,26 @@ static void workio_cmd_free(struct workio_cmd *wc)
 	if (!wc)
 		return;
 
+	if (wc->partner)
+		wc->partner->partner = NULL;
+
 	switch (wc->cmd) {
+	case WC_GET_WORK:
+		/* Unused work if the request was abandoned */
+		if (wc->u.work)
+			free_work(wc->u.work);
+		free(wc->rpc_req);
+		break;
 	case WC_SUBMIT_WORK:
 		free_work(wc->u.work);
+		free(wc->rpc_req);
 		break;
 	default: /* do nothing */
 		break;
 	}
 
 	memset(wc, 0, sizeof(*wc));	/* poison */
-	free(wc);
+	slab_free(&workio_slab, wc);
 }
 
 static void disable_curses(void)
@@ -2630,6 +3118,16 @@ void kill_work(void)
 		applog(LOG_DEBUG, "Killing off API thread");
 	thr = &thr_info[api_thr_id];
 	thr_info_cancel(thr);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Killing off proxy thread");
+	thr = &thr_info[proxy_thr_id];
+	thr_info_cancel(thr);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Killing off probe thread");
+	thr = &thr_info[probe_thr_id];
+	thr_info_cancel(thr);
 }
 
 void quit(int status, const char *format, ...);
@@ -2644,73 +3142,21 @@ static void sighandler(int sig)
 	quit(sig, "Received interrupt signal.");
 }
 
-static void *get_work_thread(void *userdata)
+bool stale_work(struct work *work, bool share)
 {
-	struct workio_cmd *wc = (struct workio_cmd *)userdata;
-	struct work *ret_work;
-	int failures = 0;
+	struct timeval now;
+	bool ret = false;
 
-	pthread_detach(pthread_self());
-	ret_work = make_work();
+	gettimeofday(&now, NULL);
+	if (share) {
+		if ((now.tv_sec - work->tv_staged.tv_sec) >= opt_expiry)
+			return true;
+	} else if ((now.tv_sec - work->tv_staged.tv_sec) >= opt_scantime)
+		return true;
 
-	if (wc->thr)
-		ret_work->thr = wc->thr;
-	else
-		ret_work->thr = NULL;
-
-	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(ret_work, wc->lagging)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
-			free_work(ret_work);
-			kill_work();
-			goto out;
-		}
-
-		/* pause, then restart work-request loop */
-		applog(LOG_DEBUG, "json_rpc_call failed on get work, retry after %d seconds",
-			fail_pause);
-		sleep(fail_pause);
-		fail_pause += opt_fail_pause;
-	}
-	fail_pause = opt_fail_pause;
-
-	if (opt_debug)
-		applog(LOG_DEBUG, "Pushing work to requesting thread");
-
-	/* send work to requesting thread */
-	if (unlikely(!tq_push(thr_info[stage_thr_id].q, ret_work))) {
-		applog(LOG_ERR, "Failed to tq_push work in workio_get_work");
-		kill_work();
-		free_work(ret_work);
-	}
-
-out:
-	workio_cmd_free(wc);
-	return NULL;
-}
-
-static bool workio_get_work(struct workio_cmd *wc)
-{
-	pthread_t get_thread;
-
-	if (unlikely(pthread_create(&get_thread, NULL, get_work_thread, (void *)wc))) {
-		applog(LOG_ERR, "Failed to create get_work_thread");
-		return false;
-	}
-	return true;
-}
-
-static bool stale_work(struct work *work, bool share)
-{
-	struct timeval now;
-	bool ret = false;
-
-	gettimeofday(&now, NULL);
-	if (share) {
-		if ((now.tv_sec - work->tv_staged.tv_sec) >= opt_expiry)
-			return true;
-	} else if ((now.tv_sec - work->tv_staged.tv_sec) >= opt_scantime)
+	/* Extranonce1 changes with every stratum connection so work from an
+	 * earlier one can never be accepted */
+	if (work->stratum && work->stratum_session != work->pool->stratum_session)
 		return true;
 
 	/* Don't compare donor work in case it's on a different chain */
@@ -2722,59 +3168,6 @@ static bool stale_work(struct work *work, bool share)
 	return ret;
 }
 
-static void *submit_work_thread(void *userdata)
-{
-	struct workio_cmd *wc = (struct workio_cmd *)userdata;
-	struct work *work = wc->u.work;
-	struct pool *pool = work->pool;
-	int failures = 0;
-
-	pthread_detach(pthread_self());
-
-	if (!opt_submit_stale && stale_work(work, true)) {
-		applog(LOG_NOTICE, "Stale share detected, discarding");
-		total_stale++;
-		pool->stale_shares++;
-		goto out;
-	}
-
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work)) {
-		if (!opt_submit_stale && stale_work(work, true)) {
-			applog(LOG_NOTICE, "Stale share detected, discarding");
-			total_stale++;
-			pool->stale_shares++;
-			break;
-		}
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "Failed %d retries ...terminating workio thread", opt_retries);
-			kill_work();
-			break;
-		}
-
-		/* pause, then restart work-request loop */
-		applog(LOG_INFO, "json_rpc_call failed on submit_work, retry after %d seconds",
-			fail_pause);
-		sleep(fail_pause);
-		fail_pause += opt_fail_pause;
-	}
-	fail_pause = opt_fail_pause;
-out:
-	workio_cmd_free(wc);
-	return NULL;
-}
-
-static bool workio_submit_work(struct workio_cmd *wc)
-{
-	pthread_t submit_thread;
-
-	if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)wc))) {
-		applog(LOG_ERR, "Failed to create submit_work_thread");
-		return false;
-	}
-	return true;
-}
-
 /* Find the pool that currently has the highest priority */
 static struct pool *priority_pool(int choice)
 {
@@ -2797,8 +3190,13 @@ static struct pool *priority_pool(int choice)
 	return ret;
 }
 
+static void discard_work(struct work *work);
+static void inc_queued(void);
+static void dec_queued(void);
+
 void switch_pools(struct pool *selected)
 {
+	struct work *work, *tmp, *ready = NULL;
 	struct pool *pool, *last_pool;
 	int i, pool_no;
 
@@ -2819,9 +3217,10 @@ void switch_pools(struct pool *selected)
 	}
 
 	switch (pool_strategy) {
-		/* Both of these set to the master pool */
+		/* These set to the master pool */
 		case POOL_FAILOVER:
 		case POOL_LOADBALANCE:
+		case POOL_LATENCY:
 			for (i = 0; i < total_pools; i++) {
 				pool = priority_pool(i);
 				if (!pool->idle && pool->enabled) {
@@ -2845,25 +3244,105 @@ void switch_pools(struct pool *selected)
 			break;
 	}
 
-	currentpool = pools[pool_no];
-	pool = currentpool;
+	pool = pools[pool_no];
+	set_current_pool(pool);
+	if (pool != last_pool) {
+		stat_inc(pool_switches);
+		gettimeofday(&tv_switched, NULL);
+		switch_pops = 0;
+		switch_settling = true;
+	}
+	/* Prefetched work is only any use if the switch went to its pool */
+	HASH_ITER(hh, warm_work, work, tmp) {
+		HASH_DEL(warm_work, work);
+		HASH_ADD_INT(ready, id, work);
+	}
+	warm_pool = NULL;
 	mutex_unlock(&control_lock);
 
 	if (pool != last_pool)
 		applog(LOG_WARNING, "Switching to %s", pool->rpc_url);
 
 	/* Reset the queued amount to allow more to be queued for the new pool */
-	mutex_lock(&qd_lock);
-	total_queued = 0;
-	mutex_unlock(&qd_lock);
+	__atomic_store_n(&total_queued, 0, __ATOMIC_RELAXED);
+
+	HASH_ITER(hh, ready, work, tmp) {
+		HASH_DEL(ready, work);
+		if (work->pool != pool) {
+			discard_work(work);
+			continue;
+		}
+		inc_queued();
+		if (unlikely(!tq_push(thr_info[stage_thr_id].q, work))) {
+			dec_queued();
+			free_work(work);
+		}
+	}
+}
+
+/* Hold back work prefetched from the pool a switch is about to move to.
+ * Returns false if that pool is already current and the work can be staged
+ * straight away */
+static bool warm_park(struct work *work)
+{
+	bool stage = false, drop = false;
+
+	mutex_lock(&control_lock);
+	if (work->pool == currentpool)
+		stage = true;
+	else if (work->pool == warm_pool)
+		HASH_ADD_INT(warm_work, id, work);
+	else
+		drop = true;
+	mutex_unlock(&control_lock);
+
+	/* The switch went to some other pool */
+	if (drop)
+		discard_work(work);
+	return !stage;
+}
+
+/* Prefetched work is for the block current when it was fetched */
+static void warm_discard(void)
+{
+	struct work *work, *tmp;
+
+	mutex_lock(&control_lock);
+	HASH_ITER(hh, warm_work, work, tmp) {
+		HASH_DEL(warm_work, work);
+		discard_work(work);
+	}
+	mutex_unlock(&control_lock);
+}
+
+/* Account the time a device waited for 'work' since tv_wait, and to the
+ * switch gap while the switch to a new pool settles */
+static void work_waited(struct work *work, struct timeval *tv_wait)
+{
+	struct timeval now, from, diff;
+
+	gettimeofday(&now, NULL);
+	mutex_lock(&control_lock);
+	if (!timeval_subtract(&diff, &now, tv_wait))
+		device_idle += diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	if (switch_settling) {
+		from = *tv_wait;
+		if (timercmp(&from, &tv_switched, <))
+			from = tv_switched;
+		if (!timeval_subtract(&diff, &now, &from))
+			switch_idle += diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+		if (work->pool == currentpool && ++switch_pops >= mining_threads)
+			switch_settling = false;
+	}
+	mutex_unlock(&control_lock);
 }
 
 static void discard_work(struct work *work)
 {
 	if (!work->clone && !work->rolls && !work->mined) {
 		if (work->pool)
-			work->pool->discarded_work++;
-		total_discarded++;
+			stat_inc(work->pool->discarded_work);
+		stat_inc(total_discarded);
 		if (opt_debug)
 			applog(LOG_DEBUG, "Discarded work");
 	} else if (opt_debug)
@@ -2875,46 +3354,62 @@ static void discard_work(struct work *work)
  * queued to prevent ever being left without work */
 static void inc_queued(void)
 {
-	mutex_lock(&qd_lock);
-	total_queued++;
-	mutex_unlock(&qd_lock);
+	__atomic_add_fetch(&total_queued, 1, __ATOMIC_RELAXED);
 }
 
 static void dec_queued(void)
 {
-	mutex_lock(&qd_lock);
-	if (total_queued > 0)
-		total_queued--;
-	mutex_unlock(&qd_lock);
+	int queued = __atomic_load_n(&total_queued, __ATOMIC_RELAXED);
+
+	while (queued > 0 && !__atomic_compare_exchange_n(&total_queued, &queued, queued - 1,
+							   true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
 }
 
 static int requests_queued(void)
 {
-	int ret;
+	return __atomic_load_n(&total_queued, __ATOMIC_RELAXED);
+}
 
-	mutex_lock(&qd_lock);
-	ret = total_queued;
-	mutex_unlock(&qd_lock);
-	return ret;
+static bool hash_push(struct work *work);
+static struct work *cache_steal(struct work_cache *c);
+
+static int discard_if_stale(struct work *work)
+{
+	if (stale_work(work, false)) {
+		discard_work(work);
+		return 1;
+	}
+	if (unlikely(!hash_push(work)))
+		free_work(work);
+	return 0;
 }
 
+/* Only called on a restart, which moves on work_block, so all the staged work
+ * but the donor's is stale. The whole heap is taken at once and the work in
+ * it checked outside the lock, in case any was staged since. The threads'
+ * caches are stolen empty too, fresh work going back in the heaps */
 static int discard_stale(void)
 {
-	struct work *work, *tmp;
+	struct staged_heap old;
+	struct work *work;
 	int i, stale = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			if (work->clone)
-				--staged_clones;
-			discard_work(work);
-			stale++;
-		}
-	}
+	old = staged;
+	memset(&staged, 0, sizeof(staged));
+	__atomic_sub_fetch(&total_staged, old.count, __ATOMIC_RELAXED);
 	mutex_unlock(stgd_lock);
 
+	for (i = 0; i < old.count; i++)
+		stale += discard_if_stale(old.work[i]);
+	free(old.work);
+
+	for (i = 0; i < mining_threads; i++) {
+		while ((work = cache_steal(&work_caches[i])))
+			stale += discard_if_stale(work);
+	}
+
 	if (opt_debug)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 
@@ -2933,12 +3428,15 @@ static void restart_threads(void)
 
 	/* Discard staged work that is now stale */
 	stale = discard_stale();
+	warm_discard();
 
 	for (i = 0; i < stale; i++)
 		queue_request(NULL, true);
 
 	for (i = 0; i < mining_threads; i++)
 		work_restart[i].restart = 1;
+
+	proxy_new_block();
 }
 
 static void set_curblock(char *hexstr, unsigned char *hash)
@@ -2962,21 +3460,70 @@ static void set_curblock(char *hexstr, unsigned char *hash)
 		free(old_hash);
 }
 
+/* Account for the pool of 'work' announcing block 's' with a longpoll,
+ * stratum notify or new template, noting whether it was the first to and
+ * how long after the block was first seen. Returns whether the pool had
+ * already announced it */
+static bool block_announced(struct block *s, struct work *work)
+{
+	struct pool *pool = work->pool;
+	uint32_t bit = 1U << pool->pool_no;
+	struct timeval now, diff;
+
+	wr_lock(&blk_lock);
+	if (s->announced & bit) {
+		wr_unlock(&blk_lock);
+		return true;
+	}
+	if (!s->announced)
+		pool->blocks_first++;
+	s->announced |= bit;
+	wr_unlock(&blk_lock);
+
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &s->first_seen);
+	pool->blocks_announced++;
+	pool->announce_lag += diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	return false;
+}
+
+/* Time from a longpoll restarting the devices to one having fresh work */
+static void lp_restart_start(void)
+{
+	mutex_lock(&control_lock);
+	gettimeofday(&tv_lp_block, NULL);
+	lp_restarting = true;
+	mutex_unlock(&control_lock);
+}
+
+static void lp_restart_done(void)
+{
+	struct timeval now, diff;
+
+	if (!__atomic_load_n(&lp_restarting, __ATOMIC_RELAXED))
+		return;
+	mutex_lock(&control_lock);
+	if (lp_restarting) {
+		gettimeofday(&now, NULL);
+		timeval_subtract(&diff, &now, &tv_lp_block);
+		restart_lag += diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+		restarts_timed++;
+		lp_restarting = false;
+	}
+	mutex_unlock(&control_lock);
+}
+
 static void test_work_current(struct work *work, bool longpoll)
 {
 	struct block *s;
-	char *hexstr;
+	char hexstr[37];
 
 	/* Allow donation to not set current work, so it will work even if
 	 * mining on a different chain */
 	if (donor(work->pool))
 		return;
 
-	hexstr = bin2hex(work->data, 18);
-	if (unlikely(!hexstr)) {
-		applog(LOG_ERR, "stage_thread OOM");
-		return;
-	}
+	__bin2hex(hexstr, work->data, 18);
 
 	/* Search to see if this block exists yet and if not, consider it a
 	 * new block and set the current block details to this one */
@@ -2988,34 +3535,184 @@ static void test_work_current(struct work *work, bool longpoll)
 		if (unlikely(!s))
 			quit (1, "test_work_current OOM");
 		strcpy(s->hash, hexstr);
+		gettimeofday(&s->first_seen, NULL);
 		wr_lock(&blk_lock);
 		HASH_ADD_STR(blocks, hash, s);
 		wr_unlock(&blk_lock);
+		if (longpoll)
+			block_announced(s, work);
 		set_curblock(hexstr, work->data);
 		if (unlikely(++new_blocks == 1))
-			goto out_free;
+			return;
 
 		work_block++;
 
-		if (longpoll)
-			applog(LOG_NOTICE, "LONGPOLL detected new block on network, waiting on fresh work");
+		if (longpoll) {
+			lp_restart_start();
+			applog(LOG_NOTICE, "%s detected new block on network, waiting on fresh work",
+			       work->stratum ? "Stratum" : "LONGPOLL");
+		}
 		else if (have_longpoll)
 			applog(LOG_NOTICE, "New block detected on network before longpoll, waiting on fresh work");
 		else
 			applog(LOG_NOTICE, "New block detected on network, waiting on fresh work");
 		restart_threads();
 	} else if (longpoll) {
-		applog(LOG_NOTICE, "LONGPOLL requested work restart, waiting on fresh work");
+		bool again = block_announced(s, work);
+
+		/* Every pool longpolled announces each block, so another pool
+		 * first announcing a block already known restarts nothing. The
+		 * pool in use, or one work is taken from announcing it again,
+		 * wants a restart */
+		if (work->pool != current_pool() &&
+		    (!again || (pool_strategy != POOL_LOADBALANCE &&
+				pool_strategy != POOL_LATENCY)))
+			return;
+		lp_restart_start();
+		applog(LOG_NOTICE, "%s requested work restart, waiting on fresh work",
+		       work->stratum ? "Stratum" : "LONGPOLL");
 		work_block++;
 		restart_threads();
 	}
-out_free:
-	free(hexstr);
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
+/* Whether 'a' is handed out before 'b' */
+static inline bool staged_before(const struct work *a, const struct work *b)
+{
+	if (opt_staged_order == STAGED_FRESHEST)
+		return timercmp(&a->tv_staged, &b->tv_staged, >);
+	return timercmp(&a->tv_staged, &b->tv_staged, <);
+}
+
+static void heap_add(struct staged_heap *h, struct work *work)
+{
+	int i, parent;
+
+	if (h->count == h->size) {
+		h->size = h->size ? h->size * 2 : 16;
+		h->work = realloc(h->work, h->size * sizeof(*h->work));
+		if (unlikely(!h->work))
+			quit(1, "Failed to realloc in heap_add");
+	}
+	for (i = h->count++; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (!staged_before(work, h->work[parent]))
+			break;
+		h->work[i] = h->work[parent];
+	}
+	h->work[i] = work;
+	if (work->clone)
+		h->clones++;
+	__atomic_add_fetch(&total_staged, 1, __ATOMIC_RELAXED);
+}
+
+static struct work *heap_take(struct staged_heap *h)
+{
+	struct work *top, *last;
+	int i, child;
+
+	if (!h->count)
+		return NULL;
+	top = h->work[0];
+	last = h->work[--h->count];
+	for (i = 0; (child = i * 2 + 1) < h->count; i = child) {
+		if (child + 1 < h->count && staged_before(h->work[child + 1], h->work[child]))
+			child++;
+		if (!staged_before(h->work[child], last))
+			break;
+		h->work[i] = h->work[child];
+	}
+	h->work[i] = last;
+	if (top->clone)
+		h->clones--;
+	__atomic_sub_fetch(&total_staged, 1, __ATOMIC_RELAXED);
+	return top;
+}
+
+/* Only ever called by the thread owning the cache */
+static bool cache_push(struct work_cache *c, struct work *work)
+{
+	long b = __atomic_load_n(&c->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&c->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= CACHE_SIZE)
+		return false;
+	__atomic_store_n(&c->work[b % CACHE_SIZE], work, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&c->bottom, b + 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&total_staged, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Only ever called by the thread owning the cache, racing the thieves for
+ * the last work in it */
+static struct work *cache_take(struct work_cache *c)
+{
+	long b = __atomic_load_n(&c->bottom, __ATOMIC_RELAXED) - 1;
+	struct work *work = NULL;
+	long t;
+
+	__atomic_store_n(&c->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&c->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		work = __atomic_load_n(&c->work[b % CACHE_SIZE], __ATOMIC_RELAXED);
+		if (t == b && !__atomic_compare_exchange_n(&c->top, &t, t + 1, false,
+							   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			work = NULL;
+		if (t == b)
+			__atomic_store_n(&c->bottom, b + 1, __ATOMIC_RELAXED);
+	} else
+		__atomic_store_n(&c->bottom, b + 1, __ATOMIC_RELAXED);
+
+	if (work)
+		__atomic_sub_fetch(&total_staged, 1, __ATOMIC_RELAXED);
+	return work;
+}
+
+/* Any thread may steal. Returns NULL if the cache is empty, retrying when
+ * beaten to the top by another thief or the owner */
+static struct work *cache_steal(struct work_cache *c)
+{
+	struct work *work;
+	long t, b;
+
+	do {
+		t = __atomic_load_n(&c->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		b = __atomic_load_n(&c->bottom, __ATOMIC_ACQUIRE);
+		if (t >= b)
+			return NULL;
+		work = __atomic_load_n(&c->work[t % CACHE_SIZE], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&c->top, &t, t + 1, false,
+					      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	__atomic_sub_fetch(&total_staged, 1, __ATOMIC_RELAXED);
+	return work;
+}
+
+/* Steal from the nearest neighbour of thr_id with any work cached, or from
+ * any thread for a thr_id of -1 */
+static struct work *cache_steal_any(int thr_id)
+{
+	struct work *work;
+	int i, victim;
+
+	for (i = 1; i <= mining_threads; i++) {
+		victim = (thr_id + i) % mining_threads;
+		if (victim == thr_id)
+			continue;
+		work = cache_steal(&work_caches[victim]);
+		if (work)
+			return work;
+	}
+	return NULL;
+}
+
+static bool staged_empty(void)
 {
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
+	return !__atomic_load_n(&staged.count, __ATOMIC_RELAXED) &&
+	       !__atomic_load_n(&staged_donor.count, __ATOMIC_RELAXED);
 }
 
 static bool hash_push(struct work *work)
@@ -3023,12 +3720,9 @@ static bool hash_push(struct work *work)
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
-		if (work->clone)
-			++staged_clones;
-	} else
+	if (likely(!getq->frozen))
+		heap_add(donor(work->pool) ? &staged_donor : &staged, work);
+	else
 		rc = false;
 	pthread_cond_signal(&getq->cond);
 	mutex_unlock(stgd_lock);
@@ -3115,7 +3809,20 @@ static void display_pool_summary(struct pool *pool)
 		wlog(" Discarded work due to new blocks: %d\n", pool->discarded_work);
 		wlog(" Stale submissions discarded due to new blocks: %d\n", pool->stale_shares);
 		wlog(" Unable to get work from server occasions: %d\n", pool->getfail_occasions);
-		wlog(" Submitting work remotely delay occasions: %d\n\n", pool->remotefail_occasions);
+		wlog(" Submitting work remotely delay occasions: %d\n", pool->remotefail_occasions);
+		wlog(" Getwork latency median / 90%%: %ums / %ums, failed: %u\n",
+		     rpc_stats_pct(&pool->getwork_stats, 50), rpc_stats_pct(&pool->getwork_stats, 90),
+		     pool->getwork_stats.errors);
+		wlog(" Submit latency median / 90%%: %ums / %ums, failed: %u\n",
+		     rpc_stats_pct(&pool->submit_stats, 50), rpc_stats_pct(&pool->submit_stats, 90),
+		     pool->submit_stats.errors);
+		wlog(" Blocks announced / first: %u / %u, average lag: %.0fms\n",
+		     pool->blocks_announced, pool->blocks_first,
+		     pool->blocks_announced ? pool->announce_lag / pool->blocks_announced : 0.0);
+		wlog(" Throttled getwork / submit / probe: %.0fms / %.0fms / %.0fms\n",
+		     pool->net[NET_GETWORK].throttled, pool->net[NET_SUBMIT].throttled,
+		     pool->net[NET_PROBE].throttled);
+		wlog(" Connections reused / fresh: %u / %u\n\n", pool->curl_reused, pool->curl_fresh);
 		wrefresh(logwin);
 		unlock_curses();
 	}
@@ -3154,7 +3861,11 @@ void write_config(FILE *fcfg)
 	for(i = 0; i < total_pools; i++) {
 		fprintf(fcfg, "%s\n\t{\n\t\t\"url\" : \"%s\",", i > 0 ? "," : "", pools[i]->rpc_url);
 		fprintf(fcfg, "\n\t\t\"user\" : \"%s\",", pools[i]->rpc_user);
-		fprintf(fcfg, "\n\t\t\"pass\" : \"%s\"\n\t}", pools[i]->rpc_pass);
+		fprintf(fcfg, "\n\t\t\"pass\" : \"%s\"", pools[i]->rpc_pass);
+		if (pools[i]->net_rate_set)
+			fprintf(fcfg, ",\n\t\t\"net-rate\" : \"%g:%g:%g\"", pools[i]->net[NET_GETWORK].rate,
+				pools[i]->net[NET_SUBMIT].rate, pools[i]->net[NET_PROBE].rate);
+		fputs("\n\t}", fcfg);
 		}
 	fputs("\n],\n\n", fcfg);
 
@@ -3214,7 +3925,8 @@ void write_config(FILE *fcfg)
 			   ((void *)opt->cb_arg == (void *)set_int_0_to_9999 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_65535 ||
 			   (void *)opt->cb_arg == (void *)set_int_0_to_10 ||
-			   (void *)opt->cb_arg == (void *)set_int_1_to_10) && opt->desc != opt_hidden)
+			   (void *)opt->cb_arg == (void *)set_int_1_to_10 ||
+			   (void *)opt->cb_arg == (void *)set_int_0_to_99) && opt->desc != opt_hidden)
 				fprintf(fcfg, ",\n\"%s\" : \"%d\"", p+2, *(int *)opt->u.arg);
 		}
 	}
@@ -3224,6 +3936,8 @@ void write_config(FILE *fcfg)
 	fprintf(fcfg, ",\n\"shares\" : \"%d\"", opt_shares);
 	if (pool_strategy == POOL_LOADBALANCE)
 		fputs(",\n\"load-balance\" : true", fcfg);
+	if (pool_strategy == POOL_LATENCY)
+		fputs(",\n\"latency-balance\" : true", fcfg);
 	if (pool_strategy == POOL_ROUNDROBIN)
 		fputs(",\n\"round-robin\" : true", fcfg);
 	if (pool_strategy == POOL_ROTATE)
@@ -3231,7 +3945,11 @@ void write_config(FILE *fcfg)
 #if defined(unix)
 	if (opt_stderr_cmd && *opt_stderr_cmd)
 		fprintf(fcfg, ",\n\"monitor\" : \"%s\"", opt_stderr_cmd);
+	if (opt_spool_dir && *opt_spool_dir)
+		fprintf(fcfg, ",\n\"spool-dir\" : \"%s\"", opt_spool_dir);
 #endif // defined(unix)
+	if (opt_staged_order == STAGED_FRESHEST)
+		fputs(",\n\"staged-order\" : \"freshest\"", fcfg);
 	if (opt_kernel && *opt_kernel)
 		fprintf(fcfg, ",\n\"kernel\" : \"%s\"", opt_kernel);
 	if (opt_kernel_path && *opt_kernel_path) {
@@ -3240,6 +3958,8 @@ void write_config(FILE *fcfg)
 			kpath[strlen(kpath)-1] = 0;
 		fprintf(fcfg, ",\n\"kernel-path\" : \"%s\"", kpath);
 	}
+	if (opt_btc_address)
+		fprintf(fcfg, ",\n\"btc-address\" : \"%s\"", opt_btc_address);
 	if (schedstart.enable)
 		fprintf(fcfg, ",\n\"sched-time\" : \"%d:%d\"", schedstart.tm.tm_hour, schedstart.tm.tm_min);
 	if (schedstop.enable)
@@ -3814,72 +4534,1226 @@ static void *input_thread(void *userdata)
 	return NULL;
 }
 
-static void *workio_thread(void *userdata)
-{
-	struct thr_info *mythr = userdata;
-	bool ok = true;
-
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+/* Shares sent to stratum pools waiting for their reply, hashed by id */
+struct stratum_share {
+	UT_hash_handle hh;
+	struct work *work;
+	int id;
+};
 
-	while (ok) {
-		struct workio_cmd *wc;
+static struct stratum_share *stratum_shares = NULL;
+static pthread_mutex_t sshare_lock;
+/* Ids 1 and 2 are used by subscribe and authorise */
+static int sshare_id = 3;
 
-		if (opt_debug)
-			applog(LOG_DEBUG, "Popping work to work thread");
+static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = tq_pop(mythr->q, NULL);
-		if (unlikely(!wc)) {
-			applog(LOG_ERR, "Failed to tq_pop in workio_thread");
-			ok = false;
-			break;
-		}
+/* Work target for a share difficulty, difficulty 1 being 0xffff * 2^208 */
+static void set_work_target(unsigned char *target, double diff)
+{
+	const double two64 = 18446744073709551616.0;
+	double t, scale;
+	int i;
 
-		/* process workio_cmd */
-		switch (wc->cmd) {
-		case WC_GET_WORK:
-			ok = workio_get_work(wc);
-			break;
-		case WC_SUBMIT_WORK:
-			ok = workio_submit_work(wc);
-			break;
-		default:
-			ok = false;
-			break;
-		}
+	if (diff <= 0)
+		diff = 1;
+	t = 65535.0 * 65536.0 * two64 * two64 * two64 / diff;
+	if (t >= two64 * two64 * two64 * two64) {
+		memset(target, 0xff, 32);
+		return;
 	}
+	for (i = 3; i >= 0; i--) {
+		uint64_t limb;
+		int j;
 
-	tq_freeze(mythr->q);
-
-	return NULL;
+		scale = 1;
+		for (j = 0; j < i; j++)
+			scale *= two64;
+		limb = t / scale;
+		t -= (double)limb * scale;
+		if (t < 0)
+			t = 0;
+		for (j = 0; j < 8; j++)
+			target[i * 8 + j] = limb >> (8 * j);
+	}
 }
 
-static void *api_thread(void *userdata)
+/* Build a work item from the pool's current stratum job or block template
+ * with the next extranonce2, no network traffic is needed */
+static bool gen_stratum_work(struct pool *pool, struct work *work)
 {
-	struct thr_info *mythr = userdata;
+	unsigned char merkle_root[64], *nonce2, target[32];
+	char header[257], merkle_hash[65];
+	uint32_t *root32 = (uint32_t *)merkle_root;
+	uint32_t swapped[8];
+	double diff;
+	int i;
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	mutex_lock(&pool->stratum_lock);
+	if (!pool->stratum_notify) {
+		mutex_unlock(&pool->stratum_lock);
+		return false;
+	}
 
-	api();
+	work->nonce2 = pool->nonce2++;
+	nonce2 = pool->swork.coinbase + pool->swork.nonce2_offset;
+	memset(nonce2, 0, pool->n2size);
+	for (i = 0; i < (int)pool->n2size && i < 4; i++)
+		nonce2[i] = work->nonce2 >> (8 * i);
 
-	PTH(mythr) = 0L;
+	gen_hash(pool->swork.coinbase, merkle_root, pool->swork.cb_len);
+	for (i = 0; i < pool->swork.merkles; i++) {
+		memcpy(merkle_root + 32, pool->swork.merkle[i], 32);
+		gen_hash(merkle_root, merkle_root, 64);
+	}
+	for (i = 0; i < 8; i++)
+		swapped[i] = swab32(root32[i]);
+	__bin2hex(merkle_hash, (unsigned char *)swapped, 32);
 
-	return NULL;
-}
+	snprintf(header, sizeof(header), "%s%s%s%s%s%s%s",
+		 pool->swork.bbversion, pool->swork.prev_hash, merkle_hash,
+		 pool->swork.ntime, pool->swork.nbit, "00000000", workpadding);
+	strncpy(work->job_id, pool->swork.job_id, sizeof(work->job_id) - 1);
+	work->stratum_session = pool->stratum_session;
+	diff = pool->swork.diff;
+	memcpy(target, pool->swork.target, sizeof(target));
+	mutex_unlock(&pool->stratum_lock);
 
-static void thread_reportin(struct thr_info *thr)
-{
-	gettimeofday(&thr->last, NULL);
-	thr->cgpu->status = LIFE_WELL;
-	thr->getwork = false;
-}
+	if (unlikely(!hex2bin(work->data, header, sizeof(work->data))))
+		return false;
+	if (pool->has_gbt)
+		memcpy(work->target, target, sizeof(target));
+	else
+		set_work_target(work->target, diff);
+	work_complete(work, GW_RESULT | GW_DATA | GW_TARGET);
 
-static inline void thread_reportout(struct thr_info *thr)
-{
-	thr->getwork = true;
+	work->pool = pool;
+	work->gbt = pool->has_gbt;
+	work->stratum = !work->gbt;
+	stat_inc(local_work);
+	return true;
 }
 
-static void hashmeter(int thr_id, struct timeval *diff,
+/* Send a solved stratum share. The work is kept until the reply comes back
+ * to the stratum thread. */
+static void stratum_submit(struct work *work)
+{
+	struct pool *pool = work->pool;
+	struct stratum_share *sshare;
+	char nonce2hex[17], noncehex[9], ntimehex[9];
+	unsigned char nonce2[8] = { };
+	json_t *req;
+	int i;
+
+	if (!pool->stratum_auth) {
+		submit_upstream_result(work, NULL);
+		free_work(work);
+		return;
+	}
+
+	for (i = 0; i < (int)pool->n2size && i < 4; i++)
+		nonce2[i] = work->nonce2 >> (8 * i);
+	__bin2hex(nonce2hex, nonce2, pool->n2size);
+	__bin2hex(ntimehex, work->data + 68, 4);
+	__bin2hex(noncehex, work->data + 76, 4);
+
+	sshare = calloc(sizeof(*sshare), 1);
+	if (unlikely(!sshare))
+		quit(1, "Failed to calloc sshare in stratum_submit");
+	sshare->work = work;
+	mutex_lock(&sshare_lock);
+	sshare->id = sshare_id++;
+	HASH_ADD_INT(stratum_shares, id, sshare);
+	mutex_unlock(&sshare_lock);
+
+	req = json_pack("{s:[s,s,s,s,s],s:i,s:s}",
+			"params", pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex,
+			"id", sshare->id, "method", "mining.submit");
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s stratum submit id %d", pool->rpc_url, sshare->id);
+	if (unlikely(!stratum_send_json(pool, req))) {
+		mutex_lock(&sshare_lock);
+		HASH_DEL(stratum_shares, sshare);
+		mutex_unlock(&sshare_lock);
+		submit_upstream_result(work, NULL);
+		free_work(work);
+		free(sshare);
+	}
+}
+
+/* Build the submitblock request for a block found on getblocktemplate work,
+ * NULL if the template it was built from has been dropped */
+static char *submit_block_req(struct work *work)
+{
+	char *block, *workid, *s;
+	json_t *req, *params;
+
+	block = gbt_block(work->pool, work, &workid);
+	if (!block)
+		return NULL;
+
+	params = json_array();
+	json_array_append_new(params, json_string(block));
+	if (workid) {
+		json_t *obj = json_object();
+
+		json_object_set_new(obj, "workid", json_string(workid));
+		json_array_append_new(params, obj);
+	}
+	req = json_object();
+	json_object_set_new(req, "method", json_string("submitblock"));
+	json_object_set_new(req, "params", params);
+	json_object_set_new(req, "id", json_integer(1));
+	s = json_dumps(req, JSON_COMPACT);
+	json_decref(req);
+	free(workid);
+	free(block);
+	if (unlikely(!s))
+		quit(1, "Failed to build submitblock request");
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "DBG: sending %s submitblock RPC call: %s", work->pool->rpc_url, s);
+	return s;
+}
+
+/* Account for the reply to a stratum share. Returns false if the reply
+ * does not belong to any share */
+static bool parse_stratum_response(json_t *val)
+{
+	struct stratum_share *sshare;
+	json_t *id_val;
+	int id;
+
+	id_val = json_object_get(val, "id");
+	if (!json_is_integer(id_val))
+		return false;
+	id = json_integer_value(id_val);
+	mutex_lock(&sshare_lock);
+	HASH_FIND_INT(stratum_shares, &id, sshare);
+	if (sshare)
+		HASH_DEL(stratum_shares, sshare);
+	mutex_unlock(&sshare_lock);
+	if (!sshare)
+		return false;
+
+	submit_upstream_result(sshare->work, json_incref(val));
+	free_work(sshare->work);
+	free(sshare);
+	return true;
+}
+
+/* The connection went away, so will any replies to shares sent on it */
+static void clear_stratum_shares(struct pool *pool)
+{
+	struct stratum_share *sshare, *tmp;
+
+	mutex_lock(&sshare_lock);
+	HASH_ITER(hh, stratum_shares, sshare, tmp) {
+		if (sshare->work->pool != pool)
+			continue;
+		HASH_DEL(stratum_shares, sshare);
+		submit_upstream_result(sshare->work, NULL);
+		free_work(sshare->work);
+		free(sshare);
+	}
+	mutex_unlock(&sshare_lock);
+}
+
+/* The workio thread runs a single event loop driving all getwork and submit
+ * requests through a curl multi handle. Commands arriving on its queue are
+ * placed on the pending list, started when their pool has fewer than
+ * --pool-inflight requests outstanding, and failed requests are put on a
+ * timer list to be retried after fail_pause instead of sleeping. */
+static CURLM *workio_multi;
+static LIST_HEAD(workio_pending);
+static LIST_HEAD(workio_timers);
+static LIST_HEAD(workio_getting);
+/* Set once --retries is exhausted; the loop exits and main with it */
+static bool workio_giveup;
+
+/* Replies needed from a pool before its latency decides when to hedge */
+#define HEDGE_MIN_REPLIES 16
+
+static void workio_queue(struct workio_cmd *wc)
+{
+	list_add_tail(&wc->list, &workio_pending);
+	wc->pool->workio_queued++;
+	total_workio_queued++;
+}
+
+static void workio_unqueue(struct workio_cmd *wc)
+{
+	list_del(&wc->list);
+	wc->pool->workio_queued--;
+	total_workio_queued--;
+}
+
+/* Retry the command once fail_pause has expired, keeping the timer list
+ * sorted by due time */
+static void workio_defer(struct workio_cmd *wc)
+{
+	struct workio_cmd *pos;
+
+	gettimeofday(&wc->tv_due, NULL);
+	wc->tv_due.tv_sec += fail_pause;
+	fail_pause += opt_fail_pause;
+	wc->attempts = 0;
+
+	list_for_each_entry(pos, &workio_timers, list) {
+		if (timercmp(&wc->tv_due, &pos->tv_due, <))
+			break;
+	}
+	list_add_tail(&wc->list, &pos->list);
+	wc->pool->workio_queued++;
+	total_workio_queued++;
+}
+
+/* Send a getwork to the command's pool, or generate the work straight away
+ * if that pool speaks stratum */
+static void workio_queue_pool(struct workio_cmd *wc)
+{
+	struct work *work = wc->u.work;
+
+	if (!wc->pool->has_stratum && !wc->pool->has_gbt) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", wc->pool->rpc_url, rpc_req);
+		workio_queue(wc);
+		return;
+	}
+
+	if (unlikely(!gen_stratum_work(wc->pool, work))) {
+		applog(LOG_DEBUG, "No stratum job from pool %d, retry after %d seconds",
+		       wc->pool->pool_no, fail_pause);
+		workio_defer(wc);
+		return;
+	}
+	stat_inc(total_getworks);
+	stat_inc(wc->pool->getwork_requested);
+	if (wc->hedge && wc->partner && getwork_waiting)
+		stat_inc(hedge_rescues);
+	wc->u.work = NULL;
+	if (unlikely(!tq_push(thr_info[stage_thr_id].q, work))) {
+		applog(LOG_ERR, "Failed to tq_push work in workio_queue_get");
+		kill_work();
+		free_work(work);
+	}
+	workio_cmd_free(wc);
+}
+
+/* Send a getwork to the preferred pool */
+static void workio_queue_get(struct workio_cmd *wc)
+{
+	wc->pool = select_pool(wc->lagging);
+	workio_queue_pool(wc);
+}
+
+static void workio_get_work(struct workio_cmd *wc)
+{
+	INIT_LIST_HEAD(&wc->batch);
+	wc->u.work = make_work();
+	wc->u.work->thr = wc->thr;
+	if (wc->warm)
+		workio_queue_pool(wc);
+	else
+		workio_queue_get(wc);
+}
+
+static void workio_submit_work(struct workio_cmd *wc)
+{
+	struct work *work = wc->u.work;
+	struct pool *pool = work->pool;
+
+	INIT_LIST_HEAD(&wc->batch);
+	if (!opt_submit_stale && stale_work(work, true)) {
+		applog(LOG_NOTICE, "Stale share detected, discarding");
+		stat_inc(total_stale);
+		stat_inc(pool->stale_shares);
+		workio_cmd_free(wc);
+		return;
+	}
+
+#ifdef __BIG_ENDIAN__
+        int swapcounter = 0;
+        for (swapcounter = 0; swapcounter < 32; swapcounter++)
+            (((uint32_t*) (work->data))[swapcounter]) = swab32(((uint32_t*) (work->data))[swapcounter]);
+#endif
+
+	if (work->stratum) {
+		wc->u.work = NULL;
+		workio_cmd_free(wc);
+		stratum_submit(work);
+		return;
+	}
+
+	/* Blocks go out straight away and on their own */
+	if (work->gbt) {
+		wc->rpc_req = submit_block_req(work);
+		if (unlikely(!wc->rpc_req)) {
+			applog(LOG_NOTICE, "Block found on a dropped template, discarding");
+			stat_inc(total_stale);
+			stat_inc(pool->stale_shares);
+			workio_cmd_free(wc);
+			return;
+		}
+		wc->pool = pool;
+		workio_queue(wc);
+		return;
+	}
+
+	/* Hold the share back for up to --submit-window ms so others for the
+	 * same pool can go with it */
+	gettimeofday(&wc->tv_due, NULL);
+	wc->tv_due.tv_usec += opt_submit_window * 1000;
+	wc->tv_due.tv_sec += wc->tv_due.tv_usec / 1000000;
+	wc->tv_due.tv_usec %= 1000000;
+
+	wc->pool = pool;
+	workio_queue(wc);
+}
+
+static void workio_start(struct workio_cmd *wc)
+{
+	struct pool *pool = wc->pool;
+	const char *req;
+
+	workio_unqueue(wc);
+	gettimeofday(&wc->tv_start, NULL);
+
+	if (wc->cmd == WC_SUBMIT_WORK) {
+		if (!wc->rpc_req) {
+			wc->rpc_req = submit_upstream_req(wc->u.work, 1);
+			if (unlikely(!wc->rpc_req))
+				quit(1, "Failed to build submit request in workio_start");
+		}
+		/* Force a fresh connection in case there are dead persistent
+		 * connections to this pool */
+		if (pool_isset(pool, &pool->submit_fail))
+			wc->fresh = true;
+	}
+	wc->ce = pop_curl_entry(pool, false);
+	if (wc->rpc_req)
+		req = wc->rpc_req;
+	else
+		req = rpc_req;
+	if (wc->fresh) {
+		curl_easy_setopt(wc->ce->curl, CURLOPT_FRESH_CONNECT, 1);
+		wc->fresh = false;
+	}
+
+	wc->rt = json_rpc_setup(wc->ce->curl, pool->rpc_url, req, false, false, pool);
+	if (unlikely(!wc->rt))
+		quit(1, "Failed to setup rpc transfer in workio_start");
+	if (wc->cmd == WC_SUBMIT_WORK)
+		json_rpc_stats(wc->rt, &pool->submit_stats);
+	/* A pool that can't take a connection for work within --fail-detect
+	 * is counted as failing. Shares are given the usual time as they
+	 * would be lost */
+	if (wc->cmd == WC_GET_WORK && opt_fail_detect)
+		curl_easy_setopt(wc->ce->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)opt_fail_detect);
+	if (wc->cmd == WC_GET_WORK && list_empty(&wc->batch))
+		json_rpc_stream_work(wc->rt, wc->u.work);
+	curl_easy_setopt(wc->ce->curl, CURLOPT_PRIVATE, wc);
+	if (unlikely(curl_multi_add_handle(workio_multi, wc->ce->curl)))
+		quit(1, "Failed to add curl handle in workio_start");
+
+	pool->workio_inflight++;
+	total_workio_inflight++;
+
+	/* Getworks slower than the --hedge percentile of the pool's recent
+	 * ones may get a duplicate sent elsewhere */
+	if (wc->cmd == WC_GET_WORK) {
+		list_add_tail(&wc->running, &workio_getting);
+		timerclear(&wc->tv_hedge);
+		if (opt_hedge && !wc->hedge && pool->getwork_stats.replies >= HEDGE_MIN_REPLIES) {
+			unsigned int ms = rpc_stats_pct(&pool->getwork_stats, opt_hedge);
+
+			wc->tv_hedge.tv_sec = wc->tv_start.tv_sec + ms / 1000;
+			wc->tv_hedge.tv_usec = wc->tv_start.tv_usec + ms % 1000 * 1000;
+			if (wc->tv_hedge.tv_usec >= 1000000) {
+				wc->tv_hedge.tv_sec++;
+				wc->tv_hedge.tv_usec -= 1000000;
+			}
+		}
+	}
+}
+
+/* Gather up to 'max' pending commands of the same kind for the same pool
+ * behind this one and send them all as a single JSON-RPC batch request */
+static void workio_start_batch(struct workio_cmd *leader, int max)
+{
+	struct workio_cmd *wc, *tmp;
+	size_t len = 1, reqlen;
+	char *req = NULL, *s;
+	int n = 1;
+
+	list_for_each_entry_safe(wc, tmp, &workio_pending, list) {
+		if (n >= max)
+			break;
+		if (wc == leader || wc->cmd != leader->cmd || wc->pool != leader->pool)
+			continue;
+		workio_unqueue(wc);
+		list_add_tail(&wc->list, &leader->batch);
+		if (wc->fresh) {
+			leader->fresh = true;
+			wc->fresh = false;
+		}
+		n++;
+	}
+
+	if (n == 1) {
+		workio_start(leader);
+		return;
+	}
+
+	/* The leader is request id 0 and the others follow in list order */
+	wc = leader;
+	for (n = 0; ; n++) {
+		if (wc->cmd == WC_SUBMIT_WORK)
+			s = submit_upstream_req(wc->u.work, n);
+		else {
+			s = malloc(64);
+			if (s)
+				sprintf(s, "{\"method\": \"getwork\", \"params\": [], \"id\":%d}", n);
+		}
+		if (unlikely(!s))
+			quit(1, "Failed to build request in workio_start_batch");
+		reqlen = strlen(s);
+		req = realloc(req, len + reqlen + 2);
+		if (unlikely(!req))
+			quit(1, "Failed to realloc req in workio_start_batch");
+		req[len - 1] = n ? ',' : '[';
+		memcpy(req + len, s, reqlen);
+		len += reqlen + 1;
+		free(s);
+
+		if (wc->list.next == &leader->batch)
+			break;
+		wc = list_entry(wc == leader ? leader->batch.next : wc->list.next,
+				struct workio_cmd, list);
+	}
+	req[len - 1] = ']';
+	req[len] = '\0';
+
+	free(leader->rpc_req);
+	leader->rpc_req = req;
+	if (opt_debug)
+		applog(LOG_DEBUG, "Batching %d %s requests to pool %d", n + 1,
+		       leader->cmd == WC_SUBMIT_WORK ? "submit" : "getwork",
+		       leader->pool->pool_no);
+	workio_start(leader);
+}
+
+/* Milliseconds from now until tv, 0 if it has passed */
+static int ms_until(struct timeval *now, struct timeval *tv)
+{
+	if (!timercmp(now, tv, <))
+		return 0;
+	return (tv->tv_sec - now->tv_sec) * 1000 + (tv->tv_usec - now->tv_usec) / 1000 + 1;
+}
+
+static int pending_submits(struct pool *pool)
+{
+	struct workio_cmd *wc;
+	int ret = 0;
+
+	list_for_each_entry(wc, &workio_pending, list) {
+		if (wc->cmd == WC_SUBMIT_WORK && wc->pool == pool)
+			ret++;
+	}
+	return ret;
+}
+
+static void min_wait(int *wait, int delay)
+{
+	if (!*wait || delay < *wait)
+		*wait = delay;
+}
+
+/* Start the pending requests of one kind that the per pool limits allow */
+static void workio_kick_cmd(enum workio_commands cmd, struct timeval *now, int *wait)
+{
+	struct workio_cmd *wc, *tmp;
+	int delay;
+
+restart:
+	list_for_each_entry_safe(wc, tmp, &workio_pending, list) {
+		if (wc->cmd != cmd || wc->pool->workio_inflight >= opt_pool_inflight)
+			continue;
+		if (wc->cmd == WC_SUBMIT_WORK && opt_submit_batch > 1 && !wc->pool->no_batch &&
+		    !wc->pool->has_gbt) {
+			delay = ms_until(now, &wc->tv_due);
+			if (delay && pending_submits(wc->pool) < opt_submit_batch) {
+				min_wait(wait, delay);
+				continue;
+			}
+		}
+		delay = net_throttle(wc->pool, wc->cmd == WC_SUBMIT_WORK ? NET_SUBMIT : NET_GETWORK);
+		if (delay) {
+			min_wait(wait, delay);
+			continue;
+		}
+		/* Batching can take more than one entry off the list */
+		if (wc->cmd == WC_GET_WORK && opt_getwork_batch > 1 && !wc->pool->no_batch) {
+			workio_start_batch(wc, opt_getwork_batch);
+			goto restart;
+		}
+		if (wc->cmd == WC_SUBMIT_WORK && opt_submit_batch > 1 && !wc->pool->no_batch &&
+		    !wc->pool->has_gbt) {
+			workio_start_batch(wc, opt_submit_batch);
+			goto restart;
+		}
+		workio_start(wc);
+	}
+}
+
+/* Start whatever pending requests the per pool limits allow, submits first
+ * so they get any free request slots and never wait behind getworks. Returns
+ * the number of milliseconds until a request that was held back may start, 0
+ * if none are waiting on time */
+static int workio_kick(void)
+{
+	struct timeval now;
+	int wait = 0;
+
+	gettimeofday(&now, NULL);
+	workio_kick_cmd(WC_SUBMIT_WORK, &now, &wait);
+	workio_kick_cmd(WC_GET_WORK, &now, &wait);
+	return wait;
+}
+
+/* Move expired timers back to the pending list. Returns the number of
+ * milliseconds until the next timer is due, or -1 if there are none */
+static long workio_run_timers(void)
+{
+	struct workio_cmd *wc, *tmp;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	list_for_each_entry_safe(wc, tmp, &workio_timers, list) {
+		if (timercmp(&wc->tv_due, &now, >))
+			return (wc->tv_due.tv_sec - now.tv_sec) * 1000 +
+			       (wc->tv_due.tv_usec - now.tv_usec) / 1000 + 1;
+
+		workio_unqueue(wc);
+		/* Getworks go to whichever pool is now preferred */
+		if (wc->cmd == WC_GET_WORK)
+			workio_queue_get(wc);
+		else
+			workio_queue(wc);
+	}
+	return -1;
+}
+
+/* The reply to a getwork came in, either as 'val' or already decoded into the
+ * work item as it streamed in, in which case 'fields' is set */
+static void workio_got_work(struct workio_cmd *wc, json_t *val, bool rolltime,
+			    unsigned int fields)
+{
+	struct work *work = wc->u.work;
+	struct pool *pool = wc->pool;
+	bool rc;
+
+	if (val || fields) {
+		work->rolltime = rolltime;
+		if (fields) {
+			work_complete(work, fields);
+			rc = true;
+		} else {
+			rc = work_decode(json_object_get(val, "result"), work);
+			json_decref(val);
+		}
+		if (likely(rc)) {
+			/* The first of a hedged pair back is the one used, the
+			 * other's work is staged as a spare */
+			if (wc->partner) {
+				if (wc->hedge && getwork_waiting)
+					stat_inc(hedge_rescues);
+				wc->partner->partner = NULL;
+				wc->partner = NULL;
+			}
+			work->pool = pool;
+			roll_frac = (roll_frac * 15 + (rolltime ? 1 : 0)) / 16;
+			stat_inc(total_getworks);
+			stat_inc(pool->getwork_requested);
+			fail_pause = opt_fail_pause;
+
+			/* Prefetched work waits for the switch to its pool */
+			if (wc->warm) {
+				wc->u.work = NULL;
+				if (warm_park(work)) {
+					workio_cmd_free(wc);
+					return;
+				}
+				inc_queued();
+			}
+
+			if (opt_debug)
+				applog(LOG_DEBUG, "Pushing work to requesting thread");
+
+			/* send work to requesting thread */
+			wc->u.work = NULL;
+			if (unlikely(!tq_push(thr_info[stage_thr_id].q, work))) {
+				applog(LOG_ERR, "Failed to tq_push work in workio_get_work");
+				kill_work();
+				free_work(work);
+			}
+			workio_cmd_free(wc);
+			return;
+		}
+		/* Force a fresh connection in case there are dead persistent
+		 * connections */
+		wc->fresh = true;
+	} else if (donor(pool)) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "Donor pool lagging");
+		wc->lagging = true;
+		wc->attempts = 0;
+		workio_queue_get(wc);
+		return;
+	}
+
+	/* A failed duplicate is not retried, the original still is, nor is
+	 * a failed prefetch */
+	if (wc->hedge || wc->warm) {
+		if (wc->hedge)
+			dec_queued();
+		workio_cmd_free(wc);
+		return;
+	}
+
+	/* Once the pool has been found dead the getwork goes elsewhere */
+	if (pool->idle && pool != current_pool()) {
+		wc->attempts = 0;
+		workio_queue_get(wc);
+		return;
+	}
+
+	/* A single failure response here might be reported as a dead pool and
+	 * there may be temporary denied messages etc. falsely reporting
+	 * failure so retry a few times before giving up */
+	if (++wc->attempts < 3) {
+		workio_queue(wc);
+		return;
+	}
+
+	applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
+	if (unlikely((opt_retries >= 0) && (++wc->failures > opt_retries))) {
+		applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
+		workio_cmd_free(wc);
+		workio_giveup = true;
+		return;
+	}
+
+	/* pause, then restart work-request loop */
+	applog(LOG_DEBUG, "json_rpc_call failed on get work, retry after %d seconds",
+		fail_pause);
+	workio_defer(wc);
+}
+
+static void workio_submitted(struct workio_cmd *wc, json_t *val)
+{
+	struct work *work = wc->u.work;
+	struct pool *pool = wc->pool;
+
+	if (submit_upstream_result(work, val)) {
+		fail_pause = opt_fail_pause;
+		if (wc->spooled) {
+			pool->spool_replayed++;
+			goto spool_done;
+		}
+		goto out;
+	}
+
+	if (!opt_submit_stale && stale_work(work, true)) {
+		applog(LOG_NOTICE, "Stale share detected, discarding");
+		stat_inc(total_stale);
+		stat_inc(pool->stale_shares);
+		if (wc->spooled) {
+			stat_inc(pool->spool_dropped);
+			goto spool_done;
+		}
+		goto out;
+	}
+
+#if defined(unix)
+	/* Still down, replay from this share again after the pause */
+	if (wc->spooled) {
+		pool->spool_inflight--;
+		if (pool->spool_next > wc->spool_slot)
+			pool->spool_next = wc->spool_slot;
+		pool->spool_retry = time(NULL) + opt_fail_pause;
+		goto out;
+	}
+	/* Keep the share on disk until the pool is back rather than retrying
+	 * it from memory. Blocks need their template so are retried as
+	 * before, as are shares that find the spool full */
+	if (pool->spool && !work->gbt && spool_add(pool, work) >= 0) {
+		if (opt_debug)
+			applog(LOG_DEBUG, "Spooled share for pool %d", pool->pool_no);
+		goto out;
+	}
+#endif
+
+	if (unlikely((opt_retries >= 0) && (++wc->failures > opt_retries))) {
+		applog(LOG_ERR, "Failed %d retries ...terminating workio thread", opt_retries);
+		workio_cmd_free(wc);
+		workio_giveup = true;
+		return;
+	}
+
+	/* pause, then restart work-request loop */
+	applog(LOG_INFO, "json_rpc_call failed on submit_work, retry after %d seconds",
+		fail_pause);
+	workio_defer(wc);
+	return;
+spool_done:
+#if defined(unix)
+	pool->spool_inflight--;
+	spool_done(pool, wc->spool_slot);
+#endif
+out:
+	workio_cmd_free(wc);
+}
+
+#if defined(unix)
+/* Most shares a pool has replaying from its spool at once */
+#define SPOOL_REPLAY 8
+
+/* Replay spooled shares, oldest first, to each pool that is up again. A
+ * round of them is sent only once the last has been answered so a failure
+ * can go back to the first share that failed without sending any twice */
+static void workio_replay_spools(void)
+{
+	time_t now = time(NULL);
+	struct workio_cmd *wc;
+	struct spool_rec *rec;
+	char hexstr[37];
+	struct work *work;
+	int i;
+
+	/* The current block must be known to tell the stale shares */
+	if (!new_blocks)
+		return;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (!pool->spool || pool->spool_inflight || pool->idle ||
+		    pool->spool_next >= pool->spool_tail || now < pool->spool_retry)
+			continue;
+
+		while (pool->spool_next < pool->spool_tail &&
+		       pool->spool_inflight < SPOOL_REPLAY) {
+			rec = &pool->spool[pool->spool_next];
+			if (rec->done) {
+				pool->spool_next++;
+				continue;
+			}
+
+			work = make_work();
+			memcpy(work->data, rec->data, sizeof(work->data));
+			work->pool = pool;
+			/* The device that found it may be gone or renumbered */
+			work->thr_id = mining_threads;
+			work->tv_staged.tv_sec = rec->time;
+			__bin2hex(hexstr, work->data, 18);
+			work->work_block = strcmp(hexstr, current_block) ? work_block - 1 : work_block;
+			if (!opt_submit_stale && stale_work(work, true)) {
+				stat_inc(total_stale);
+				stat_inc(pool->stale_shares);
+				stat_inc(pool->spool_dropped);
+				free_work(work);
+				spool_done(pool, pool->spool_next++);
+				continue;
+			}
+
+			wc = make_workio_cmd();
+			wc->cmd = WC_SUBMIT_WORK;
+			wc->u.work = work;
+			wc->pool = pool;
+			wc->spooled = true;
+			wc->spool_slot = pool->spool_next++;
+			INIT_LIST_HEAD(&wc->batch);
+			gettimeofday(&wc->tv_due, NULL);
+			pool->spool_inflight++;
+			workio_queue(wc);
+		}
+	}
+}
+#endif
+
+/* Find the member of a batch reply answering request 'id', returning a
+ * reference to it if it carries a valid result */
+static json_t *batch_reply(json_t *val, int id)
+{
+	json_t *reply, *res_val, *err_val, *id_val;
+	unsigned int i;
+
+	for (i = 0; i < json_array_size(val); i++) {
+		reply = json_array_get(val, i);
+		id_val = json_object_get(reply, "id");
+		if (!json_is_integer(id_val) || json_integer_value(id_val) != id)
+			continue;
+
+		res_val = json_object_get(reply, "result");
+		err_val = json_object_get(reply, "error");
+		if (!res_val || json_is_null(res_val) ||
+		    (err_val && !json_is_null(err_val)))
+			return NULL;
+		return json_incref(reply);
+	}
+	return NULL;
+}
+
+static void workio_got_batch(struct workio_cmd *leader, json_t *val,
+			     bool rolltime)
+{
+	struct pool *pool = leader->pool;
+	struct workio_cmd *wc, *tmp;
+	int id = 1;
+
+	free(leader->rpc_req);
+	leader->rpc_req = NULL;
+
+	/* A pool that answered but not with an array, typically with a
+	 * method not found or parse error, doesn't understand batches, so
+	 * send these again singly and don't batch it again. HTTP errors may
+	 * just be an overloaded pool and are retried as any other failure */
+	if (val && !json_is_array(val)) {
+		applog(LOG_WARNING, "Pool %d does not support batched requests, using single requests",
+		       pool->pool_no);
+		json_decref(val);
+		pool->no_batch = true;
+		list_for_each_entry_safe(wc, tmp, &leader->batch, list) {
+			list_del(&wc->list);
+			workio_queue(wc);
+		}
+		workio_queue(leader);
+		return;
+	}
+
+	if (val) {
+		if (leader->cmd == WC_SUBMIT_WORK)
+			pool->submit_batches++;
+		else
+			pool->getwork_batches++;
+	}
+	list_for_each_entry_safe(wc, tmp, &leader->batch, list) {
+		list_del(&wc->list);
+		if (wc->cmd == WC_SUBMIT_WORK)
+			workio_submitted(wc, val ? batch_reply(val, id) : NULL);
+		else
+			workio_got_work(wc, val ? batch_reply(val, id) : NULL, rolltime, 0);
+		id++;
+	}
+	if (leader->cmd == WC_SUBMIT_WORK)
+		workio_submitted(leader, val ? batch_reply(val, 0) : NULL);
+	else
+		workio_got_work(leader, val ? batch_reply(val, 0) : NULL, rolltime, 0);
+	if (val)
+		json_decref(val);
+}
+
+static void pool_died(struct pool *pool);
+
+/* Transport errors meaning nothing is listening at the pool's address, as
+ * opposed to a request that merely went wrong. Timeouts and dropped
+ * connections happen to live pools too, so they only count towards
+ * FAIL_STREAK */
+static bool pool_unreachable(CURLcode result)
+{
+	switch (result) {
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Getworks waiting to go to 'pool' are sent to whichever pool is now
+ * preferred instead */
+static void workio_reroute(struct pool *pool)
+{
+	struct workio_cmd *wc, *tmp;
+
+	list_for_each_entry_safe(wc, tmp, &workio_pending, list) {
+		if (wc->pool != pool || wc->cmd != WC_GET_WORK || wc->hedge || wc->warm)
+			continue;
+		workio_unqueue(wc);
+		wc->attempts = 0;
+		workio_queue_get(wc);
+	}
+}
+
+/* Declare a pool dead as soon as it refuses connections, or after
+ * FAIL_STREAK requests in a row have failed or timed out, rather than
+ * waiting for devices to run out of work */
+#define FAIL_STREAK 3
+
+static void workio_pool_failed(struct pool *pool, CURLcode result)
+{
+	if (donor(pool) || pool->idle)
+		return;
+	if (!pool_unreachable(result) && ++pool->fail_streak < FAIL_STREAK)
+		return;
+	pool_died(pool);
+	if (pool != current_pool())
+		workio_reroute(pool);
+}
+
+static void workio_done(struct workio_cmd *wc, CURLcode result)
+{
+	struct pool *pool = wc->pool;
+	unsigned int fields = 0;
+	bool rolltime = false;
+	bool batch = false;
+	json_t *val;
+
+	curl_multi_remove_handle(workio_multi, wc->ce->curl);
+	if (wc->cmd == WC_GET_WORK)
+		list_del(&wc->running);
+	if (!list_empty(&wc->batch)) {
+		batch = true;
+		val = json_rpc_finish_batch(wc->rt, result, &rolltime);
+	} else if (wc->cmd == WC_GET_WORK)
+		val = json_rpc_finish_work(wc->rt, result, &rolltime, &fields);
+	else if (wc->cmd == WC_SUBMIT_WORK && wc->u.work->gbt)
+		val = json_rpc_finish_submitblock(wc->rt, result, &rolltime);
+	else
+		val = json_rpc_finish(wc->rt, result, &rolltime);
+	wc->rt = NULL;
+	push_curl_entry(wc->ce, pool);
+	wc->ce = NULL;
+	pool->workio_inflight--;
+	total_workio_inflight--;
+
+	if (result != CURLE_OK || (!val && !fields))
+		workio_pool_failed(pool, result);
+	else
+		pool->fail_streak = 0;
+
+	if (wc->cmd == WC_GET_WORK && result == CURLE_OK) {
+		struct timeval now, diff;
+
+		gettimeofday(&now, NULL);
+		timeval_subtract(&diff, &now, &wc->tv_start);
+		decay_time(&pool->getwork_rtt, diff.tv_sec + diff.tv_usec / 1000000.0);
+	}
+
+	if (batch) {
+		workio_got_batch(wc, val, rolltime);
+		return;
+	}
+
+	switch (wc->cmd) {
+	case WC_GET_WORK:
+		workio_got_work(wc, val, rolltime, fields);
+		break;
+	case WC_SUBMIT_WORK:
+		workio_submitted(wc, val);
+		break;
+	default:
+		if (val)
+			json_decref(val);
+		workio_cmd_free(wc);
+		break;
+	}
+}
+
+/* The pool to send a duplicate of a getwork to 'cp' to, the first alive one
+ * after it in priority order */
+static struct pool *hedge_pool(struct pool *cp)
+{
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = priority_pool(i);
+
+		if (pool != cp && pool->enabled && !pool->idle && !donor(pool))
+			return pool;
+	}
+	return NULL;
+}
+
+/* Getworks still outstanding past their hedge time while no work is staged,
+ * so devices are about to sit idle, get a duplicate sent to another pool.
+ * Returns the milliseconds until the next hedge time, -1 if there is none */
+static long workio_hedge(void)
+{
+	struct workio_cmd *wc, *hedge;
+	struct timeval now;
+	struct pool *pool;
+	long ms, wait = -1;
+
+	if (!opt_hedge)
+		return -1;
+
+	gettimeofday(&now, NULL);
+	list_for_each_entry(wc, &workio_getting, running) {
+		if (wc->hedge || wc->hedged || !timerisset(&wc->tv_hedge) || donor(wc->pool))
+			continue;
+		ms = ms_until(&now, &wc->tv_hedge);
+		if (ms) {
+			if (wait < 0 || ms < wait)
+				wait = ms;
+			continue;
+		}
+		if (requests_staged())
+			continue;
+		pool = hedge_pool(wc->pool);
+		if (!pool)
+			continue;
+
+		hedge = make_workio_cmd();
+		hedge->cmd = WC_GET_WORK;
+		INIT_LIST_HEAD(&hedge->batch);
+		hedge->u.work = make_work();
+		hedge->pool = pool;
+		hedge->hedge = true;
+		hedge->partner = wc;
+		wc->partner = hedge;
+		wc->hedged = true;
+		stat_inc(total_hedged);
+		inc_queued();
+		if (opt_debug)
+			applog(LOG_DEBUG, "Pool %d getwork slow, hedging with pool %d",
+			       wc->pool->pool_no, pool->pool_no);
+		workio_queue_pool(hedge);
+	}
+	return wait;
+}
+
+/* Send a command to the workio thread, waking it if it is waiting on the
+ * network */
+static bool workio_push(struct workio_cmd *wc)
+{
+	if (unlikely(!tq_push(thr_info[work_thr_id].q, wc)))
+		return false;
+#if LIBCURL_VERSION_NUM >= 0x074400
+	curl_multi_wakeup(workio_multi);
+#endif
+	return true;
+}
+
+static void *workio_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	/* An expired abstime makes tq_pop return immediately */
+	const struct timespec expired = { 0, 0 };
+	bool ok = true;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	while (ok) {
+		struct workio_cmd *wc;
+		long timeout, curl_timeout, hedge;
+		int running, msgs, delay;
+		bool done = false;
+		CURLMsg *msg;
+
+		/* take all the workio_cmds sent to us on our queue */
+		while ((wc = tq_pop(mythr->q, &expired))) {
+			switch (wc->cmd) {
+			case WC_GET_WORK:
+				workio_get_work(wc);
+				break;
+			case WC_SUBMIT_WORK:
+				workio_submit_work(wc);
+				break;
+			default:
+				workio_cmd_free(wc);
+				ok = false;
+				break;
+			}
+		}
+
+		timeout = workio_run_timers();
+#if defined(unix)
+		workio_replay_spools();
+#endif
+		hedge = workio_hedge();
+		delay = workio_kick();
+
+		curl_multi_perform(workio_multi, &running);
+		while ((msg = curl_multi_info_read(workio_multi, &msgs))) {
+			CURLcode result = msg->data.result;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&wc);
+			workio_done(wc, result);
+			done = true;
+		}
+		if (unlikely(workio_giveup))
+			break;
+		/* Completions may have queued retries, start them straight away */
+		if (done)
+			continue;
+
+		if (timeout < 0 || timeout > 1000)
+			timeout = 1000;
+		if (hedge >= 0 && hedge < timeout)
+			timeout = hedge;
+		if (delay && delay < timeout)
+			timeout = delay;
+		curl_multi_timeout(workio_multi, &curl_timeout);
+		if (curl_timeout >= 0 && curl_timeout < timeout)
+			timeout = curl_timeout;
+#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_poll(workio_multi, NULL, 0, timeout, NULL);
+#else
+		/* No way to wake the wait on new commands so keep it short */
+		if (timeout > 100)
+			timeout = 100;
+		curl_multi_wait(workio_multi, NULL, 0, timeout, NULL);
+#endif
+	}
+
+	tq_freeze(mythr->q);
+
+	return NULL;
+}
+
+static void *proxy_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	proxy();
+
+	PTH(mythr) = 0L;
+
+	return NULL;
+}
+
+static void *api_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	api();
+
+	PTH(mythr) = 0L;
+
+	return NULL;
+}
+
+static void thread_reportin(struct thr_info *thr)
+{
+	gettimeofday(&thr->last, NULL);
+	thr->cgpu->status = LIFE_WELL;
+	thr->getwork = false;
+}
+
+static inline void thread_reportout(struct thr_info *thr)
+{
+	thr->getwork = true;
+}
+
+static void hashmeter(int thr_id, struct timeval *diff,
 		      unsigned long hashes_done)
 {
 	struct timeval temp_tv_end, total_diff;
@@ -3986,22 +5860,148 @@ out_unlock:
 	}
 }
 
-static bool pool_active(struct pool *pool, bool pinging)
+static void *stratum_thread(void *userdata);
+
+/* Connect and authorise a stratum pool and wait for its first job. Once its
+ * thread is running that thread looks after reconnecting. */
+static bool stratum_active(struct pool *pool, bool pinging)
 {
-	bool ret = false;
+	struct work *work;
 	json_t *val;
-	CURL *curl;
-	bool rolltime;
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return false;
+	if (pool->stratum_thread_started)
+		return pool->stratum_auth && pool->stratum_notify;
+
+	if (!initiate_stratum(pool) || !auth_stratum(pool))
+		goto out_fail;
+	while (!pool->stratum_notify && sock_full(pool, 10) && recv_stratum(pool, &val)) {
+		if (val)
+			json_decref(val);
 	}
+	work = make_work();
+	if (!gen_stratum_work(pool, work)) {
+		free_work(work);
+		suspend_stratum(pool);
+		goto out_fail;
+	}
+	/* This job is the pool's first so it restarts nothing */
+	mutex_lock(&pool->stratum_lock);
+	pool->swork.clean = false;
+	mutex_unlock(&pool->stratum_lock);
+
+	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_thread, (void *)pool)))
+		quit(1, "Failed to create stratum thread for pool %d", pool->pool_no);
+	pool->stratum_thread_started = true;
+
+	applog(LOG_DEBUG, "Pushing pooltest work to base pool");
+	tq_push(thr_info[stage_thr_id].q, work);
+	stat_inc(total_getworks);
+	stat_inc(pool->getwork_requested);
+	inc_queued();
+	gettimeofday(&pool->tv_idle, NULL);
+	return true;
 
-	applog(LOG_INFO, "Testing pool %s", pool->rpc_url);
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, rpc_req,
-			true, false, &rolltime, pool);
+out_fail:
+	applog(LOG_DEBUG, "FAILED to get a stratum job from pool %u %s",
+	       pool->pool_no, pool->rpc_url);
+	if (!pinging)
+		applog(LOG_WARNING, "Pool %u slow/down or URL or credentials invalid", pool->pool_no);
+	return false;
+}
+
+/* A getblocktemplate request, waiting for the template to change from the
+ * one longpollid identifies if given */
+static char *gbt_request(const char *longpollid)
+{
+	json_t *req, *params, *param, *caps, *rules;
+	char *s;
+
+	caps = json_array();
+	json_array_append_new(caps, json_string("longpoll"));
+	json_array_append_new(caps, json_string("workid"));
+	rules = json_array();
+	json_array_append_new(rules, json_string("segwit"));
+	param = json_object();
+	json_object_set_new(param, "capabilities", caps);
+	json_object_set_new(param, "rules", rules);
+	if (longpollid)
+		json_object_set_new(param, "longpollid", json_string(longpollid));
+	params = json_array();
+	json_array_append_new(params, param);
+	req = json_object();
+	json_object_set_new(req, "id", json_integer(0));
+	json_object_set_new(req, "method", json_string("getblocktemplate"));
+	json_object_set_new(req, "params", params);
+	s = json_dumps(req, JSON_COMPACT);
+	json_decref(req);
+	if (unlikely(!s))
+		quit(1, "Failed to build getblocktemplate request");
+	return s;
+}
+
+static void *gbt_thread(void *userdata);
+
+/* Fetch a first block template and start the thread that follows the pool's
+ * templates after that */
+static bool gbt_active(struct pool *pool, bool pinging)
+{
+	struct curl_ent *ce;
+	struct work *work;
+	bool rolltime;
+	json_t *val;
+	char *req;
+
+	if (pool->gbt_thread_started)
+		return pool->gbt_active;
+
+	req = gbt_request(NULL);
+	ce = pop_curl_entry(pool, true);
+	val = json_rpc_call(ce->curl, pool->rpc_url, req, true, false, &rolltime, pool);
+	push_curl_entry(ce, pool);
+	free(req);
+	if (!val)
+		goto out_fail;
+	if (!gbt_decode(pool, json_object_get(val, "result"))) {
+		json_decref(val);
+		goto out_fail;
+	}
+	json_decref(val);
+
+	pool->has_gbt = true;
+	pool->gbt_active = true;
+	work = make_work();
+	if (unlikely(!gen_stratum_work(pool, work)))
+		quit(1, "Failed to generate work from pool %d template", pool->pool_no);
+	/* The first template restarts nothing */
+	mutex_lock(&pool->stratum_lock);
+	pool->swork.clean = false;
+	mutex_unlock(&pool->stratum_lock);
+
+	if (unlikely(pthread_create(&pool->gbt_thread, NULL, gbt_thread, (void *)pool)))
+		quit(1, "Failed to create getblocktemplate thread for pool %d", pool->pool_no);
+	pool->gbt_thread_started = true;
+	applog(LOG_NOTICE, "Solo mining on pool %d with getblocktemplate", pool->pool_no);
+
+	applog(LOG_DEBUG, "Pushing pooltest work to base pool");
+	tq_push(thr_info[stage_thr_id].q, work);
+	stat_inc(total_getworks);
+	stat_inc(pool->getwork_requested);
+	inc_queued();
+	gettimeofday(&pool->tv_idle, NULL);
+	return true;
+
+out_fail:
+	applog(LOG_DEBUG, "FAILED to get a block template from pool %u %s",
+	       pool->pool_no, pool->rpc_url);
+	if (pool->has_gbt && !pinging)
+		applog(LOG_WARNING, "Pool %u slow/down or URL or credentials invalid", pool->pool_no);
+	return false;
+}
+
+/* Stage the work a getwork probe of 'pool' got back in 'val', if any */
+static bool pool_probed(struct pool *pool, json_t *val, bool rolltime, bool pinging)
+{
+	bool ret = false;
 
 	if (val) {
 		struct work *work = make_work();
@@ -4017,10 +6017,11 @@ static bool pool_active(struct pool *pool, bool pinging)
 				applog(LOG_DEBUG, "Pushing pooltest work to base pool");
 
 			tq_push(thr_info[stage_thr_id].q, work);
-			total_getworks++;
-			pool->getwork_requested++;
+			stat_inc(total_getworks);
+			stat_inc(pool->getwork_requested);
 			inc_queued();
 			ret = true;
+			pool->gbt_checked = true;
 			gettimeofday(&pool->tv_idle, NULL);
 		} else {
 			applog(LOG_DEBUG, "Successfully retrieved but FAILED to decipher work from pool %u %s",
@@ -4039,36 +6040,342 @@ static bool pool_active(struct pool *pool, bool pinging)
 		}
 	}
 
-	curl_easy_cleanup(curl);
 	return ret;
 }
 
+static bool pool_active(struct pool *pool, bool pinging)
+{
+	json_t *val;
+	struct curl_ent *ce;
+	bool rolltime;
+
+	applog(LOG_INFO, "Testing pool %s", pool->rpc_url);
+	if (pool->has_stratum)
+		return stratum_active(pool, pinging);
+	/* With an address to pay try getblocktemplate until the pool has
+	 * shown it only does getwork */
+	if (pool->has_gbt || (btc_script_len && !pool->gbt_checked && !donor(pool))) {
+		if (gbt_active(pool, pinging))
+			return true;
+		if (pool->has_gbt)
+			return false;
+	}
+	ce = pop_curl_entry(pool, true);
+	val = json_rpc_call(ce->curl, pool->rpc_url, rpc_req,
+			true, false, &rolltime, pool);
+	push_curl_entry(ce, pool);
+
+	return pool_probed(pool, val, rolltime, pinging);
+}
+
 static void pool_died(struct pool *pool)
 {
 	if (!pool_tset(pool, &pool->idle)) {
 		if (!donor(pool))
 			applog(LOG_WARNING, "Pool %d %s not responding!", pool->pool_no, pool->rpc_url);
 		gettimeofday(&pool->tv_idle, NULL);
+		if (pool == current_pool())
+			switch_pools(NULL);
+	}
+}
+
+static inline int cp_prio(void)
+{
+	int prio;
+
+	mutex_lock(&control_lock);
+	prio = currentpool->prio;
+	mutex_unlock(&control_lock);
+	return prio;
+}
+
+static void pool_resus(struct pool *pool)
+{
+	if (!donor(pool))
+		applog(LOG_WARNING, "Pool %d %s recovered", pool->pool_no, pool->rpc_url);
+	if (pool->prio < cp_prio() && pool_strategy == POOL_FAILOVER)
 		switch_pools(NULL);
+}
+
+/* Idle pools are probed every PROBE_INTERVAL seconds to see if they have
+ * recovered. The probe thread sends getwork probes on a curl multi handle
+ * of its own, all at once and each within its pool's --probe-time, so a
+ * slow pool holds up neither the others nor the watchdog. Stratum and GBT
+ * pools can only be probed with blocking calls so get a thread each */
+#define PROBE_INTERVAL 60
+
+static void probe_result(struct pool *pool, bool ok)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &pool->tv_probe);
+	pool->probe_ms = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	pool->probe_ok = ok;
+	pool->probes++;
+	pool->probing = false;
+	if (ok) {
+		pool->fail_streak = 0;
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+	}
+}
+
+static void *probe_blocking(void *userdata)
+{
+	struct pool *pool = userdata;
+
+	pthread_detach(pthread_self());
+	probe_result(pool, pool_active(pool, true));
+	return NULL;
+}
+
+static void probe_start(CURLM *multi, struct pool *pool)
+{
+	pthread_t pth;
+
+	pool->probing = true;
+	gettimeofday(&pool->tv_probe, NULL);
+	pool->tv_idle = pool->tv_probe;
+
+	if (pool->has_stratum || pool->has_gbt ||
+	    (btc_script_len && !pool->gbt_checked && !donor(pool))) {
+		if (unlikely(pthread_create(&pth, NULL, probe_blocking, pool))) {
+			applog(LOG_ERR, "Failed to create probe thread for pool %d", pool->pool_no);
+			pool->probing = false;
+		}
+		return;
+	}
+
+	applog(LOG_INFO, "Testing pool %s", pool->rpc_url);
+	pool->probe_ce = pop_curl_entry(pool, false);
+	pool->probe_rt = json_rpc_setup(pool->probe_ce->curl, pool->rpc_url, rpc_req, true, false, pool);
+	if (unlikely(!pool->probe_rt))
+		quit(1, "Failed to setup rpc transfer in probe_start");
+	curl_easy_setopt(pool->probe_ce->curl, CURLOPT_PRIVATE, pool);
+	if (unlikely(curl_multi_add_handle(multi, pool->probe_ce->curl)))
+		quit(1, "Failed to add curl handle in probe_start");
+}
+
+static void probe_done(CURLM *multi, struct pool *pool, CURLcode result)
+{
+	bool rolltime = false;
+	json_t *val;
+
+	curl_multi_remove_handle(multi, pool->probe_ce->curl);
+	val = json_rpc_finish(pool->probe_rt, result, &rolltime);
+	pool->probe_rt = NULL;
+	push_curl_entry(pool->probe_ce, pool);
+	pool->probe_ce = NULL;
+	probe_result(pool, pool_probed(pool, val, rolltime, true));
+}
+
+static void *probe_thread(void *userdata)
+{
+	struct pool *pool;
+	CURLM *multi;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	multi = curl_multi_init();
+	if (unlikely(!multi)) {
+		applog(LOG_ERR, "CURL multi initialisation failed");
+		return NULL;
+	}
+
+	while (42) {
+		int i, running, msgs, timeout = 1000;
+		struct timeval now, due;
+		CURLMsg *msg;
+		long ms;
+
+		gettimeofday(&now, NULL);
+		for (i = 0; i <= total_pools; i++) {
+			if (i < total_pools)
+				pool = pools[i];
+			else if (opt_donation > 0.0)
+				pool = &donationpool;
+			else
+				break;
+
+			if (!pool->enabled || !pool->idle || pool->probing)
+				continue;
+			due = pool->tv_idle;
+			due.tv_sec += PROBE_INTERVAL;
+			ms = ms_until(&now, &due);
+			if (ms) {
+				if (ms < timeout)
+					timeout = ms;
+				continue;
+			}
+			probe_start(multi, pool);
+		}
+
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &msgs))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&pool);
+			probe_done(multi, pool, msg->data.result);
+		}
+
+		/* Sleep until the next probe is due even with none in flight,
+		 * when curl_multi_wait would return at once */
+#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_poll(multi, NULL, 0, timeout, NULL);
+#else
+		if (running)
+			curl_multi_wait(multi, NULL, 0, timeout, NULL);
+		else {
+			struct timespec rgtp = { timeout / 1000, (timeout % 1000) * 1000000 };
+
+			nanosleep(&rgtp, NULL);
+		}
+#endif
+	}
+
+	return NULL;
+}
+
+/* Stratum pools have a thread each reading the jobs they notify and the
+ * replies to shares. A clean job is treated like a longpoll, so one on a
+ * block already known still restarts the devices when it comes from the
+ * pool in use. */
+static void stratum_reconnect(struct pool *pool)
+{
+	clear_stratum_shares(pool);
+	suspend_stratum(pool);
+	pool_died(pool);
+
+	while (!initiate_stratum(pool) || !auth_stratum(pool)) {
+		applog(LOG_DEBUG, "Failed to reconnect to stratum pool %d, retry after %d seconds",
+		       pool->pool_no, opt_fail_pause);
+		sleep(opt_fail_pause);
+	}
+	if (pool_tclear(pool, &pool->idle))
+		pool_resus(pool);
+}
+
+static void *stratum_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		struct work *work;
+		json_t *val;
+		bool clean;
+
+		/* Pools send a new job at least every minute or two so a
+		 * connection quiet for longer than that has gone bad */
+		if (!sock_full(pool, 120) || !recv_stratum(pool, &val)) {
+			applog(LOG_INFO, "Stratum connection to pool %d interrupted", pool->pool_no);
+			stratum_reconnect(pool);
+			continue;
+		}
+		if (val) {
+			if (!parse_stratum_response(val))
+				applog(LOG_INFO, "Unexpected stratum reply from pool %d", pool->pool_no);
+			json_decref(val);
+		}
+
+		mutex_lock(&pool->stratum_lock);
+		clean = pool->swork.clean;
+		pool->swork.clean = false;
+		mutex_unlock(&pool->stratum_lock);
+		if (!clean)
+			continue;
+
+		work = make_work();
+		if (unlikely(!gen_stratum_work(pool, work))) {
+			free_work(work);
+			continue;
+		}
+		test_work_current(work, true);
+		if (unlikely(!tq_push(thr_info[stage_thr_id].q, work)))
+			applog(LOG_ERR, "Could not tq_push work in stratum_thread");
 	}
+
+	return NULL;
 }
 
-static inline int cp_prio(void)
+/* Solo pools have a thread each following the block templates with
+ * getblocktemplate longpoll, which answers when the pool has a new block or
+ * new transactions. A template on a new block is treated like a longpoll. */
+static void *gbt_thread(void *userdata)
 {
-	int prio;
+	struct pool *pool = (struct pool *)userdata;
+	CURL *curl;
 
-	mutex_lock(&control_lock);
-	prio = currentpool->prio;
-	mutex_unlock(&control_lock);
-	return prio;
-}
+	pthread_detach(pthread_self());
 
-static void pool_resus(struct pool *pool)
-{
-	if (!donor(pool))
-		applog(LOG_WARNING, "Pool %d %s recovered", pool->pool_no, pool->rpc_url);
-	if (pool->prio < cp_prio() && pool_strategy == POOL_FAILOVER)
-		switch_pools(NULL);
+	curl = pool_curl_init(pool);
+	if (unlikely(!curl))
+		quit(1, "CURL initialisation failed in gbt_thread");
+
+	while (42) {
+		struct work *work;
+		bool rolltime, clean;
+		char *req;
+		json_t *val;
+
+		/* Without longpoll support fetch a fresh template every
+		 * --scan-time seconds, or as soon as one of our blocks is
+		 * accepted since the template is then stale */
+		if (!pool->longpollid) {
+			struct timespec abstime;
+			struct timeval now;
+
+			gettimeofday(&now, NULL);
+			abstime.tv_sec = now.tv_sec + opt_scantime;
+			abstime.tv_nsec = now.tv_usec * 1000;
+			mutex_lock(&pool->stratum_lock);
+			while (!pool->gbt_refresh &&
+			       pthread_cond_timedwait(&pool->gbt_cond, &pool->stratum_lock, &abstime) != ETIMEDOUT)
+				;
+			pool->gbt_refresh = false;
+			mutex_unlock(&pool->stratum_lock);
+		}
+		req = gbt_request(pool->longpollid);
+		val = json_rpc_call(curl, pool->rpc_url, req, false,
+				    pool->longpollid != NULL, &rolltime, pool);
+		free(req);
+		if (!val || !gbt_decode(pool, json_object_get(val, "result"))) {
+			if (val)
+				json_decref(val);
+			pool->gbt_active = false;
+			pool_died(pool);
+			applog(LOG_DEBUG, "getblocktemplate from pool %d failed, retry after %d seconds",
+			       pool->pool_no, opt_fail_pause);
+			sleep(opt_fail_pause);
+			continue;
+		}
+		json_decref(val);
+		if (!pool->gbt_active) {
+			pool->gbt_active = true;
+			if (pool_tclear(pool, &pool->idle))
+				pool_resus(pool);
+		}
+
+		mutex_lock(&pool->stratum_lock);
+		clean = pool->swork.clean;
+		pool->swork.clean = false;
+		mutex_unlock(&pool->stratum_lock);
+		if (!clean)
+			continue;
+
+		work = make_work();
+		if (unlikely(!gen_stratum_work(pool, work))) {
+			free_work(work);
+			continue;
+		}
+		test_work_current(work, true);
+		if (unlikely(!tq_push(thr_info[stage_thr_id].q, work)))
+			applog(LOG_ERR, "Could not tq_push work in gbt_thread");
+	}
+
+	return NULL;
 }
 
 static bool queue_request(struct thr_info *thr, bool needed)
@@ -4076,15 +6383,11 @@ static bool queue_request(struct thr_info *thr, bool needed)
 	struct workio_cmd *wc;
 	int rq = requests_queued();
 
-	if (rq >= mining_threads + staged_clones)
+	if (rq >= mining_threads + queue_depth + staged.clones + staged_donor.clones)
 		return true;
 
 	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	if (unlikely(!wc)) {
-		applog(LOG_ERR, "Failed to calloc wc in queue_request");
-		return false;
-	}
+	wc = make_workio_cmd();
 
 	wc->cmd = WC_GET_WORK;
 	if (thr)
@@ -4102,7 +6405,7 @@ static bool queue_request(struct thr_info *thr, bool needed)
 		applog(LOG_DEBUG, "Queueing getwork request to work thread");
 
 	/* send work request to workio thread */
-	if (unlikely(!tq_push(thr_info[work_thr_id].q, wc))) {
+	if (unlikely(!workio_push(wc))) {
 		applog(LOG_ERR, "Failed to tq_push in queue_request");
 		workio_cmd_free(wc);
 		return false;
@@ -4112,23 +6415,188 @@ static bool queue_request(struct thr_info *thr, bool needed)
 	return true;
 }
 
-static struct work *hash_pop(const struct timespec *abstime)
+/* Prefetch a getwork for each mining thread from the pool the next rotation
+ * switches to, so its connection is up and work is waiting when it does */
+static void warm_up(void)
 {
-	struct work *work = NULL;
-	int rc = 0;
+	struct workio_cmd *wc;
+	struct pool *pool;
+	int i;
+
+	mutex_lock(&control_lock);
+	pool = pools[(currentpool->pool_no + 1) % total_pools];
+	if (pool == currentpool || pool == warm_pool || pool->idle || !pool->enabled ||
+	    pool->has_stratum || pool->has_gbt) {
+		mutex_unlock(&control_lock);
+		return;
+	}
+	warm_pool = pool;
+	mutex_unlock(&control_lock);
+
+	applog(LOG_DEBUG, "Prefetching work from pool %d before switching to it", pool->pool_no);
+	for (i = 0; i < mining_threads || !i; i++) {
+		wc = make_workio_cmd();
+		wc->cmd = WC_GET_WORK;
+		wc->pool = pool;
+		wc->warm = true;
+		if (unlikely(!workio_push(wc))) {
+			applog(LOG_ERR, "Failed to tq_push in warm_up");
+			workio_cmd_free(wc);
+			return;
+		}
+	}
+}
+
+#if defined(unix)
+static void *bench_failover_thread(void *userdata)
+{
+	double ms, total = 0, worst = 0;
+	struct timeval start, now, diff;
+	struct pool *pool, *next;
+	struct workio_cmd *wc;
+	unsigned int before;
+	int i;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	for (i = 0; i < BENCH_POOLS - 1; i++) {
+		/* Let mining settle on the pool before taking it down */
+		sleep(5);
+		pool = current_pool();
+		next = pools[pool->pool_no + 1];
+		before = next->getwork_requested;
+
+		gettimeofday(&start, NULL);
+		mock_pool_stop(bench_pids[pool->pool_no]);
+		bench_pids[pool->pool_no] = 0;
+
+		/* Ask for work straight away as a device running out would,
+		 * whatever is already queued */
+		wc = make_workio_cmd();
+		wc->cmd = WC_GET_WORK;
+		if (unlikely(!workio_push(wc)))
+			quit(1, "Failed to tq_push in bench_failover_thread");
+		inc_queued();
+
+		do {
+			struct timespec rgtp = { 0, 1000000 };
+
+			nanosleep(&rgtp, NULL);
+			gettimeofday(&now, NULL);
+			timeval_subtract(&diff, &now, &start);
+		} while ((current_pool() == pool || next->getwork_requested == before) &&
+			 diff.tv_sec < 90);
+
+		ms = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+		applog(LOG_WARNING, "Failover from pool %d to pool %d took %.1fms",
+		       pool->pool_no, next->pool_no, ms);
+		total += ms;
+		if (ms > worst)
+			worst = ms;
+	}
+
+	/* Report before kill_work as main exits once the threads are gone */
+	applog(LOG_WARNING, "Failover benchmark: %d failovers, average %.1fms, worst %.1fms",
+	       BENCH_POOLS - 1, total / (BENCH_POOLS - 1), worst);
+	bench_stop_pools();
+	kill_work();
+	return NULL;
+}
+
+static void *bench_pipeline_thread(void *userdata)
+{
+	double idle, lag, secs;
+	struct timeval start, now, diff;
+	unsigned long locks, scans;
+	int shares, stale;
+	unsigned int timed;
+	struct pool *pool = pools[0];
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	/* Count from here so startup does not weigh on the results */
+	gettimeofday(&start, NULL);
+	mutex_lock(&control_lock);
+	idle = device_idle;
+	lag = restart_lag;
+	timed = restarts_timed;
+	mutex_unlock(&control_lock);
+	shares = total_accepted + total_rejected;
+	stale = total_stale;
+	__atomic_store_n(&lock_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock_scans, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock_stats, true, __ATOMIC_RELEASE);
+
+	sleep(opt_bench_pipeline);
+
+	__atomic_store_n(&lock_stats, false, __ATOMIC_RELEASE);
+	locks = __atomic_load_n(&lock_count, __ATOMIC_RELAXED);
+	scans = __atomic_load_n(&lock_scans, __ATOMIC_RELAXED);
+	gettimeofday(&now, NULL);
+	timeval_subtract(&diff, &now, &start);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	mutex_lock(&control_lock);
+	idle = device_idle - idle;
+	lag = restart_lag - lag;
+	timed = restarts_timed - timed;
+	mutex_unlock(&control_lock);
+	shares = total_accepted + total_rejected - shares;
+	stale = total_stale - stale;
+
+	applog(LOG_WARNING, "Pipeline benchmark: %.2f shares/s, getwork RTT median / 90%% %ums / %ums, "
+	       "device idle %.1f%%, stale %.1f%%, longpoll to restart %.1fms over %u blocks, "
+	       "%.2f locks taken per scan over %lu scans",
+	       shares / secs, rpc_stats_pct(&pool->getwork_stats, 50),
+	       rpc_stats_pct(&pool->getwork_stats, 90),
+	       mining_threads ? idle * 100 / (secs * 1000 * mining_threads) : 0.0,
+	       shares + stale ? stale * 100.0 / (shares + stale) : 0.0,
+	       timed ? lag / timed : 0.0, timed,
+	       scans ? (double)locks / scans : 0.0, scans);
+	bench_stop_pools();
+	kill_work();
+	return NULL;
+}
+#endif
+
+/* Under stgd_lock */
+static struct work *hash_take(void)
+{
+	if (staged.count && (!staged_donor.count ||
+			     staged_before(staged.work[0], staged_donor.work[0])))
+		return heap_take(&staged);
+	return heap_take(&staged_donor);
+}
+
+/* Take the next staged work, and while the lock is held a batch more into
+ * 'cache' if there is enough staged for every thread to have its share and
+ * nobody is left waiting */
+static struct work *hash_pop(const struct timespec *abstime, struct work_cache *cache)
+{
+	struct work *work, *batch[CACHE_BATCH];
+	int rc = 0, i, n = 0;
 
 	mutex_lock(stgd_lock);
-	while (!getq->frozen && !HASH_COUNT(staged_work) && !rc)
+	__atomic_add_fetch(&getwork_waiting, 1, __ATOMIC_SEQ_CST);
+	while (!getq->frozen && !staged.count && !staged_donor.count && !rc)
 		rc = pthread_cond_timedwait(&getq->cond, stgd_lock, abstime);
+	__atomic_sub_fetch(&getwork_waiting, 1, __ATOMIC_SEQ_CST);
 
-	if (HASH_COUNT(staged_work)) {
-		work = staged_work;
-		HASH_DEL(staged_work, work);
-		if (work->clone)
-			--staged_clones;
+	work = hash_take();
+	if (work && cache && !getwork_waiting) {
+		n = (staged.count + staged_donor.count) / mining_threads;
+		if (n > CACHE_BATCH)
+			n = CACHE_BATCH;
+		for (i = 0; i < n; i++)
+			batch[i] = hash_take();
 	}
 	mutex_unlock(stgd_lock);
 
+	/* Pushed in reverse so the thread takes them in the heap's order */
+	while (n--) {
+		if (unlikely(!cache_push(cache, batch[n])) && !hash_push(batch[n]))
+			free_work(batch[n]);
+	}
+
 	return work;
 }
 
@@ -4139,7 +6607,8 @@ static inline bool should_roll(struct work *work)
 	rs = requests_staged();
 	if (rs >= mining_threads)
 		return false;
-	if (work->pool == current_pool() || pool_strategy == POOL_LOADBALANCE || !rs)
+	if (work->pool == current_pool() || pool_strategy == POOL_LOADBALANCE ||
+	    pool_strategy == POOL_LATENCY || !rs)
 		return true;
 	return false;
 }
@@ -4159,7 +6628,7 @@ static void roll_work(struct work *work)
 	ntime = be32toh(*work_ntime);
 	ntime++;
 	*work_ntime = htobe32(ntime);
-	local_work++;
+	stat_inc(local_work);
 	work->rolls++;
 	work->blk.nonce = 0;
 	if (opt_debug)
@@ -4188,7 +6657,7 @@ static bool divide_work(struct timeval *now, struct work *work, uint32_t hash_di
 		/* Okay we can divide it up */
 		work->blk.nonce += hash_inc;
 		work->cloned = true;
-		local_work++;
+		stat_inc(local_work);
 		if (opt_debug)
 			applog(LOG_DEBUG, "Successfully divided work");
 		return true;
@@ -4203,6 +6672,7 @@ static bool divide_work(struct timeval *now, struct work *work, uint32_t hash_di
 static bool get_work(struct work *work, bool requested, struct thr_info *thr,
 		     const int thr_id, uint32_t hash_div)
 {
+	struct work_cache *cache = &work_caches[thr_id];
 	bool newreq = false, ret = false;
 	struct timespec abstime = {};
 	struct timeval now;
@@ -4215,7 +6685,7 @@ static bool get_work(struct work *work, bool requested, struct thr_info *thr,
 	thread_reportout(thr);
 retry:
 	pool = current_pool();
-	if (!requested || requests_queued() < opt_queue) {
+	if (!requested || requests_queued() < queue_depth) {
 		if (unlikely(!queue_request(thr, true))) {
 			applog(LOG_WARNING, "Failed to queue_request in get_work");
 			goto out;
@@ -4232,8 +6702,11 @@ retry:
 	if (requested && !newreq && !requests_staged() && requests_queued() >= mining_threads &&
 	    !pool_tset(pool, &pool->lagging)) {
 		applog(LOG_WARNING, "Pool %d not providing work fast enough", pool->pool_no);
-		pool->getfail_occasions++;
-		total_go++;
+		stat_inc(pool->getfail_occasions);
+		stat_inc(total_go);
+		/* Round robin moves on to the next pool if this one dies */
+		if (pool_strategy == POOL_ROUNDROBIN)
+			warm_up();
 	}
 
 	newreq = requested = false;
@@ -4243,13 +6716,33 @@ retry:
 	if (opt_debug)
 		applog(LOG_DEBUG, "Popping work from get queue to get work");
 
-	/* wait for 1st response, or get cached response */
-	work_heap = hash_pop(&abstime);
-	if (unlikely(!work_heap)) {
-		/* Attempt to switch pools if this one times out */
-		pool_died(pool);
-		goto retry;
-	}
+	/* Our own cache first, then the staged heaps, stealing from the other
+	 * threads only before waiting on the heaps */
+	work_heap = cache_take(cache);
+	if (!work_heap) {
+		int rs = 0;
+
+		if (staged_empty())
+			work_heap = cache_steal_any(thr_id);
+		if (!work_heap) {
+			rs = requests_staged();
+			/* wait for 1st response, or get cached response */
+			work_heap = hash_pop(&abstime, cache);
+			if (unlikely(!work_heap)) {
+				/* Attempt to switch pools if this one times out */
+				pool_died(pool);
+				goto retry;
+			}
+		}
+		/* Fresh work taken without waiting when no more was staged than
+		 * the depth beyond --queue means this thread would have waited
+		 * a getwork round trip with --queue alone */
+		if (queue_depth > opt_queue && rs && rs <= queue_depth - opt_queue &&
+		    !work_heap->clone && !work_heap->rolls && !work_heap->mined)
+			stat_inc(starvation_averted);
+		work_waited(work_heap, &now);
+	} else if (unlikely(__atomic_load_n(&switch_settling, __ATOMIC_RELAXED)))
+		work_waited(work_heap, &now);
 
 	if (stale_work(work_heap, false)) {
 		dec_queued();
@@ -4259,6 +6752,7 @@ retry:
 
 	pool = work_heap->pool;
 	/* If we make it here we have succeeded in getting fresh work */
+	lp_restart_done();
 	if (!work_heap->mined) {
 		pool_tclear(pool, &pool->lagging);
 		if (pool_tclear(pool, &pool->idle))
@@ -4274,7 +6768,10 @@ retry:
 		if (opt_debug)
 			applog(LOG_DEBUG, "Pushing divided work to get queue head");
 
-		hash_push(work_heap);
+		/* Keep it for ourselves unless another thread is waiting */
+		if (__atomic_load_n(&getwork_waiting, __ATOMIC_SEQ_CST) ||
+		    !cache_push(cache, work_heap))
+			hash_push(work_heap);
 		work->clone = true;
 	} else {
 		dec_queued();
@@ -4302,16 +6799,60 @@ out:
 	return ret;
 }
 
+/* Hand out work to a downstream miner of the proxy. Work is rolled whenever
+ * the pool allows it, so one upstream getwork can serve many miners, with
+ * the rolled master staying staged for the next one to ask */
+bool get_proxy_work(struct work *work)
+{
+	struct timespec abstime = {};
+	struct work *work_heap;
+	struct timeval now;
+
+retry:
+	if (unlikely(!queue_request(NULL, true)))
+		return false;
+
+	gettimeofday(&now, NULL);
+	abstime.tv_sec = now.tv_sec + 60;
+	work_heap = staged_empty() ? cache_steal_any(-1) : NULL;
+	if (!work_heap)
+		work_heap = hash_pop(&abstime, NULL);
+	if (unlikely(!work_heap))
+		return false;
+
+	if (stale_work(work_heap, false)) {
+		dec_queued();
+		discard_work(work_heap);
+		goto retry;
+	}
+
+	if (!work_heap->mined) {
+		struct pool *pool = work_heap->pool;
+
+		pool_tclear(pool, &pool->lagging);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+	}
+
+	memcpy(work, work_heap, sizeof(*work));
+	if (can_roll(work_heap)) {
+		roll_work(work_heap);
+		hash_push(work_heap);
+		work->clone = true;
+	} else {
+		dec_queued();
+		free_work(work_heap);
+	}
+	work->mined = true;
+	return true;
+}
+
 static bool submit_work_sync(struct thr_info *thr, const struct work *work_in)
 {
 	struct workio_cmd *wc;
 
 	/* fill out work request message */
-	wc = calloc(1, sizeof(*wc));
-	if (unlikely(!wc)) {
-		applog(LOG_ERR, "Failed to calloc wc in submit_work_sync");
-		return false;
-	}
+	wc = make_workio_cmd();
 
 	wc->u.work = make_work();
 	wc->cmd = WC_SUBMIT_WORK;
@@ -4322,7 +6863,7 @@ static bool submit_work_sync(struct thr_info *thr, const struct work *work_in)
 		applog(LOG_DEBUG, "Pushing submit work to work thread");
 
 	/* send solution to workio thread */
-	if (unlikely(!tq_push(thr_info[work_thr_id].q, wc))) {
+	if (unlikely(!workio_push(wc))) {
 		applog(LOG_ERR, "Failed to tq_push work in submit_work_sync");
 		goto err_out;
 	}
@@ -4404,6 +6945,7 @@ static void *miner_thread(void *userdata)
 	bool requested = false;
 	uint32_t hash_div = 1;
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	pthread_setspecific(lock_stats_key, mythr);
 
 	if (api->thread_init && !api->thread_init(mythr))
 		goto out;
@@ -4438,6 +6980,8 @@ static void *miner_thread(void *userdata)
 			gettimeofday(&tv_start, NULL);
 
 			hashes = api->scanhash(mythr, work, work->blk.nonce + max_nonce);
+			if (unlikely(lock_stats))
+				stat_inc(lock_scans);
 			if (unlikely(work_restart[thr_id].restart))
 				break;
 			if (unlikely(!hashes))
@@ -4641,6 +7185,17 @@ static void convert_to_work(json_t *val, bool rolltime, struct pool *pool)
 	}
 	work->pool = pool;
 	work->rolltime = rolltime;
+
+	/* Pools no work is being taken from are only listened to for new
+	 * blocks and their work is not wanted, but their announcements of
+	 * blocks already known still count */
+	if (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
+	    pool_strategy != POOL_LATENCY) {
+		test_work_current(work, true);
+		free_work(work);
+		return;
+	}
+
 	/* We'll be checking this work item twice, but we already know it's
 	 * from a new block so explicitly force the new block detection now
 	 * rather than waiting for it to hit the stage thread. This also
@@ -4656,115 +7211,166 @@ static void convert_to_work(json_t *val, bool rolltime, struct pool *pool)
 		applog(LOG_DEBUG, "Converted longpoll data to work");
 }
 
-/* If we want longpoll, enable it for the chosen default pool, or, if
- * the pool does not support longpoll, find the first one that does
- * and use its longpoll support */
-static struct pool *select_longpoll_pool(void)
+/* Set up and start the longpoll request of 'pool' on 'multi' */
+static bool longpoll_start(CURLM *multi, struct pool *pool)
 {
-	struct pool *cp = current_pool();
-	int i;
+	char *hdr_path = pool->hdr_path, *copy_start;
 
-	if (cp->hdr_path)
-		return cp;
-	for (i = 0; i < total_pools; i++) {
-		struct pool *pool = pools[i];
+	if (!pool->lp_url) {
+		/* full URL */
+		if (strstr(hdr_path, "://"))
+			pool->lp_url = strdup(hdr_path);
+		else {
+			/* absolute path, on current server */
+			copy_start = (*hdr_path == '/') ? (hdr_path + 1) : hdr_path;
+			pool->lp_url = malloc(strlen(pool->rpc_url) + strlen(copy_start) + 2);
+			if (pool->lp_url)
+				sprintf(pool->lp_url, "%s%s%s", pool->rpc_url,
+					pool->rpc_url[strlen(pool->rpc_url) - 1] != '/' ? "/" : "",
+					copy_start);
+		}
+		if (unlikely(!pool->lp_url))
+			return false;
+		applog(LOG_WARNING, "Long-polling activated for %s", pool->lp_url);
+	}
 
-		if (pool->hdr_path)
-			return pool;
+	/* The longpoll holds its handle for a long time so it gets its own
+	 * one rather than one from the pool's ring, but still shares the
+	 * pool's connection cache */
+	if (!pool->lp_curl) {
+		pool->lp_curl = pool_curl_init(pool);
+		if (unlikely(!pool->lp_curl)) {
+			applog(LOG_ERR, "CURL initialisation failed");
+			return false;
+		}
 	}
-	return NULL;
+
+	pool->lp_rt = json_rpc_setup(pool->lp_curl, pool->lp_url, rpc_req,
+				     false, true, pool);
+	if (unlikely(!pool->lp_rt))
+		return false;
+	curl_easy_setopt(pool->lp_curl, CURLOPT_PRIVATE, pool);
+	if (unlikely(curl_multi_add_handle(multi, pool->lp_curl)))
+		quit(1, "Failed to add curl handle in longpoll_start");
+	gettimeofday(&pool->tv_lpstart, NULL);
+	have_longpoll = true;
+	return true;
 }
 
-static void *longpoll_thread(void *userdata)
+/* The longpoll of 'pool' has returned with 'result' */
+static void longpoll_done(struct pool *pool, CURLcode result)
 {
-	char *copy_start, *hdr_path, *lp_url = NULL;
-	struct thr_info *mythr = userdata;
-	struct timeval start, end;
-	bool need_slash = false;
-	struct pool *sp, *pool;
-	CURL *curl = NULL;
-	int failures = 0;
+	struct timeval now;
 	bool rolltime;
 	json_t *val;
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	pthread_detach(pthread_self());
+	val = json_rpc_finish(pool->lp_rt, result, &rolltime);
+	pool->lp_rt = NULL;
+	if (likely(val)) {
+		convert_to_work(val, rolltime, pool);
+		pool->lp_failures = 0;
+		json_decref(val);
+		return;
+	}
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		goto out;
+	/* Some pools regularly drop the longpoll request so only see this as
+	 * longpoll failure if it happens immediately and just restart it the
+	 * rest of the time. */
+	gettimeofday(&now, NULL);
+	if (now.tv_sec - pool->tv_lpstart.tv_sec > 30)
+		return;
+	if (opt_retries == -1 || pool->lp_failures++ < opt_retries) {
+		applog(LOG_WARNING, "longpoll failed for %s, sleeping for 30s", pool->lp_url);
+		pool->lp_retry = now.tv_sec + 30;
+	} else {
+		applog(LOG_ERR, "longpoll failed for %s, giving up on it", pool->lp_url);
+		pool->lp_dead = true;
 	}
+}
+
+/* Long-poll every pool that supports it at once, so a new block is seen as
+ * soon as any of them announces it. One thread drives all the requests with
+ * a curl multi handle, picking up pools later found to support longpoll and
+ * dropping the longpoll of pools that get disabled */
+static void *longpoll_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	bool warned = false, rolltime;
+	struct pool *pool;
+	CURLM *multi;
+	int i;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	pthread_detach(pthread_self());
 
 	tq_pop(mythr->q, NULL);
 
-	pool = select_longpoll_pool();
-new_longpoll:
-	if (!pool) {
-		applog(LOG_WARNING, "No long-poll found on any pool server");
+	multi = curl_multi_init();
+	if (unlikely(!multi)) {
+		applog(LOG_ERR, "CURL multi initialisation failed");
 		goto out;
 	}
-	hdr_path = pool->hdr_path;
-
-	/* full URL */
-	if (strstr(hdr_path, "://")) {
-		lp_url = hdr_path;
-		hdr_path = NULL;
-	} else {
-		/* absolute path, on current server */
-		copy_start = (*hdr_path == '/') ? (hdr_path + 1) : hdr_path;
-		if (pool->rpc_url[strlen(pool->rpc_url) - 1] != '/')
-			need_slash = true;
 
-		lp_url = malloc(strlen(pool->rpc_url) + strlen(copy_start) + 2);
-		if (!lp_url)
-			goto out;
-
-		sprintf(lp_url, "%s%s%s", pool->rpc_url, need_slash ? "/" : "", copy_start);
+	/* Requests of an earlier, cancelled, longpoll thread are abandoned */
+	for (i = 0; i < total_pools; i++) {
+		pool = pools[i];
+		if (pool->lp_curl)
+			curl_easy_cleanup(pool->lp_curl);
+		pool->lp_curl = NULL;
+		pool->lp_rt = NULL;
 	}
 
-	have_longpoll = true;
-	applog(LOG_WARNING, "Long-polling activated for %s", lp_url);
+	while (42) {
+		int running, msgs, active = 0;
+		time_t now = time(NULL);
+		CURLMsg *msg;
 
-	while (1) {
-		gettimeofday(&start, NULL);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass, rpc_req,
-				    false, true, &rolltime, pool);
-		if (likely(val)) {
-			convert_to_work(val, rolltime, pool);
-			failures = 0;
-			json_decref(val);
-		} else {
-			/* Some pools regularly drop the longpoll request so
-			 * only see this as longpoll failure if it happens
-			 * immediately and just restart it the rest of the
-			 * time. */
-			gettimeofday(&end, NULL);
-			if (end.tv_sec - start.tv_sec > 30)
+		for (i = 0; i < total_pools; i++) {
+			pool = pools[i];
+			if (pool->lp_rt) {
+				if (pool->enabled) {
+					active++;
+					continue;
+				}
+				curl_multi_remove_handle(multi, pool->lp_curl);
+				json_rpc_finish(pool->lp_rt, CURLE_ABORTED_BY_CALLBACK, &rolltime);
+				pool->lp_rt = NULL;
 				continue;
-			if (opt_retries == -1 || failures++ < opt_retries) {
-				applog(LOG_WARNING,
-					"longpoll failed for %s, sleeping for 30s", lp_url);
-				sleep(30);
-			} else {
-				applog(LOG_ERR,
-					"longpoll failed for %s, ending thread", lp_url);
-				goto out;
 			}
+			if (!pool->hdr_path || !pool->enabled || pool->lp_dead ||
+			    pool->has_stratum || pool->has_gbt || now < pool->lp_retry)
+				continue;
+			if (longpoll_start(multi, pool))
+				active++;
 		}
-		sp = select_longpoll_pool();
-		if (sp != pool) {
-			if (likely(lp_url))
-				free(lp_url);
-			pool = sp;
-			goto new_longpoll;
+		if (!active && !have_longpoll && !warned) {
+			applog(LOG_WARNING, "No long-poll found on any pool server");
+			warned = true;
 		}
+
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &msgs))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&pool);
+			curl_multi_remove_handle(multi, msg->easy_handle);
+			longpoll_done(pool, msg->data.result);
+		}
+
+		/* Wake at least once a second to pick up changes to the pools.
+		 * curl_multi_wait returns at once with no transfers to wait on,
+		 * as when no pool has longpoll or all are backing off */
+#if LIBCURL_VERSION_NUM >= 0x074400
+		curl_multi_poll(multi, NULL, 0, 1000, NULL);
+#else
+		if (running)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		else
+			sleep(1);
+#endif
 	}
 
 out:
-	if (curl)
-		curl_easy_cleanup(curl);
-
 	tq_freeze(mythr->q);
 	return NULL;
 }
@@ -4910,6 +7516,54 @@ void reinit_device(struct cgpu_info *cgpu)
 		cgpu->api->reinit_device(cgpu);
 }
 
+/* Keep enough work queued to cover the time it takes to fetch more. Each
+ * mining thread gets through a work item when it exhausts the nonce range or
+ * after --scan-time, whichever comes first, so from the measured hashrates
+ * we know how many items a second the devices consume. Enough of them must
+ * be queued to last twice the getwork round trip, less whatever rolling the
+ * pool allows since each rollable item can be reused. */
+static void adapt_queue(void)
+{
+	double rate = 0, prate, rtt = 0, items;
+	int i, depth, clients;
+
+	for (i = 0; i < mining_threads; i++) {
+		struct thr_info *thr = &thr_info[i];
+		double secs = opt_scantime;
+
+		if (thr->rolling > 0 && 4294.967296 / thr->rolling < secs)
+			secs = 4294.967296 / thr->rolling;
+		if (secs > 0)
+			rate += 1 / secs;
+	}
+
+	/* Downstream miners of the proxy take work as well */
+	clients = proxy_active(&prate);
+	rate += prate;
+
+	/* Load balancing can pull work from any pool so plan for the slowest */
+	if (pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_LATENCY) {
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+
+			if (pool->enabled && !pool->idle && pool->getwork_rtt > rtt)
+				rtt = pool->getwork_rtt;
+		}
+	} else
+		rtt = current_pool()->getwork_rtt;
+
+	items = rate * rtt * 2 / (1 + roll_frac * 11);
+	depth = ceil(items);
+	if (depth > (mining_threads + clients) * 2)
+		depth = (mining_threads + clients) * 2;
+	if (depth < opt_queue)
+		depth = opt_queue;
+	if (depth != queue_depth && opt_debug)
+		applog(LOG_DEBUG, "Queue depth %d for %.1f work/s at %.0fms round trip",
+		       depth, rate, rtt * 1000);
+	queue_depth = depth;
+}
+
 /* Makes sure the hashmeter keeps going even if mining threads stall, updates
  * the screen at regular intervals, and restarts threads if they appear to have
  * died. */
@@ -4929,7 +7583,8 @@ static void *watchdog_thread(void *userdata)
 		struct timeval now;
 
 		sleep(interval);
-		if (requests_queued() < opt_queue)
+		adapt_queue();
+		if (requests_queued() < queue_depth)
 			queue_request(NULL, false);
 
 		hashmeter(-1, &zero_tv, 0);
@@ -4946,32 +7601,12 @@ static void *watchdog_thread(void *userdata)
 
 		gettimeofday(&now, NULL);
 
-		for (i = 0; i < total_pools; i++) {
-			struct pool *pool = pools[i];
-
-			if (!pool->enabled)
-				continue;
-
-			/* Test pool is idle once every minute */
-			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec > 60) {
-				gettimeofday(&pool->tv_idle, NULL);
-				if (pool_active(pool, true) && pool_tclear(pool, &pool->idle))
-					pool_resus(pool);
-			}
-		}
-
-		if (opt_donation > 0.0) {
-			if (donationpool.idle && now.tv_sec - donationpool.tv_idle.tv_sec > 60) {
-				gettimeofday(&donationpool.tv_idle, NULL);
-				if (pool_active(&donationpool, true) && pool_tclear(&donationpool, &donationpool.idle))
-					pool_resus(&donationpool);
-			}
-		}
-
 		if (pool_strategy == POOL_ROTATE && now.tv_sec - rotate_tv.tv_sec > 60 * opt_rotate_period) {
 			gettimeofday(&rotate_tv, NULL);
 			switch_pools(NULL);
-		}
+		} else if (pool_strategy == POOL_ROTATE &&
+			   now.tv_sec - rotate_tv.tv_sec > 60 * opt_rotate_period - WARM_SECS)
+			warm_up();
 
 		if (!sched_paused && !should_run()) {
 			applog(LOG_WARNING, "Pausing execution as per stop time %02d:%02d scheduled",
@@ -5187,6 +7822,9 @@ void quit(int status, const char *format, ...)
 	fprintf(stderr, "\n");
 	fflush(stderr);
 
+#if defined(unix)
+	bench_stop_pools();
+#endif
 	exit(status);
 }
 
@@ -5225,7 +7863,8 @@ static bool input_pool(bool live)
 	if (!url)
 		goto out;
 
-	if (strncmp(url, "http://", 7) &&
+	if (strncasecmp(url, "stratum+tcp://", 14) &&
+	    strncmp(url, "http://", 7) &&
 	    strncmp(url, "https://", 8)) {
 		char *httpinput;
 
@@ -5251,8 +7890,14 @@ static bool input_pool(bool live)
 		quit(1, "Failed to realloc pools in input_pool");
 	pool->pool_no = total_pools;
 	pool->prio = total_pools;
-	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL)))
+	if (unlikely(pthread_mutex_init(&pool->pool_lock, NULL) ||
+		     pthread_mutex_init(&pool->stratum_lock, NULL) ||
+		     pthread_cond_init(&pool->gbt_cond, NULL) ||
+		     pthread_mutex_init(&pool->send_lock, NULL)))
 		quit (1, "Failed to pthread_mutex_init in input_pool");
+	pool->sock = CURL_SOCKET_BAD;
+	setup_pool_curl(pool);
+	detect_stratum(pool, url);
 	pool->rpc_url = url;
 	pool->rpc_user = user;
 	pool->rpc_pass = pass;
@@ -5269,6 +7914,11 @@ static bool input_pool(bool live)
 	pool->enabled = true;
 	if (live && !pool_active(pool, false))
 		pool->idle = true;
+#if defined(unix)
+	/* Pools given at startup have their spools opened by main */
+	if (live && opt_spool_dir)
+		spool_open(pool, opt_spool_dir, opt_spool_size * 1024);
+#endif
 	pools[total_pools++] = pool;
 out:
 	immedok(logwin, false);
@@ -5861,7 +8511,7 @@ int main (int argc, char *argv[])
 	unsigned int i, pools_active = 0;
 	unsigned int j, k;
 	struct block *block, *tmpblock;
-	struct work *work, *tmpwork;
+	struct work *work;
 	struct sigaction handler;
 	struct thr_info *thr;
 
@@ -5871,11 +8521,17 @@ int main (int argc, char *argv[])
 		quit(1, "Failed to curl_global_init");
 
 	mutex_init(&hash_lock);
-	mutex_init(&qd_lock);
 	mutex_init(&curses_lock);
 	mutex_init(&control_lock);
+	mutex_init(&sshare_lock);
+	mutex_init(&proxy_lock);
+	if (unlikely(pthread_cond_init(&proxy_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init proxy_cond");
 	rwlock_init(&blk_lock);
-	rwlock_init(&netacc_lock);
+	slab_init(&work_slab, "work", sizeof(struct work));
+	slab_init(&workio_slab, "workio_cmd", sizeof(struct workio_cmd));
+	if (unlikely(pthread_key_create(&lock_stats_key, NULL)))
+		quit(1, "Failed to create lock_stats_key");
 
 	sprintf(packagename, "%s %s", PACKAGE, VERSION);
 
@@ -5936,6 +8592,10 @@ int main (int argc, char *argv[])
 	if (argc != 1)
 		quit(1, "Unexpected extra commandline arguments");
 
+#if defined(unix)
+	bench_start_pools();
+#endif
+
 	applog(LOG_WARNING, "Started %s", packagename);
 
 	strcat(opt_kernel_path, "/");
@@ -6026,7 +8686,7 @@ int main (int argc, char *argv[])
 			enable_device(devices[i]);
 	}
 
-	if (!total_devices)
+	if (!total_devices && !opt_proxy_listen)
 		quit(1, "All devices disabled, cannot mine!");
 
 	devcursor = 8;
@@ -6065,8 +8725,15 @@ int main (int argc, char *argv[])
 				quit(1, "Failed to find colon delimiter in userpass");
 		}
 	}
+#if defined(unix)
+	if (opt_spool_dir) {
+		for (i = 0; i < total_pools; i++)
+			spool_open(pools[i], opt_spool_dir, opt_spool_size * 1024);
+	}
+#endif
+
 	/* Set the currentpool to pool 0 */
-	currentpool = pools[0];
+	set_current_pool(pools[0]);
 
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog)
@@ -6078,7 +8745,7 @@ int main (int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
-	total_threads = mining_threads + 8;
+	total_threads = mining_threads + 10;
 	work_restart = calloc(total_threads, sizeof(*work_restart));
 	if (!work_restart)
 		quit(1, "Failed to calloc work_restart");
@@ -6087,6 +8754,10 @@ int main (int argc, char *argv[])
 	if (!thr_info)
 		quit(1, "Failed to calloc thr_info");
 
+	work_caches = calloc(mining_threads ? mining_threads : 1, sizeof(*work_caches));
+	if (!work_caches)
+		quit(1, "Failed to calloc work_caches");
+
 	/* init workio thread info */
 	work_thr_id = mining_threads;
 	thr = &thr_info[work_thr_id];
@@ -6095,6 +8766,10 @@ int main (int argc, char *argv[])
 	if (!thr->q)
 		quit(1, "Failed to tq_new");
 
+	workio_multi = curl_multi_init();
+	if (unlikely(!workio_multi))
+		quit(1, "CURL multi initialisation failed");
+
 	/* start work I/O thread */
 	if (thr_info_create(thr, NULL, workio_thread, thr))
 		quit(1, "workio thread create failed");
@@ -6134,12 +8809,12 @@ retry_pools:
 		pool->enabled = true;
 		if (pool_active(pool, false)) {
 			if (!currentpool)
-				currentpool = pool;
+				set_current_pool(pool);
 			applog(LOG_INFO, "Pool %d %s active", pool->pool_no, pool->rpc_url);
 			pools_active++;
 		} else {
 			if (pool == currentpool)
-				currentpool = NULL;
+				set_current_pool(NULL);
 			applog(LOG_WARNING, "Unable to get work from pool %d %s", pool->pool_no, pool->rpc_url);
 			pool->idle = true;
 		}
@@ -6171,6 +8846,7 @@ retry_pools:
 		else {
 			if (unlikely(pthread_mutex_init(&donationpool.pool_lock, NULL)))
 				quit (1, "Failed to pthread_mutex_init in add donpool");
+			setup_pool_curl(&donationpool);
 			donationpool.enabled = true;
 			donationpool.pool_no = MAX_POOLS;
 			if (!pool_active(&donationpool, false))
@@ -6278,6 +8954,29 @@ retry_pools:
 		quit(1, "API thread create failed");
 	pthread_detach(thr->pth);
 
+	/* Create getwork proxy thread */
+	proxy_thr_id = mining_threads + 8;
+	thr = &thr_info[proxy_thr_id];
+	if (thr_info_create(thr, NULL, proxy_thread, thr))
+		quit(1, "proxy thread create failed");
+	pthread_detach(thr->pth);
+
+	/* Create pool probe thread */
+	probe_thr_id = mining_threads + 9;
+	thr = &thr_info[probe_thr_id];
+	if (thr_info_create(thr, NULL, probe_thread, thr))
+		quit(1, "probe thread create failed");
+	pthread_detach(thr->pth);
+
+#if defined(unix)
+	if (opt_bench_failover &&
+	    unlikely(pthread_create(&bench_thread, NULL, bench_failover_thread, NULL)))
+		quit(1, "Failover benchmark thread create failed");
+	if (opt_bench_pipeline &&
+	    unlikely(pthread_create(&bench_thread, NULL, bench_pipeline_thread, NULL)))
+		quit(1, "Pipeline benchmark thread create failed");
+#endif
+
 	sleep(opt_log_interval);
 	if (opt_donation > 0.0)
 		applog(LOG_WARNING, "Donation is enabled at %.1f%% thank you :-)", opt_donation);
@@ -6300,9 +8999,13 @@ retry_pools:
 	if (opt_n_threads)
 		free(cpus);
 
-	HASH_ITER(hh, staged_work, work, tmpwork) {
-		HASH_DEL(staged_work, work);
+	while ((work = heap_take(&staged)))
+		free_work(work);
+	while ((work = heap_take(&staged_donor)))
 		free_work(work);
+	for (i = 0; i < mining_threads; i++) {
+		while ((work = cache_steal(&work_caches[i])))
+			free_work(work);
 	}
 	HASH_ITER(hh, blocks, block, tmpblock) {
 		HASH_DEL(blocks, block);
@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <jansson.h>
@@ -177,14 +178,24 @@ enum alive {
 };
 
 
+/* Kinds of HTTP request made to a pool, each with its own rate limit */
+enum net_class {
+	NET_GETWORK,
+	NET_SUBMIT,
+	NET_PROBE,
+	NET_CLASSES,
+};
+
+
 enum pool_strategy {
 	POOL_FAILOVER,
 	POOL_ROUNDROBIN,
 	POOL_ROTATE,
 	POOL_LOADBALANCE,
+	POOL_LATENCY,
 };
 
-#define TOP_STRATEGY (POOL_LOADBALANCE)
+#define TOP_STRATEGY (POOL_LATENCY)
 
 struct strategies {
 	const char *s;
@@ -304,13 +315,38 @@ static inline void nanosleep(struct timespec *rgtp, void *__unused)
 }
 #endif
 
+/* A thread caching slab allocator for objects of one size */
+struct slab_cache {
+	const char		*name;
+	size_t			size;
+	pthread_key_t		key;
+	pthread_mutex_t		lock;
+	void			*free_list;
+	unsigned int		slabs;
+	unsigned long		allocs, frees;
+};
+
+struct tq_cell;
+
 struct thread_q {
-	struct list_head	q;
+	struct list_head	q;	/* overflow once the ring is full */
 
 	bool frozen;
 
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
+
+	struct tq_cell		*ring;
+	int			overflow;
+	unsigned int		event;
+
+	/* producers and consumers each get a cache line of their own */
+	char			pad0[64];
+	unsigned long		tail;
+	int			pushers;	/* pushes past the frozen check */
+	char			pad1[64];
+	unsigned long		head;
+	char			pad2[64];
 };
 
 struct thr_info {
@@ -378,8 +414,24 @@ static inline void swap256(void *dest_p, const void *src_p)
 
 extern void quit(int status, const char *format, ...);
 
+/* Statistics are bumped from many threads at once without a lock */
+#define stat_inc(counter)	__atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
+/* Lock acquisitions by the mining threads, which set lock_stats_key, are
+ * only counted while a benchmark asks for them */
+extern bool lock_stats;
+extern pthread_key_t lock_stats_key;
+extern unsigned long lock_count;
+
+static inline void lock_counted(void)
+{
+	if (unlikely(lock_stats) && pthread_getspecific(lock_stats_key))
+		stat_inc(lock_count);
+}
+
 static inline void mutex_lock(pthread_mutex_t *lock)
 {
+	lock_counted();
 	if (unlikely(pthread_mutex_lock(lock)))
 		quit(1, "WTF MUTEX ERROR ON LOCK!");
 }
@@ -392,12 +444,14 @@ static inline void mutex_unlock(pthread_mutex_t *lock)
 
 static inline void wr_lock(pthread_rwlock_t *lock)
 {
+	lock_counted();
 	if (unlikely(pthread_rwlock_wrlock(lock)))
 		quit(1, "WTF WRLOCK ERROR ON LOCK!");
 }
 
 static inline void rd_lock(pthread_rwlock_t *lock)
 {
+	lock_counted();
 	if (unlikely(pthread_rwlock_rdlock(lock)))
 		quit(1, "WTF RDLOCK ERROR ON LOCK!");
 }
@@ -447,16 +501,75 @@ extern bool opt_api_listen;
 extern bool opt_api_listen_v4;
 extern bool opt_api_listen_v6;
 extern bool opt_api_network;
+extern bool opt_proxy_listen;
+extern bool opt_proxy_network;
+extern int opt_proxy_port;
 extern bool opt_delaynet;
-
-extern pthread_rwlock_t netacc_lock;
+extern int opt_fail_detect;
+extern unsigned char btc_script[25];
+extern size_t btc_script_len;
 
 extern const uint32_t sha256_init_state[];
-extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
+extern void setup_pool_curl(struct pool *pool);
+extern CURL *pool_curl_init(struct pool *pool);
+extern json_t *json_rpc_call(CURL *curl, const char *url,
 			     const char *rpc_req, bool, bool, bool *,
 			     struct pool *pool);
+struct rpc_transfer;
+extern struct rpc_transfer *json_rpc_setup(CURL *curl, const char *url,
+					   const char *rpc_req, bool, bool,
+					   struct pool *pool);
+extern json_t *json_rpc_finish(struct rpc_transfer *rt, CURLcode rc, bool *);
+extern json_t *json_rpc_finish_batch(struct rpc_transfer *rt, CURLcode rc, bool *);
+extern json_t *json_rpc_finish_submitblock(struct rpc_transfer *rt, CURLcode rc, bool *);
+extern void json_rpc_stream_work(struct rpc_transfer *rt, struct work *work);
+struct rpc_stats;
+extern void json_rpc_stats(struct rpc_transfer *rt, struct rpc_stats *stats);
+extern unsigned int rpc_stats_pct(const struct rpc_stats *stats, int pct);
+extern void rpc_stats_str(char *buf, const struct rpc_stats *stats);
+extern bool stratum_send(struct pool *pool, char *s, size_t len);
+extern bool stratum_send_json(struct pool *pool, json_t *val);
+extern bool sock_full(struct pool *pool, int wait);
+extern bool recv_stratum(struct pool *pool, json_t **reply);
+extern bool initiate_stratum(struct pool *pool);
+extern bool auth_stratum(struct pool *pool);
+extern void suspend_stratum(struct pool *pool);
+extern void gen_hash(const unsigned char *data, unsigned char *hash, int len);
+extern size_t address_to_script(unsigned char *script, const char *addr);
+extern bool gbt_decode(struct pool *pool, json_t *res_val);
+extern char *gbt_block(struct pool *pool, const struct work *work, char **workid);
+#if defined(unix)
+/* How a mock pool serves its miners */
+struct mock_pool_opts {
+	int latency;	/* ms before each reply */
+	int jitter;	/* up to this many ms either side of latency */
+	int fail;	/* percent of requests answered with an HTTP error */
+	int block_secs;	/* seconds between new blocks, 0 for no longpoll */
+	int diff_bits;	/* leading zero bits of the share target */
+	bool roll;	/* allow miners to roll ntime */
+	bool stratum;	/* speak stratum instead of getwork */
+	/* Serve this --net-capture file's replies to pool replay_pool in
+	 * their original timing instead */
+	const char *replay;
+	int replay_pool;
+};
+
+extern int mock_pool_listen(int *port);
+extern pid_t mock_pool_start(int fd, const struct mock_pool_opts *opts);
+extern void mock_pool_stop(pid_t pid);
+#endif
+extern bool capture_open(const char *path);
+extern bool spool_open(struct pool *pool, const char *dir, size_t size);
+extern int spool_add(struct pool *pool, const struct work *work);
+extern void spool_done(struct pool *pool, unsigned int slot);
+extern json_t *json_rpc_finish_work(struct rpc_transfer *rt, CURLcode rc, bool *,
+				    unsigned int *fields);
+extern int net_throttle(struct pool *pool, enum net_class class);
 extern char *bin2hex(const unsigned char *p, size_t len);
+extern void __bin2hex(char *s, const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
+extern void bench_hex(void);
+extern void bench_tq(void);
 
 typedef bool (*sha256_func)(int thr_id, const unsigned char *pmidstate,
 	unsigned char *pdata,
@@ -545,6 +658,36 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 
 extern void api(void);
 
+/* A downstream miner of the getwork proxy, known by the user name it sends
+ * or else by its address */
+struct proxy_client {
+	int id;
+	char name[64];
+	char addr[48];
+	unsigned int getworks;
+	unsigned int longpolls;
+	unsigned int submits;
+	/* Shares the upstream pool accepted and rejected */
+	unsigned int accepted;
+	unsigned int rejected;
+	/* Shares refused locally, on stale or unknown work or below target */
+	unsigned int stale;
+	unsigned int invalid;
+	time_t last_seen;
+	struct proxy_client *next;
+};
+
+extern struct proxy_client *proxy_clients;
+extern int total_proxy_clients;
+extern pthread_mutex_t proxy_lock;
+extern pthread_cond_t proxy_cond;
+extern void proxy(void);
+extern void proxy_new_block(void);
+extern int proxy_active(double *rate);
+extern bool get_proxy_work(struct work *work);
+extern bool stale_work(struct work *work, bool share);
+extern bool hashtest(const struct work *work);
+
 #define MAX_GPUDEVICES 16
 #define MAX_DEVICES 32
 #define MAX_POOLS (32)
@@ -582,6 +725,14 @@ extern unsigned int new_blocks;
 extern unsigned int found_blocks;
 extern int total_accepted, total_rejected;
 extern int total_getworks, total_stale, total_discarded;
+extern int total_workio_queued, total_workio_inflight;
+extern int queue_depth;
+extern unsigned int starvation_averted;
+extern unsigned int total_hedged, hedge_rescues;
+extern unsigned int pool_switches;
+extern double switch_idle;
+extern double device_idle;
+extern struct slab_cache work_slab, workio_slab;
 extern unsigned int local_work;
 extern unsigned int total_go, total_ro;
 extern int opt_log_interval;
@@ -612,6 +763,124 @@ typedef struct {
 } dev_blk_ctx;
 #endif
 
+/* The current job of a stratum pool, protected by the pool's stratum_lock */
+struct stratum_work {
+	char *job_id;
+	char *prev_hash;
+	char *bbversion;
+	char *nbit;
+	char *ntime;
+	bool clean;
+
+	/* Binary coinbase with room for extranonce2 at nonce2_offset */
+	unsigned char *coinbase;
+	size_t cb_len;
+	size_t nonce2_offset;
+
+	int merkles;
+	unsigned char (*merkle)[32];
+
+	double diff;
+
+	/* getblocktemplate only: the block target, the transactions that
+	 * follow the coinbase in a found block and whether it needs a
+	 * coinbase witness */
+	unsigned char target[32];
+	char *txns;
+	int txn_count;
+	char *workid;
+	bool witness;
+};
+
+/* Previous getblocktemplate templates kept for blocks found on them */
+#define GBT_JOBS 4
+
+/* A share kept on disk while its pool could not be reached. The magic is
+ * written last so a record torn by a crash is never replayed */
+#define SPOOL_MAGIC 0x50534743
+
+struct spool_rec {
+	uint32_t magic;
+	uint32_t done;
+	uint32_t thr_id;
+	uint32_t time;
+	unsigned char data[128];
+};
+
+/* --net-capture writes CAPTURE_MAGIC and then a capture_rec for every
+ * JSON-RPC exchange with a pool, each followed by the request and the reply
+ * as sent. Times are microseconds of a monotonic clock, in host byte order
+ * like the rest of the record */
+#define CAPTURE_MAGIC "CGCAP001"
+
+enum capture_kind {
+	CAP_GETWORK,
+	CAP_SUBMIT,
+	CAP_LONGPOLL,
+	CAP_OTHER,
+	CAP_KINDS
+};
+
+#define CAP_FAILED	1	/* no reply, or not a 200 */
+#define CAP_HAS_LP	2	/* the reply offered X-Long-Polling */
+#define CAP_ROLLTIME	4	/* the reply allowed X-Roll-Ntime */
+
+struct capture_rec {
+	uint64_t sent;
+	uint32_t rtt;
+	uint32_t req_len;
+	uint32_t reply_len;
+	uint8_t kind;
+	uint8_t pool_no;
+	uint8_t flags;
+	uint8_t pad;
+};
+
+/* What a request asks for: getwork without params asks for work, with them
+ * it submits a share, and anything else like templates is just other. A
+ * batch goes by its first call */
+static inline enum capture_kind capture_kind(const char *req, bool longpoll)
+{
+	const char *params;
+
+	if (longpoll)
+		return CAP_LONGPOLL;
+	if (!strstr(req, "\"getwork\""))
+		return CAP_OTHER;
+	params = strstr(req, "\"params\"");
+	if (params)
+		params = strchr(params, '[');
+	if (!params)
+		return CAP_GETWORK;
+	for (params++; *params == ' '; params++)
+		;
+	return *params == ']' ? CAP_GETWORK : CAP_SUBMIT;
+}
+
+/* Round trip times of a pool's JSON-RPC requests. Bucket i of the histogram
+ * counts replies that took less than 2^i ms, the last bucket all slower ones.
+ * Everything is halved once RPC_STATS_AGE requests have been counted so the
+ * figures follow how the pool is doing lately */
+#define RPC_LAT_BUCKETS 15
+#define RPC_STATS_AGE 1024
+
+struct rpc_stats {
+	unsigned int lat[RPC_LAT_BUCKETS];
+	unsigned int replies;
+	unsigned int errors;
+};
+
+/* Token bucket holding up to a second's worth of requests at 'rate' per
+ * second, 0 meaning unlimited. tv_held is when a request of the class first
+ * had to wait for a token and 'throttled' the total ms they have waited */
+struct net_bucket {
+	double rate;
+	double tokens;
+	struct timeval tv_fill;
+	struct timeval tv_held;
+	double throttled;
+};
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -636,8 +905,125 @@ struct pool {
 	char *rpc_user, *rpc_pass;
 
 	pthread_mutex_t pool_lock;
+
+	/* Idle persistent curl handles, protected by pool_lock */
+	struct list_head curlring;
+	int curls;
+	pthread_cond_t cr_cond;
+
+	CURLSH *curl_share;
+	pthread_mutex_t share_lock[CURL_LOCK_DATA_LAST];
+	struct curl_slist *curl_headers;
+	unsigned int curl_reused;
+	unsigned int curl_fresh;
+
+	/* Requests waiting in / being serviced by the workio event loop */
+	int workio_queued;
+	int workio_inflight;
+	/* Set once the pool has failed a JSON-RPC batch getwork */
+	bool no_batch;
+	unsigned int getwork_batches;
+	unsigned int submit_batches;
+	struct rpc_stats getwork_stats;
+	struct rpc_stats submit_stats;
+	/* Requests failed in a row, reset by any that succeeds */
+	int fail_streak;
+	/* Recovery probes of the pool while idle, run by the probe thread
+	 * within probe_time ms (0 for the default). How long the last one
+	 * took and whether it got work */
+	int probe_time;
+	bool probing;
+	struct curl_ent *probe_ce;
+	struct rpc_transfer *probe_rt;
+	struct timeval tv_probe;
+	unsigned int probes;
+	double probe_ms;
+	bool probe_ok;
+	/* Request rate limits from --net-rate or --net-delay, under pool_lock */
+	struct net_bucket net[NET_CLASSES];
+	bool net_rate_set;
+
+	/* Longpoll, driven by the longpoll thread */
+	char *lp_url;
+	CURL *lp_curl;
+	struct rpc_transfer *lp_rt;
+	struct timeval tv_lpstart;
+	time_t lp_retry;
+	int lp_failures;
+	bool lp_dead;
+	/* New blocks announced by the pool's longpoll, stratum notify or
+	 * template, how many of them it was first to, and the total ms it was
+	 * behind the block first being seen */
+	unsigned int blocks_announced;
+	unsigned int blocks_first;
+	double announce_lag;
+
+	/* Append only journal of shares that failed to submit, mapped from
+	 * --spool-dir. Records before spool_head have been dealt with, the
+	 * replay has got as far as spool_next and new ones go at spool_tail */
+	int spool_fd;
+	struct spool_rec *spool;
+	unsigned int spool_slots;
+	unsigned int spool_head;
+	unsigned int spool_next;
+	unsigned int spool_tail;
+	unsigned int spool_inflight;
+	time_t spool_retry;
+	unsigned int spooled;
+	unsigned int spool_replayed;
+	unsigned int spool_dropped;
+	/* Decaying average of the getwork round trip in seconds */
+	double getwork_rtt;
+
+	/* Stratum, for stratum+tcp:// URLs. Work is generated locally from
+	 * the jobs the pool notifies instead of fetched with getwork */
+	bool has_stratum;
+	bool stratum_active;
+	bool stratum_auth;
+	bool stratum_notify;
+	char *stratum_url;
+	CURL *stratum_curl;
+	curl_socket_t sock;
+	char *sockbuf;
+	size_t sockbuf_size;
+	char *nonce1;
+	size_t n2size;
+	uint32_t nonce2;
+	unsigned int stratum_session;
+	int stratum_id;
+	unsigned int stratum_jobs;
+	struct stratum_work swork;
+	pthread_t stratum_thread;
+	bool stratum_thread_started;
+	pthread_mutex_t stratum_lock;
+	pthread_mutex_t send_lock;
+
+	/* getblocktemplate, for solo mining against bitcoind when a
+	 * --btc-address is given. Templates fill swork like stratum jobs */
+	bool has_gbt;
+	bool gbt_checked;
+	bool gbt_active;
+	char *longpollid;
+	unsigned int gbt_templates;
+	struct stratum_work gbt_jobs[GBT_JOBS];
+	pthread_t gbt_thread;
+	bool gbt_thread_started;
+	bool gbt_refresh;
+	pthread_cond_t gbt_cond;
+};
+
+struct curl_ent {
+	CURL *curl;
+	struct list_head node;
 };
 
+/* Fields found in a getwork reply */
+#define GW_RESULT	(1 << 0)
+#define GW_DATA		(1 << 1)
+#define GW_MIDSTATE	(1 << 2)
+#define GW_HASH1	(1 << 3)
+#define GW_TARGET	(1 << 4)
+
 struct work {
 	unsigned char	data[128];
 	unsigned char	hash1[64];
@@ -663,6 +1049,16 @@ struct work {
 	unsigned int	work_block;
 	int		id;
 	UT_hash_handle hh;
+
+	/* Set for work generated from a stratum job */
+	bool		stratum;
+	char		job_id[64];
+	uint32_t	nonce2;
+	unsigned int	stratum_session;
+	/* Set for work generated from a getblocktemplate template */
+	bool		gbt;
+	/* Set for work handed out to a downstream miner by the proxy */
+	struct proxy_client *client;
 };
 
 enum cl_kernel {
@@ -689,6 +1085,9 @@ extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq, const struct timespec *abstime);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern void slab_init(struct slab_cache *sc, const char *name, size_t size);
+extern void *slab_alloc(struct slab_cache *sc);
+extern void slab_free(struct slab_cache *sc, void *obj);
 extern bool successful_connect;
 extern enum cl_kernel chosen_kernel;
 extern void adl(void);
@@ -0,0 +1,748 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(unix)
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "compat.h"
+#include "miner.h"
+#include "bench_block.h"
+
+/* A minimal getwork pool on 127.0.0.1 for benchmarking against. Work is the
+ * benchmark block with the block number, connection and request count
+ * written into it, so a run serves the same work every time. Shares are all
+ * accepted. It runs in a process group of its own, one process per
+ * connection, so killing it cuts off every connection at once just like a
+ * pool going down. Given a --net-capture file it stands in for one of the
+ * pools captured instead, answering with the replies that pool gave in
+ * their original timing. Asked for stratum it speaks that instead, and
+ * drops any connection whose messages are not well formed, so it doubles as
+ * a test of the miner's side of the protocol. Built on its own with
+ * MOCKPOOL_MAIN it is the mockpool program. */
+
+static const struct mock_pool_opts mock_defaults = {
+	.diff_bits = 256,
+};
+
+static const unsigned char mock_block[] = { CGMINER_BENCHMARK_BLOCK };
+
+/* Each connection's process keeps its own count and random state */
+static struct mock_pool_opts mock;
+static struct timeval mock_started;
+static uint32_t mock_conn, mock_served;
+static unsigned int mock_seed;
+
+static const char mock_accept[] = "{\"result\":true,\"error\":null,\"id\":1}";
+
+/* The replies of the pool being replayed by kind, in the order they came.
+ * Loaded before any connection is forked off */
+struct mock_replay {
+	struct capture_rec rec;
+	const char *reply;
+};
+
+static struct mock_replay *replay[CAP_KINDS];
+static int replay_count[CAP_KINDS];
+static uint64_t replay_base;
+
+/* Shared by all the connection processes: when the replay started and the
+ * next reply of each kind to give */
+struct mock_shared {
+	uint64_t start;
+	int next[CAP_KINDS];
+};
+
+static struct mock_shared *mock_shared;
+
+static void mock_hex(char *s, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(s + i * 2, "%02x", p[i]);
+}
+
+static void mock_put32(unsigned char *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/* The block the pool is on, a new one every block_secs */
+static uint32_t mock_blockno(void)
+{
+	struct timeval now;
+
+	if (!mock.block_secs)
+		return 0;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - mock_started.tv_sec) / mock.block_secs;
+}
+
+static uint64_t mock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void mock_sleep(int ms)
+{
+	struct timespec rgtp;
+
+	if (ms <= 0)
+		return;
+	rgtp.tv_sec = ms / 1000;
+	rgtp.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&rgtp, &rgtp) && errno == EINTR)
+		;
+}
+
+/* Write fresh work on the current block to 's' */
+static int mock_work(char *s)
+{
+	unsigned char data[128], target[32];
+	char hexdata[257], hextarget[65];
+	int bits, i;
+
+	memcpy(data, mock_block, sizeof(data));
+	mock_put32(data + 4, mock_blockno());
+	mock_put32(data + 36, mock_conn);
+	mock_put32(data + 40, ++mock_served);
+	mock_hex(hexdata, data, sizeof(data));
+
+	/* The target is little endian so its zero bits are at the end */
+	memset(target, 0xff, sizeof(target));
+	for (i = 31, bits = mock.diff_bits; i >= 0 && bits > 0; i--, bits -= 8)
+		target[i] = bits >= 8 ? 0 : 0xff >> bits;
+	mock_hex(hextarget, target, sizeof(target));
+
+	return sprintf(s, "{\"result\":{\"data\":\"%s\",\"target\":\"%s\"},"
+		       "\"error\":null,\"id\":1}", hexdata, hextarget);
+}
+
+static bool mock_reply(int fd, int status, const char *body, size_t len,
+		       bool lp, bool roll)
+{
+	char hdr[256];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n"
+			"Content-Type: application/json\r\n%s%s"
+			"Content-Length: %d\r\n\r\n",
+			status, status == 200 ? "OK" : "Internal Server Error",
+			lp ? "X-Long-Polling: /LP\r\n" : "",
+			roll ? "X-Roll-Ntime: Y\r\n" : "", (int)len);
+	return write(fd, hdr, hlen) == hlen && write(fd, body, len) == (ssize_t)len;
+}
+
+/* Load the replies given to pool replay_pool from the capture file */
+static bool mock_replay_load(void)
+{
+	size_t magic = strlen(CAPTURE_MAGIC), len, pos;
+	struct mock_replay *r;
+	struct capture_rec rec;
+	char *buf;
+	FILE *f;
+	long size;
+	int kind;
+
+	f = fopen(mock.replay, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open capture %s: %s\n", mock.replay, strerror(errno));
+		return false;
+	}
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return false;
+	}
+	len = size;
+	buf = malloc(len + 1);
+	if (!buf || fread(buf, 1, len, f) != len || len < magic ||
+	    memcmp(buf, CAPTURE_MAGIC, magic)) {
+		fprintf(stderr, "%s is not a cgminer capture\n", mock.replay);
+		fclose(f);
+		free(buf);
+		return false;
+	}
+	fclose(f);
+
+	replay_base = UINT64_MAX;
+	for (pos = magic; pos + sizeof(rec) <= len; ) {
+		memcpy(&rec, buf + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (rec.kind >= CAP_KINDS || pos + rec.req_len + rec.reply_len > len)
+			break;
+		pos += rec.req_len;
+		if (rec.pool_no == mock.replay_pool) {
+			kind = rec.kind;
+			r = realloc(replay[kind], (replay_count[kind] + 1) * sizeof(*r));
+			if (!r)
+				return false;
+			replay[kind] = r;
+			r += replay_count[kind]++;
+			r->rec = rec;
+			r->reply = buf + pos;
+			if (rec.sent < replay_base)
+				replay_base = rec.sent;
+		}
+		pos += rec.reply_len;
+	}
+	if (replay_base == UINT64_MAX) {
+		fprintf(stderr, "No traffic of pool %d in %s\n", mock.replay_pool, mock.replay);
+		return false;
+	}
+
+	mock_shared = mmap(NULL, sizeof(*mock_shared), PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mock_shared == MAP_FAILED)
+		return false;
+	memset(mock_shared, 0, sizeof(*mock_shared));
+	return true;
+}
+
+/* Answer 'req' with the next captured reply of its kind, once the pool has
+ * had as long as it took to send it and the replay has reached the time it
+ * came. The first request starts the replay clock */
+static bool mock_replay_answer(int fd, const char *req, bool longpoll)
+{
+	enum capture_kind kind = capture_kind(req, longpoll);
+	uint64_t arrived = mock_now(), start, due, now;
+	const struct mock_replay *r;
+	int i;
+
+	if (__sync_bool_compare_and_swap(&mock_shared->start, 0, arrived))
+		start = arrived;
+	else
+		start = mock_shared->start;
+
+	i = __sync_fetch_and_add(&mock_shared->next[kind], 1);
+	if (i >= replay_count[kind]) {
+		/* The capture has run out: hold longpolls, accept shares and
+		 * fail anything else */
+		if (kind == CAP_LONGPOLL) {
+			while (42)
+				sleep(60);
+		}
+		if (kind == CAP_SUBMIT)
+			return mock_reply(fd, 200, mock_accept, strlen(mock_accept), false, false);
+		return mock_reply(fd, 500, "", 0, false, false);
+	}
+	r = &replay[kind][i];
+
+	due = start + r->rec.sent + r->rec.rtt - replay_base;
+	if (due < arrived + r->rec.rtt)
+		due = arrived + r->rec.rtt;
+	while ((now = mock_now()) < due)
+		mock_sleep((due - now + 999) / 1000);
+
+	if (r->rec.flags & CAP_FAILED)
+		return mock_reply(fd, 500, "", 0, false, false);
+	return mock_reply(fd, 200, r->reply, r->rec.reply_len,
+			  r->rec.flags & CAP_HAS_LP, r->rec.flags & CAP_ROLLTIME);
+}
+
+/* Add the answer to the call whose "params" are at 'params' to 's': getwork
+ * with none asks for work, with some it submits a share */
+static int mock_answer(char *s, const char *params)
+{
+	const char *list = strchr(params, '[');
+
+	if (list && !strncmp(list, "[]", 2))
+		return mock_work(s);
+	return sprintf(s, "%s", mock_accept);
+}
+
+/* Answer the requests of one keep-alive connection until it is closed. A
+ * batch gets an array of as many answers as it has calls. Longpolls are
+ * held until the next block */
+static void mock_serve(int fd)
+{
+	char buf[16384], reply[16384], *body, *cl, next;
+	size_t have = 0, need, len;
+	uint32_t block;
+	ssize_t n;
+
+	while (42) {
+		buf[have] = '\0';
+		body = strstr(buf, "\r\n\r\n");
+		if (!body) {
+			if (have >= sizeof(buf) - 1)
+				return;
+			n = read(fd, buf + have, sizeof(buf) - 1 - have);
+			if (n <= 0)
+				return;
+			have += n;
+			continue;
+		}
+		body += 4;
+		cl = strcasestr(buf, "Content-Length:");
+		need = body - buf;
+		if (cl && cl < body)
+			need += strtoul(cl + 15, NULL, 10);
+		if (need >= sizeof(buf))
+			return;
+		while (have < need) {
+			n = read(fd, buf + have, need - have);
+			if (n <= 0)
+				return;
+			have += n;
+		}
+		next = buf[need];
+		buf[need] = '\0';
+
+		if (mock.replay) {
+			if (!mock_replay_answer(fd, body, !strncmp(buf, "POST /LP", 8)))
+				return;
+			goto next;
+		}
+
+		if (!strncmp(buf, "POST /LP", 8)) {
+			block = mock_blockno();
+			while (mock_blockno() == block)
+				mock_sleep(10);
+		} else
+			mock_sleep(mock.latency + (mock.jitter ?
+				   (int)(rand_r(&mock_seed) % (2 * mock.jitter + 1)) - mock.jitter : 0));
+
+		if (mock.fail && (int)(rand_r(&mock_seed) % 100) < mock.fail) {
+			if (!mock_reply(fd, 500, "", 0, mock.block_secs, mock.roll))
+				return;
+		} else {
+			if (*body == '[') {
+				len = 1;
+				strcpy(reply, "[");
+				for (cl = body; (cl = strstr(cl, "\"params\"")); cl++) {
+					if (len + 512 >= sizeof(reply))
+						return;
+					if (len > 1)
+						reply[len++] = ',';
+					len += mock_answer(reply + len, cl);
+				}
+				strcpy(reply + len++, "]");
+			} else {
+				cl = strstr(body, "\"params\"");
+				len = cl ? mock_answer(reply, cl) : (size_t)sprintf(reply, "%s", mock_accept);
+			}
+			if (!mock_reply(fd, 200, reply, len, mock.block_secs, mock.roll))
+				return;
+		}
+next:
+		buf[need] = next;
+		have -= need;
+		memmove(buf, buf + need, have);
+	}
+}
+
+/* Send one JSON message to a stratum miner, taking the reference to it */
+static bool mock_send(int fd, json_t *val)
+{
+	char *s;
+	size_t len;
+	bool ret;
+
+	s = json_dumps(val, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	if (!s)
+		return false;
+	len = strlen(s);
+	s[len] = '\n';
+	ret = write(fd, s, len + 1) == (ssize_t)len + 1;
+	s[len] = '\0';
+	free(s);
+	return ret;
+}
+
+/* Announce a job on the current block. The header fields come from the
+ * benchmark block, in the same word order getwork hands them out */
+static bool mock_notify(int fd, uint32_t block, bool clean)
+{
+	unsigned char data[128];
+	char job_id[9], prev_hash[65], version[9], nbits[9], ntime[9];
+
+	memcpy(data, mock_block, sizeof(data));
+	mock_put32(data + 4, block);
+	sprintf(job_id, "%x", block);
+	mock_hex(version, data, 4);
+	mock_hex(prev_hash, data + 4, 32);
+	mock_hex(ntime, data + 68, 4);
+	mock_hex(nbits, data + 72, 4);
+
+	return mock_send(fd, json_pack("{s:n,s:s,s:[s,s,s,s,[],s,s,s,b]}", "id",
+				       "method", "mining.notify", "params",
+				       job_id, prev_hash,
+				       "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff",
+				       "ffffffff01000000000000000000000000",
+				       version, nbits, ntime, clean));
+}
+
+/* The share difficulty for diff_bits, difficulty 1 being 32 bits */
+static double mock_diff(void)
+{
+	double diff = 1;
+	int bits;
+
+	for (bits = mock.diff_bits; bits > 32; bits--)
+		diff *= 2;
+	for (; bits < 32; bits++)
+		diff /= 2;
+	return diff;
+}
+
+/* Check a line from a stratum miner is a JSON object with an integer id of
+ * at least 1 and a string method, returning it or NULL if it is not. Replies
+ * to the pool's own calls are left for the caller to skip */
+static json_t *mock_stratum_request(const char *line, int *id, const char **method)
+{
+	json_error_t err;
+	json_t *val, *id_val;
+
+	val = json_loads(line, 0, &err);
+	if (!json_is_object(val)) {
+		fprintf(stderr, "Stratum connection %u sent invalid JSON (%s): %s\n",
+			mock_conn, err.text, line);
+		if (val)
+			json_decref(val);
+		return NULL;
+	}
+	*method = json_string_value(json_object_get(val, "method"));
+	if (!*method)
+		return val;
+	id_val = json_object_get(val, "id");
+	if (!json_is_integer(id_val) || json_integer_value(id_val) < 1) {
+		fprintf(stderr, "Stratum connection %u sent a request without an id of 1 or more: %s\n",
+			mock_conn, line);
+		json_decref(val);
+		return NULL;
+	}
+	*id = json_integer_value(id_val);
+	return val;
+}
+
+/* Whether 'params' is an array of 'n' strings */
+static bool mock_strings(json_t *params, size_t n)
+{
+	size_t i;
+
+	if (!json_is_array(params) || json_array_size(params) != n)
+		return false;
+	for (i = 0; i < n; i++) {
+		if (!json_is_string(json_array_get(params, i)))
+			return false;
+	}
+	return true;
+}
+
+/* Answer one stratum miner until it disconnects or breaks the protocol.
+ * Once authorised it gets the difficulty and a job, and a new job with
+ * clean set each block. Shares on the current job are accepted, bar the
+ * fail percent, and the latency applies to every reply */
+static void mock_serve_stratum(int fd)
+{
+	char buf[16384], *eol, n1[9];
+	bool subscribed = false, authorised = false;
+	uint32_t block = mock_blockno();
+	struct timeval tv;
+	size_t have = 0;
+	fd_set rd;
+	ssize_t n;
+
+	sprintf(n1, "%08x", mock_conn);
+	while (42) {
+		const char *method;
+		json_t *val, *params, *reply;
+		bool authorise;
+		int id;
+
+		buf[have] = '\0';
+		eol = strchr(buf, '\n');
+		if (!eol) {
+			if (have >= sizeof(buf) - 1)
+				return;
+			if (authorised && mock_blockno() != block) {
+				block = mock_blockno();
+				if (!mock_notify(fd, block, true))
+					return;
+			}
+			FD_ZERO(&rd);
+			FD_SET(fd, &rd);
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			if (select(fd + 1, &rd, NULL, NULL, &tv) <= 0)
+				continue;
+			n = read(fd, buf + have, sizeof(buf) - 1 - have);
+			if (n <= 0)
+				return;
+			have += n;
+			continue;
+		}
+		*eol++ = '\0';
+
+		val = mock_stratum_request(buf, &id, &method);
+		if (!val)
+			return;
+		if (!method) {
+			/* A reply to a call of the pool's, which need no answer */
+			json_decref(val);
+			goto next;
+		}
+		params = json_object_get(val, "params");
+		authorise = !authorised && !strcmp(method, "mining.authorize");
+		if (!strcmp(method, "mining.subscribe")) {
+			subscribed = true;
+			reply = json_pack("{s:i,s:[[[s,s]],s,i],s:n}", "id", id, "result",
+					  "mining.notify", n1, n1, 4, "error");
+		} else if (!strcmp(method, "mining.authorize")) {
+			if (!subscribed || !mock_strings(params, 2)) {
+				fprintf(stderr, "Stratum connection %u sent a bad authorize: %s\n",
+					mock_conn, buf);
+				json_decref(val);
+				return;
+			}
+			reply = json_pack("{s:i,s:b,s:n}", "id", id, "result", 1, "error");
+		} else if (!strcmp(method, "mining.submit")) {
+			if (!authorised || !mock_strings(params, 5)) {
+				fprintf(stderr, "Stratum connection %u sent a bad submit: %s\n",
+					mock_conn, buf);
+				json_decref(val);
+				return;
+			}
+			mock_sleep(mock.latency + (mock.jitter ?
+				   (int)(rand_r(&mock_seed) % (2 * mock.jitter + 1)) - mock.jitter : 0));
+			if (strtoul(json_string_value(json_array_get(params, 1)), NULL, 16) != mock_blockno())
+				reply = json_pack("{s:i,s:b,s:[i,s,n]}", "id", id, "result", 0,
+						  "error", 21, "Job not found");
+			else if (mock.fail && (int)(rand_r(&mock_seed) % 100) < mock.fail)
+				reply = json_pack("{s:i,s:b,s:[i,s,n]}", "id", id, "result", 0,
+						  "error", 20, "Other/Unknown");
+			else
+				reply = json_pack("{s:i,s:b,s:n}", "id", id, "result", 1, "error");
+		} else
+			reply = json_pack("{s:i,s:n,s:[i,s,n]}", "id", id, "result",
+					  "error", 20, "Unknown method");
+		json_decref(val);
+
+		if (!mock_send(fd, reply))
+			return;
+		if (authorise) {
+			authorised = true;
+			block = mock_blockno();
+			if (!mock_send(fd, json_pack("{s:n,s:s,s:[f]}", "id", "method",
+						     "mining.set_difficulty", "params", mock_diff())) ||
+			    !mock_notify(fd, block, true))
+				return;
+		}
+next:
+		have -= eol - buf;
+		memmove(buf, eol, have);
+	}
+}
+
+/* Listen on 127.0.0.1 port *port, or any free port if it is 0, which is
+ * then filled in. Returns the socket to start the pool on, or -1 */
+int mock_pool_listen(int *port)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(*port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 64) ||
+	    getsockname(fd, (struct sockaddr *)&addr, &alen)) {
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(addr.sin_port);
+	return fd;
+}
+
+static bool mock_setup(const struct mock_pool_opts *opts)
+{
+	mock = opts ? *opts : mock_defaults;
+	return !mock.replay || mock_replay_load();
+}
+
+static void mock_accept_loop(int fd)
+{
+	int conn;
+
+	gettimeofday(&mock_started, NULL);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	while (42) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		mock_conn++;
+		if (!fork()) {
+			close(fd);
+			mock_seed = mock_conn;
+			if (mock.stratum)
+				mock_serve_stratum(conn);
+			else
+				mock_serve(conn);
+			_exit(0);
+		}
+		close(conn);
+	}
+}
+
+/* Start a mock pool serving the socket from mock_pool_listen, which is
+ * closed here. NULL opts serve work no share can meet straight away.
+ * Returns the pid to stop it with, or -1 */
+pid_t mock_pool_start(int fd, const struct mock_pool_opts *opts)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid) {
+		if (pid > 0)
+			setpgid(pid, pid);
+		close(fd);
+		return pid;
+	}
+
+	setpgid(0, 0);
+	if (!mock_setup(opts))
+		_exit(1);
+	mock_accept_loop(fd);
+	_exit(0);
+}
+
+void mock_pool_stop(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+	kill(-pid, SIGKILL);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+#ifdef MOCKPOOL_MAIN
+static void mock_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -p <port>     Port to listen on (default: 8332)\n"
+		"  -l <ms>       Latency of each reply (default: 0)\n"
+		"  -j <ms>       Jitter either side of the latency (default: 0)\n"
+		"  -f <percent>  Requests to fail with an HTTP error (default: 0)\n"
+		"  -b <secs>     Seconds between new blocks announced by longpoll, 0 for no longpoll (default: 0)\n"
+		"  -d <bits>     Leading zero bits of the share target (default: 32)\n"
+		"  -r            Allow miners to roll ntime\n"
+		"  -s            Speak stratum instead of getwork, checking every message\n"
+		"  -R <file>     Replay the replies in a --net-capture file instead\n"
+		"  -P <pool>     Pool number in the capture to replay (default: 0)\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct mock_pool_opts opts = { .diff_bits = 32 };
+	int c, fd, port = 8332;
+
+	while ((c = getopt(argc, argv, "p:l:j:f:b:d:rsR:P:")) != -1) {
+		switch (c) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'l':
+				opts.latency = atoi(optarg);
+				break;
+			case 'j':
+				opts.jitter = atoi(optarg);
+				break;
+			case 'f':
+				opts.fail = atoi(optarg);
+				break;
+			case 'b':
+				opts.block_secs = atoi(optarg);
+				break;
+			case 'd':
+				opts.diff_bits = atoi(optarg);
+				break;
+			case 'r':
+				opts.roll = true;
+				break;
+			case 's':
+				opts.stratum = true;
+				break;
+			case 'R':
+				opts.replay = optarg;
+				break;
+			case 'P':
+				opts.replay_pool = atoi(optarg);
+				break;
+			default:
+				mock_usage(argv[0]);
+		}
+	}
+	if (optind < argc || port < 0 || port > 65535 || opts.latency < 0 ||
+	    opts.jitter < 0 || opts.fail < 0 || opts.fail > 100 ||
+	    opts.block_secs < 0 || opts.diff_bits < 0 || opts.diff_bits > 256 ||
+	    opts.replay_pool < 0 || opts.replay_pool > 255 ||
+	    (opts.stratum && opts.replay))
+		mock_usage(argv[0]);
+	if (!mock_setup(&opts))
+		return 1;
+
+	fd = mock_pool_listen(&port);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to listen on 127.0.0.1:%d\n", port);
+		return 1;
+	}
+	printf("Mock pool listening on %s://127.0.0.1:%d\n",
+	       opts.stratum ? "stratum+tcp" : "http", port);
+	fflush(stdout);
+	mock_accept_loop(fd);
+	return 0;
+}
+#endif /* MOCKPOOL_MAIN */
+
+#else /* defined(unix) */
+
+#ifdef MOCKPOOL_MAIN
+int main(void)
+{
+	fprintf(stderr, "The mock pool is only available on unix\n");
+	return 1;
+}
+#endif
+
+#endif /* defined(unix) */
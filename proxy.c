@@ -0,0 +1,593 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <jansson.h>
+#ifndef WIN32
+# include <errno.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# define CLOSESOCKET close
+#else
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define CLOSESOCKET closesocket
+#endif
+
+#include "compat.h"
+#include "miner.h"
+#include "uthash.h"
+
+/* The getwork proxy lets other miners on the network take their work from
+ * this cgminer instead of each talking to the pools themselves. Work is
+ * handed out from the staged work, rolled where the pool allows it, shares
+ * coming back are checked and sent upstream like locally found ones, and a
+ * longpoll is held for every downstream miner that asks for one. Each
+ * connection is served by its own thread. */
+
+/* Largest request, headers and body, taken from a downstream miner */
+#define PROXY_BUFSIZ	8192
+
+/* How often a held longpoll checks whether its miner went away */
+#define PROXY_LP_CHECK	30
+
+/* Connections served at once, and downstream miners counted separately
+ * before the rest are lumped together */
+#define PROXY_MAX_CONNS		128
+#define PROXY_MAX_CLIENTS	256
+
+static const char *PROXY_OTHERS = "(others)";
+
+static const char *PROXY_LP_PATH = "/LP";
+
+/* Work handed out, found again by its header without the nonce when a
+ * share on it is submitted */
+struct proxy_work {
+	unsigned char key[76];
+	struct work work;
+	UT_hash_handle hh;
+};
+
+static struct proxy_work *proxy_works;
+static time_t proxy_swept;
+static unsigned int proxy_block;
+static unsigned int proxy_getworks;
+static int proxy_conns;
+
+struct proxy_client *proxy_clients;
+int total_proxy_clients;
+pthread_mutex_t proxy_lock;
+pthread_cond_t proxy_cond;
+
+struct proxy_conn {
+	int sock;
+	char addr[48];
+};
+
+/* A new block makes all work handed out stale, wake the held longpolls */
+void proxy_new_block(void)
+{
+	if (!opt_proxy_listen)
+		return;
+
+	mutex_lock(&proxy_lock);
+	proxy_block++;
+	pthread_cond_broadcast(&proxy_cond);
+	mutex_unlock(&proxy_lock);
+}
+
+/* The number of downstream miners seen in the last minute, and the rate
+ * they have taken work at since the last call */
+int proxy_active(double *rate)
+{
+	static struct timeval tv_last;
+	static unsigned int last_getworks;
+	struct proxy_client *client;
+	struct timeval now, diff;
+	unsigned int getworks;
+	double secs;
+	int active = 0;
+
+	*rate = 0;
+	if (!opt_proxy_listen)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	mutex_lock(&proxy_lock);
+	for (client = proxy_clients; client; client = client->next) {
+		if (now.tv_sec - client->last_seen < 60)
+			active++;
+	}
+	getworks = proxy_getworks;
+	mutex_unlock(&proxy_lock);
+
+	timeval_subtract(&diff, &now, &tv_last);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	if (tv_last.tv_sec && secs > 0)
+		*rate = (getworks - last_getworks) / secs;
+	tv_last = now;
+	last_getworks = getworks;
+	return active;
+}
+
+static struct proxy_client *proxy_client(const char *name, const char *addr)
+{
+	struct proxy_client *client;
+
+	mutex_lock(&proxy_lock);
+	/* Clients are never freed as work and shares in flight point at them,
+	 * so a flood of names is bounded by counting it as one */
+	if (total_proxy_clients >= PROXY_MAX_CLIENTS)
+		name = PROXY_OTHERS;
+	for (client = proxy_clients; client; client = client->next) {
+		if (!strcmp(client->name, name))
+			break;
+	}
+	if (!client) {
+		client = calloc(sizeof(*client), 1);
+		if (unlikely(!client))
+			quit(1, "Failed to calloc client in proxy_client");
+		client->id = total_proxy_clients++;
+		snprintf(client->name, sizeof(client->name), "%s", name);
+		client->next = proxy_clients;
+		proxy_clients = client;
+		applog(LOG_NOTICE, "Proxy client %s connected from %s", client->name, addr);
+	}
+	snprintf(client->addr, sizeof(client->addr), "%s", addr);
+	client->last_seen = time(NULL);
+	mutex_unlock(&proxy_lock);
+
+	return client;
+}
+
+static int base64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/* Decode the user name of an HTTP basic authorization into 'name' */
+static void basic_user(char *name, size_t size, const char *b64)
+{
+	unsigned int bits = 0, nbits = 0;
+	size_t len = 0;
+	int v;
+
+	while (len < size - 1 && (v = base64_value(*b64++)) >= 0) {
+		bits = (bits << 6) | v;
+		nbits += 6;
+		if (nbits >= 8) {
+			char c = bits >> (nbits - 8);
+
+			nbits -= 8;
+			if (c == ':')
+				break;
+			name[len++] = c;
+		}
+	}
+	name[len] = '\0';
+}
+
+/* Find header 'hdr' in the request headers 'buf', returning its value */
+static const char *http_header(const char *buf, const char *hdr)
+{
+	size_t len = strlen(hdr);
+	const char *p = buf;
+
+	while ((p = strstr(p, "\r\n"))) {
+		p += 2;
+		if (!strncasecmp(p, hdr, len) && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ')
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static bool proxy_send(int sock, const char *s, size_t len)
+{
+	while (len) {
+		ssize_t sent = send(sock, s, len, 0);
+
+		if (sent <= 0)
+			return false;
+		s += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+/* Has the downstream miner on 'sock' closed its connection */
+static bool proxy_gone(int sock)
+{
+	struct timeval timeout = { 0, 0 };
+	char c;
+	fd_set rd;
+
+	FD_ZERO(&rd);
+	FD_SET(sock, &rd);
+	if (select(sock + 1, &rd, NULL, NULL, &timeout) <= 0)
+		return false;
+	return recv(sock, &c, 1, MSG_PEEK) <= 0;
+}
+
+/* Hold a longpoll until the next block, false if the miner went away */
+static bool proxy_longpoll(struct proxy_conn *conn)
+{
+	struct timespec abstime = {};
+	unsigned int block;
+	bool ret = true;
+
+	mutex_lock(&proxy_lock);
+	block = proxy_block;
+	while (block == proxy_block) {
+		abstime.tv_sec = time(NULL) + PROXY_LP_CHECK;
+		pthread_cond_timedwait(&proxy_cond, &proxy_lock, &abstime);
+		if (block == proxy_block && proxy_gone(conn->sock)) {
+			ret = false;
+			break;
+		}
+	}
+	mutex_unlock(&proxy_lock);
+	return ret;
+}
+
+/* Drop the work handed out that shares can no longer be accepted on */
+static void proxy_sweep(void)
+{
+	struct proxy_work *pw, *tmp;
+
+	HASH_ITER(hh, proxy_works, pw, tmp) {
+		if (stale_work(&pw->work, true)) {
+			HASH_DEL(proxy_works, pw);
+			free(pw);
+		}
+	}
+}
+
+static json_t *proxy_getwork(struct proxy_client *client)
+{
+	struct proxy_work *pw;
+	json_t *res;
+	char *hexstr;
+	time_t now;
+
+	pw = calloc(sizeof(*pw), 1);
+	if (unlikely(!pw))
+		quit(1, "Failed to calloc pw in proxy_getwork");
+	if (unlikely(!get_proxy_work(&pw->work))) {
+		free(pw);
+		return NULL;
+	}
+	pw->work.client = client;
+	memcpy(pw->key, pw->work.data, sizeof(pw->key));
+
+	res = json_object();
+	hexstr = bin2hex(pw->work.midstate, sizeof(pw->work.midstate));
+	json_object_set_new(res, "midstate", json_string(hexstr));
+	free(hexstr);
+	hexstr = bin2hex(pw->work.data, sizeof(pw->work.data));
+	json_object_set_new(res, "data", json_string(hexstr));
+	free(hexstr);
+	hexstr = bin2hex(pw->work.hash1, sizeof(pw->work.hash1));
+	json_object_set_new(res, "hash1", json_string(hexstr));
+	free(hexstr);
+	hexstr = bin2hex(pw->work.target, sizeof(pw->work.target));
+	json_object_set_new(res, "target", json_string(hexstr));
+	free(hexstr);
+
+	now = time(NULL);
+	mutex_lock(&proxy_lock);
+	if (proxy_swept != now) {
+		proxy_sweep();
+		proxy_swept = now;
+	}
+	HASH_ADD(hh, proxy_works, key, sizeof(pw->key), pw);
+	proxy_getworks++;
+	client->getworks++;
+	mutex_unlock(&proxy_lock);
+
+	return res;
+}
+
+/* Check a share from a downstream miner and pass it upstream */
+static bool proxy_submit(struct proxy_client *client, const char *hexstr)
+{
+	unsigned char data[128];
+	struct proxy_work *pw;
+	struct work work;
+	uint32_t nonce;
+
+	stat_inc(client->submits);
+	/* Checked here so hex2bin never logs what a client sent as an error */
+	if (strlen(hexstr) != sizeof(data) * 2 ||
+	    strspn(hexstr, "0123456789abcdefABCDEF") != sizeof(data) * 2 ||
+	    !hex2bin(data, hexstr, sizeof(data))) {
+		applog(LOG_INFO, "Malformed share from proxy client %s", client->name);
+		stat_inc(client->invalid);
+		return false;
+	}
+
+	mutex_lock(&proxy_lock);
+	HASH_FIND(hh, proxy_works, data, sizeof(pw->key), pw);
+	if (pw)
+		memcpy(&work, &pw->work, sizeof(work));
+	mutex_unlock(&proxy_lock);
+
+	if (!pw || stale_work(&work, true)) {
+		applog(LOG_INFO, "Stale share from proxy client %s", client->name);
+		stat_inc(client->stale);
+		return false;
+	}
+
+	memcpy(work.data + 76, data + 76, 4);
+	if (!hashtest(&work)) {
+		applog(LOG_INFO, "Share below target from proxy client %s", client->name);
+		stat_inc(client->invalid);
+		return false;
+	}
+
+	nonce = work.data[76] | work.data[77] << 8 | work.data[78] << 16 | (uint32_t)work.data[79] << 24;
+	return submit_nonce(NULL, &work, nonce);
+}
+
+static json_t *rpc_error(int code, const char *message)
+{
+	json_t *err = json_object();
+
+	json_object_set_new(err, "code", json_integer(code));
+	json_object_set_new(err, "message", json_string(message));
+	return err;
+}
+
+/* Answer one JSON-RPC request, returning the reply */
+static char *proxy_request(struct proxy_conn *conn, const char *hdrs,
+			   const char *path, const char *body)
+{
+	json_t *val = NULL, *reply, *res = NULL, *err = NULL, *params;
+	const char *auth, *method;
+	struct proxy_client *client;
+	json_error_t json_err;
+	char name[64];
+	char *s;
+
+	auth = http_header(hdrs, "Authorization");
+	if (auth && !strncasecmp(auth, "Basic ", 6))
+		basic_user(name, sizeof(name), auth + 6);
+	else
+		name[0] = '\0';
+	if (!name[0])
+		strcpy(name, conn->addr);
+	client = proxy_client(name, conn->addr);
+
+	if (*body) {
+		val = json_loads(body, 0, &json_err);
+		if (!json_is_object(val)) {
+			err = rpc_error(-32700, "Parse error");
+			goto out;
+		}
+		method = json_string_value(json_object_get(val, "method"));
+		if (!method || strcmp(method, "getwork")) {
+			err = rpc_error(-32601, "Method not found");
+			goto out;
+		}
+	}
+
+	params = val ? json_object_get(val, "params") : NULL;
+	if (json_is_array(params) && json_array_size(params) > 0) {
+		const char *hexstr = json_string_value(json_array_get(params, 0));
+
+		res = (hexstr && proxy_submit(client, hexstr)) ? json_true() : json_false();
+		goto out;
+	}
+
+	if (!strncasecmp(path, PROXY_LP_PATH, strlen(PROXY_LP_PATH))) {
+		stat_inc(client->longpolls);
+		if (!proxy_longpoll(conn)) {
+			if (val)
+				json_decref(val);
+			return NULL;
+		}
+	}
+	res = proxy_getwork(client);
+	if (!res)
+		err = rpc_error(-1, "No work available");
+out:
+	reply = json_object();
+	json_object_set_new(reply, "result", res ? res : json_null());
+	json_object_set_new(reply, "error", err ? err : json_null());
+	json_object_set(reply, "id", (val && json_object_get(val, "id")) ?
+			json_object_get(val, "id") : json_null());
+	s = json_dumps(reply, JSON_COMPACT);
+	json_decref(reply);
+	if (val)
+		json_decref(val);
+	return s;
+}
+
+/* Serve the requests of one downstream miner until it disconnects */
+static void *proxy_conn_thread(void *userdata)
+{
+	struct proxy_conn *conn = userdata;
+	size_t len = 0;
+	char *buf;
+
+	pthread_detach(pthread_self());
+
+	buf = malloc(PROXY_BUFSIZ + 1);
+	if (unlikely(!buf))
+		goto out;
+	buf[0] = '\0';
+
+	while (42) {
+		char *hdr_end, *eol, *body, *path, *reply, saved, hdr[256];
+		const char *clen, *connection;
+		size_t want, body_len = 0;
+		bool keepalive, sent;
+		ssize_t n;
+
+		while (!(hdr_end = strstr(buf, "\r\n\r\n"))) {
+			if (len >= PROXY_BUFSIZ)
+				goto out;
+			n = recv(conn->sock, buf + len, PROXY_BUFSIZ - len, 0);
+			if (n <= 0)
+				goto out;
+			len += n;
+			buf[len] = '\0';
+		}
+		*hdr_end = '\0';
+		body = hdr_end + 4;
+
+		clen = http_header(buf, "Content-Length");
+		if (clen)
+			body_len = strtoul(clen, NULL, 10);
+		/* Checked before adding so a huge length cannot wrap want */
+		if (body_len > PROXY_BUFSIZ)
+			goto out;
+		want = body - buf + body_len;
+		if (want > PROXY_BUFSIZ)
+			goto out;
+		while (len < want) {
+			n = recv(conn->sock, buf + len, PROXY_BUFSIZ - len, 0);
+			if (n <= 0)
+				goto out;
+			len += n;
+		}
+
+		/* HTTP/1.1 connections persist unless told otherwise */
+		eol = strstr(buf, "\r\n");
+		if (!eol)
+			eol = hdr_end;
+		connection = http_header(buf, "Connection");
+		if (eol - buf >= 8 && !strncmp(eol - 8, "HTTP/1.1", 8))
+			keepalive = !connection || strncasecmp(connection, "close", 5);
+		else
+			keepalive = connection && !strncasecmp(connection, "keep-alive", 10);
+
+		path = strchr(buf, ' ');
+		path = path ? path + 1 : buf;
+
+		saved = body[body_len];
+		body[body_len] = '\0';
+		reply = proxy_request(conn, buf, path, body);
+		body[body_len] = saved;
+		if (!reply)
+			goto out;
+
+		snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+			 "Content-Type: application/json\r\n"
+			 "Content-Length: %d\r\n"
+			 "X-Long-Polling: %s\r\n"
+			 "Connection: %s\r\n\r\n",
+			 (int)strlen(reply), PROXY_LP_PATH, keepalive ? "keep-alive" : "close");
+		sent = proxy_send(conn->sock, hdr, strlen(hdr)) &&
+		       proxy_send(conn->sock, reply, strlen(reply));
+		free(reply);
+		if (!sent || !keepalive)
+			goto out;
+
+		/* Keep what the miner may have pipelined after this request */
+		memmove(buf, buf + want, len - want);
+		len -= want;
+		buf[len] = '\0';
+	}
+out:
+	free(buf);
+	CLOSESOCKET(conn->sock);
+	free(conn);
+	mutex_lock(&proxy_lock);
+	proxy_conns--;
+	mutex_unlock(&proxy_lock);
+	return NULL;
+}
+
+void proxy(void)
+{
+	struct sockaddr_in serv, cli;
+	struct proxy_conn *conn;
+	socklen_t clisiz;
+	pthread_t pth;
+	int sock, c, on = 1;
+
+	if (!opt_proxy_listen)
+		return;
+
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		applog(LOG_ERR, "Proxy socket failed (%s), proxy will not be available", strerror(errno));
+		return;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(opt_proxy_network ? INADDR_ANY : INADDR_LOOPBACK);
+	serv.sin_port = htons(opt_proxy_port);
+	if (bind(sock, (struct sockaddr *)&serv, sizeof(serv)) < 0 || listen(sock, 64) < 0) {
+		applog(LOG_ERR, "Proxy bind to port %d failed (%s), proxy will not be available",
+		       opt_proxy_port, strerror(errno));
+		CLOSESOCKET(sock);
+		return;
+	}
+	applog(LOG_WARNING, "Getwork proxy listening on %s port %d",
+	       opt_proxy_network ? "all addresses" : "127.0.0.1", opt_proxy_port);
+
+	while (42) {
+		clisiz = sizeof(cli);
+		c = accept(sock, (struct sockaddr *)&cli, &clisiz);
+		if (c < 0) {
+			applog(LOG_ERR, "Proxy accept failed (%s), proxy will not be available", strerror(errno));
+			break;
+		}
+
+		mutex_lock(&proxy_lock);
+		if (proxy_conns >= PROXY_MAX_CONNS) {
+			mutex_unlock(&proxy_lock);
+			applog(LOG_INFO, "Proxy refused %s, already serving %d connections",
+			       inet_ntoa(cli.sin_addr), PROXY_MAX_CONNS);
+			CLOSESOCKET(c);
+			continue;
+		}
+		proxy_conns++;
+		mutex_unlock(&proxy_lock);
+
+		conn = calloc(sizeof(*conn), 1);
+		if (unlikely(!conn))
+			quit(1, "Failed to calloc conn in proxy");
+		conn->sock = c;
+		snprintf(conn->addr, sizeof(conn->addr), "%s", inet_ntoa(cli.sin_addr));
+		if (unlikely(pthread_create(&pth, NULL, proxy_conn_thread, conn))) {
+			applog(LOG_ERR, "Failed to create proxy connection thread");
+			CLOSESOCKET(c);
+			free(conn);
+			mutex_lock(&proxy_lock);
+			proxy_conns--;
+			mutex_unlock(&proxy_lock);
+		}
+	}
+	CLOSESOCKET(sock);
+}
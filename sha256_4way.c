@@ -109,6 +109,7 @@ bool ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     unsigned int *nNonce_p = (unsigned int*)(pdata + 76);
+    const unsigned int target7 = ((const unsigned int *)ptarget)[7];
 
 	pdata += 64;
 
@@ -126,7 +127,7 @@ bool ScanHash_4WaySSE2(int thr_id, const unsigned char *pmidstate,
 
         for (j = 0; j < NPAR; j++)
         {
-            if (unlikely(thash[7][j] == 0))
+            if (unlikely(swab32(thash[7][j]) <= target7))
             {
 		int i;
 
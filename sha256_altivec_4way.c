@@ -82,6 +82,7 @@ bool ScanHash_altivec_4way(int thr_id, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     unsigned int *nNonce_p = (unsigned int*)(pdata + 76);
+    const unsigned int target7 = ((const unsigned int *)ptarget)[7];
 
 	pdata += 64;
 
@@ -98,7 +99,7 @@ bool ScanHash_altivec_4way(int thr_id, const unsigned char *pmidstate,
 
         for (j = 0; j < NPAR; j++)
         {
-            if (unlikely(thash[7][j] == 0))
+            if (unlikely(swab32(thash[7][j]) <= target7))
             {
 		int i;
 
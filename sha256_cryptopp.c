@@ -102,6 +102,7 @@ bool scanhash_cryptopp(int thr_id, const unsigned char *midstate,
 {
 	uint32_t *hash32 = (uint32_t *) hash;
 	uint32_t *nonce = (uint32_t *)(data + 76);
+	const uint32_t target7 = ((const uint32_t *)target)[7];
 
 	data += 64;
 
@@ -114,7 +115,7 @@ bool scanhash_cryptopp(int thr_id, const unsigned char *midstate,
 		runhash(hash1, data, midstate);
 		runhash(hash, hash1, sha256_init_state);
 
-		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
+		if (unlikely((swab32(hash32[7]) <= target7) && fulltest(hash, target))) {
 			*last_nonce = n;
 			return true;
 		}
@@ -586,6 +587,7 @@ bool scanhash_asm32(int thr_id, const unsigned char *midstate,
 {
 	uint32_t *hash32 = (uint32_t *) hash;
 	uint32_t *nonce = (uint32_t *)(data + 76);
+	const uint32_t target7 = ((const uint32_t *)target)[7];
 
 	data += 64;
 
@@ -598,7 +600,7 @@ bool scanhash_asm32(int thr_id, const unsigned char *midstate,
 		runhash32(hash1, data, midstate);
 		runhash32(hash, hash1, sha256_init_state);
 
-		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
+		if (unlikely((swab32(hash32[7]) <= target7) && fulltest(hash, target))) {
 			*last_nonce = n;
 			return true;
 		}
@@ -247,6 +247,9 @@ bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 {
 	uint32_t *hash32 = (uint32_t *) hash;
 	uint32_t *nonce = (uint32_t *)(data + 76);
+	/* Zero for any real pool, only a test pool hands out targets easier
+	 * than difficulty 1 */
+	const uint32_t target7 = ((const uint32_t *)target)[7];
 	unsigned long stat_ctr = 0;
 
 	data += 64;
@@ -262,7 +265,7 @@ bool scanhash_c(int thr_id, const unsigned char *midstate, unsigned char *data,
 
 		stat_ctr++;
 
-		if (unlikely((hash32[7] == 0) && fulltest(hash, target))) {
+		if (unlikely((swab32(hash32[7]) <= target7) && fulltest(hash, target))) {
 			*last_nonce = n;
 			return true;
 		}
@@ -58,6 +58,7 @@ bool scanhash_sse2_64(int thr_id, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     uint32_t *nNonce_p = (uint32_t *)(pdata + 76);
+    const uint32_t target7 = ((const uint32_t *)ptarget)[7];
     uint32_t m_midstate[8], m_w[16], m_w1[16];
     __m128i m_4w[64] __attribute__ ((aligned (0x100)));
     __m128i m_4hash[64] __attribute__ ((aligned (0x100)));
@@ -103,7 +104,7 @@ bool scanhash_sse2_64(int thr_id, const unsigned char *pmidstate,
 
 	for (j = 0; j < 4; j++) {
 	    mi.m = m_4hash[7];
-	    if (unlikely(mi.i[j] == 0))
+	    if (unlikely(swab32(mi.i[j]) <= target7))
 		break;
         }
 
@@ -58,6 +58,7 @@ bool scanhash_sse2_32(int thr_id, const unsigned char *pmidstate,
 	uint32_t nonce)
 {
     uint32_t *nNonce_p = (uint32_t *)(pdata + 76);
+    const uint32_t target7 = ((const uint32_t *)ptarget)[7];
     uint32_t m_midstate[8], m_w[16], m_w1[16];
     __m128i m_4w[64] __attribute__ ((aligned (0x100)));
     __m128i m_4hash[64] __attribute__ ((aligned (0x100)));
@@ -98,7 +99,7 @@ bool scanhash_sse2_32(int thr_id, const unsigned char *pmidstate,
 	CalcSha256_x86 (m_4hash, m_4hash1, sha256_32init);
 
 	for (j = 0; j < 4; j++) {
-	    if (unlikely(((uint32_t *)&(m_4hash[7]))[j] == 0)) {
+	    if (unlikely(swab32(((uint32_t *)&(m_4hash[7]))[j]) <= target7)) {
 		/* We found a hit...so check it */
 		/* Use the C version for a check... */
 
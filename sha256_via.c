@@ -32,6 +32,7 @@ bool scanhash_via(int thr_id, const unsigned char *pmidstate,
 	uint32_t *data32 = (uint32_t *) data;
 	uint32_t *hash32 = (uint32_t *) tmp_hash;
 	uint32_t *nonce = (uint32_t *)(data + 64 + 12);
+	const uint32_t target7 = ((const uint32_t *)target)[7];
 	unsigned long stat_ctr = 0;
 	int i;
 
@@ -63,7 +64,7 @@ bool scanhash_via(int thr_id, const unsigned char *pmidstate,
 
 		stat_ctr++;
 
-		if (unlikely((hash32[7] == 0) && fulltest(tmp_hash, target))) {
+		if (unlikely((swab32(hash32[7]) <= target7) && fulltest(tmp_hash, target))) {
 			/* swap nonce'd data back into original storage area;
 			 * TODO: only swap back the nonce, rather than all data
 			 */
@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
@@ -22,7 +23,9 @@
 #include <time.h>
 #include <curses.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/types.h>
 #ifndef WIN32
 # include <sys/socket.h>
@@ -32,8 +35,24 @@
 # include <winsock2.h>
 # include <mstcpip.h>
 #endif
+#if defined(unix)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 #include "miner.h"
 #include "elist.h"
+#include "sha2.h"
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #if JANSSON_MAJOR_VERSION >= 2
 #define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
@@ -42,18 +61,15 @@
 #endif
 
 bool successful_connect = false;
-struct timeval nettime;
+bool lock_stats;
+pthread_key_t lock_stats_key;
+unsigned long lock_count;
 
 struct data_buffer {
 	void		*buf;
 	size_t		len;
 };
 
-struct upload_buffer {
-	const void	*buf;
-	size_t		len;
-};
-
 struct header_info {
 	char		*lp_path;
 	bool		has_rolltime;
@@ -159,24 +175,6 @@ static size_t all_data_cb(const void *ptr, size_t size, size_t nmemb,
 	return len;
 }
 
-static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb,
-			     void *user_data)
-{
-	struct upload_buffer *ub = user_data;
-	int len = size * nmemb;
-
-	if (len > ub->len)
-		len = ub->len;
-
-	if (len) {
-		memcpy(ptr, ub->buf, len);
-		ub->buf += len;
-		ub->len -= len;
-	}
-
-	return len;
-}
-
 static size_t resp_hdr_cb(void *ptr, size_t size, size_t nmemb, void *user_data)
 {
 	struct header_info *hi = user_data;
@@ -287,147 +285,691 @@ int json_rpc_call_sockopt_cb(void *userdata, curl_socket_t fd, curlsocktype purp
 }
 #endif
 
-static void last_nettime(struct timeval *last)
+/* Requests per second of each class for pools without a --net-rate when
+ * --net-delay is in use */
+#define NET_DELAY_RATE 4
+
+/* Take a token from the pool's bucket for this class of request. Returns 0
+ * if the request may go ahead, otherwise the milliseconds until it may */
+int net_throttle(struct pool *pool, enum net_class class)
 {
-	rd_lock(&netacc_lock);
-	last->tv_sec = nettime.tv_sec;
-	last->tv_usec = nettime.tv_usec;
-	rd_unlock(&netacc_lock);
+	struct net_bucket *nb = &pool->net[class];
+	struct timeval now, diff;
+	double rate, burst;
+	int ret = 0;
+
+	mutex_lock(&pool->pool_lock);
+	rate = nb->rate;
+	if (!pool->net_rate_set && opt_delaynet)
+		rate = NET_DELAY_RATE;
+	if (rate <= 0)
+		goto out;
+
+	burst = rate > 1 ? rate : 1;
+	gettimeofday(&now, NULL);
+	if (timerisset(&nb->tv_fill)) {
+		if (!timeval_subtract(&diff, &now, &nb->tv_fill))
+			nb->tokens += (diff.tv_sec + diff.tv_usec / 1000000.0) * rate;
+		if (nb->tokens > burst)
+			nb->tokens = burst;
+	} else
+		nb->tokens = burst;
+	nb->tv_fill = now;
+
+	if (nb->tokens < 1) {
+		if (!timerisset(&nb->tv_held))
+			nb->tv_held = now;
+		ret = (1 - nb->tokens) * 1000 / rate + 1;
+		goto out;
+	}
+	nb->tokens--;
+	if (timerisset(&nb->tv_held)) {
+		if (!timeval_subtract(&diff, &now, &nb->tv_held))
+			nb->throttled += diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+		timerclear(&nb->tv_held);
+	}
+out:
+	mutex_unlock(&pool->pool_lock);
+	return ret;
 }
 
-static void set_nettime(void)
+static void pool_share_lock(CURL *curl, curl_lock_data data,
+			    curl_lock_access access, void *userptr)
 {
-	wr_lock(&netacc_lock);
-	gettimeofday(&nettime, NULL);
-	wr_unlock(&netacc_lock);
+	struct pool *pool = userptr;
+
+	mutex_lock(&pool->share_lock[data]);
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, bool *rolltime,
-		      struct pool *pool)
+static void pool_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
 {
-	json_t *val, *err_val, *res_val;
-	int rc;
-	struct data_buffer all_data = { };
-	struct upload_buffer upload_data;
-	json_error_t err = { };
-	struct curl_slist *headers = NULL;
-	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
-	long timeout = longpoll ? (60 * 60) : 60;
-	struct header_info hi = { };
-	bool probing = false;
+	struct pool *pool = userptr;
+
+	mutex_unlock(&pool->share_lock[data]);
+}
 
-	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
+/* Set up the state every curl handle of this pool shares: the DNS cache,
+ * SSL sessions and open connections are kept in a CURLSH so a new handle
+ * does not need a fresh TCP/TLS handshake, and the request headers are
+ * built once instead of on every call. */
+void setup_pool_curl(struct pool *pool)
+{
+	char user_agent_hdr[128];
+	int i;
 
-	if (probe) {
-		probing = !pool->probed;
-		/* Probe for only 15 seconds */
-		timeout = 15;
+	INIT_LIST_HEAD(&pool->curlring);
+	if (unlikely(pthread_cond_init(&pool->cr_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init in setup_pool_curl");
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		if (unlikely(pthread_mutex_init(&pool->share_lock[i], NULL)))
+			quit(1, "Failed to pthread_mutex_init in setup_pool_curl");
 	}
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+
+	pool->curl_share = curl_share_init();
+	if (unlikely(!pool->curl_share))
+		quit(1, "CURL share initialisation failed");
+	curl_share_setopt(pool->curl_share, CURLSHOPT_LOCKFUNC, pool_share_lock);
+	curl_share_setopt(pool->curl_share, CURLSHOPT_UNLOCKFUNC, pool_share_unlock);
+	curl_share_setopt(pool->curl_share, CURLSHOPT_USERDATA, pool);
+	curl_share_setopt(pool->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(pool->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(pool->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
+	pool->curl_headers = curl_slist_append(pool->curl_headers,
+		"Content-type: application/json");
+	pool->curl_headers = curl_slist_append(pool->curl_headers,
+		"X-Mining-Extensions: longpoll midstate rollntime");
+	pool->curl_headers = curl_slist_append(pool->curl_headers, user_agent_hdr);
+	/* disable Expect hdr */
+	pool->curl_headers = curl_slist_append(pool->curl_headers, "Expect:");
+	if (unlikely(!pool->curl_headers))
+		quit(1, "Failed to build curl headers in setup_pool_curl");
+}
+
+/* Create a curl handle with the per pool request template applied. Only the
+ * per request options are set again by json_rpc_call. */
+CURL *pool_curl_init(struct pool *pool)
+{
+	CURL *curl = curl_easy_init();
+
+	if (unlikely(!curl))
+		return NULL;
 
 #if 0 /* Disable curl debugging since it spews to stderr */
 	if (opt_protocol)
 		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
 #endif
+	curl_easy_setopt(curl, CURLOPT_SHARE, pool->curl_share);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_ENCODING, "");
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
 	if (!opt_delaynet)
 		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
-	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
 	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	if (opt_socks_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, opt_socks_proxy);
 		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, CURLPROXY_SOCKS4);
 	}
-	if (userpass) {
-		curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
+	if (pool->rpc_userpass) {
+		curl_easy_setopt(curl, CURLOPT_USERPWD, pool->rpc_userpass);
 		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
 	}
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, pool->curl_headers);
+
+	return curl;
+}
+
+enum gws_state {
+	GWS_VALUE,	/* expecting a value */
+	GWS_KEY,	/* expecting a key or the end of an object */
+	GWS_COLON,
+	GWS_NEXT,	/* expecting ',' or the end of the container */
+	GWS_STRING,
+	GWS_ESCAPE,
+	GWS_LITERAL,
+	GWS_END,
+	GWS_FAIL,
+};
+
+enum gws_member {
+	GWM_OTHER,
+	GWM_RESULT,
+	GWM_ERROR,
+};
+
+#define GWS_MAXDEPTH 16
+
+/* State of the streaming getwork reply parser. It only understands the
+ * shape {"result": {"data": "..", ...}, "error": null, ...}, anything else
+ * makes it give up and leaves the reply to jansson. */
+struct getwork_stream {
+	struct work		*work;
+	unsigned char		state;
+	unsigned char		depth;
+	unsigned char		member;
+	signed char		field;
+	bool			in_key;
+	bool			escaped;
+	bool			spilled;
+	char			nest[GWS_MAXDEPTH];
+	char			lit[6];
+	size_t			litlen;
+	char			str[257];
+	size_t			len;
+	unsigned int		seen;
+	size_t			rawlen;
+	char			raw[2048];
+};
+
+static const struct {
+	const char	*name;
+	unsigned int	flag;
+	size_t		offset;
+	size_t		size;
+} gws_fields[] = {
+	{ "data",	GW_DATA,	offsetof(struct work, data),	 sizeof(((struct work *)0)->data) },
+	{ "midstate",	GW_MIDSTATE,	offsetof(struct work, midstate), sizeof(((struct work *)0)->midstate) },
+	{ "hash1",	GW_HASH1,	offsetof(struct work, hash1),	 sizeof(((struct work *)0)->hash1) },
+	{ "target",	GW_TARGET,	offsetof(struct work, target),	 sizeof(((struct work *)0)->target) },
+};
+
+static void gws_key(struct getwork_stream *gs)
+{
+	int i;
+
+	gs->str[gs->len] = '\0';
+	if (gs->depth == 1) {
+		if (!strcmp(gs->str, "result"))
+			gs->member = GWM_RESULT;
+		else if (!strcmp(gs->str, "error"))
+			gs->member = GWM_ERROR;
+		else
+			gs->member = GWM_OTHER;
+		return;
+	}
+	if (gs->depth != 2 || gs->member != GWM_RESULT)
+		return;
+	gs->field = -1;
+	if (gs->escaped)
+		return;
+	for (i = 0; i < (int)(sizeof(gws_fields) / sizeof(gws_fields[0])); i++) {
+		if (!strcmp(gs->str, gws_fields[i].name)) {
+			gs->field = i;
+			return;
+		}
+	}
+}
+
+/* A string value has ended, decode it if it is one of the work fields */
+static bool gws_string(struct getwork_stream *gs)
+{
+	int f = gs->field;
+
+	if (gs->depth != 2 || gs->member != GWM_RESULT || f < 0)
+		return gs->depth != 1 || gs->member == GWM_OTHER;
+	gs->field = -1;
+	if (gs->escaped || gs->len != gws_fields[f].size * 2)
+		return false;
+	gs->str[gs->len] = '\0';
+	if (!hex2bin((unsigned char *)gs->work + gws_fields[f].offset, gs->str,
+		     gws_fields[f].size))
+		return false;
+	gs->seen |= gws_fields[f].flag;
+	return true;
+}
+
+static void gws_value_done(struct getwork_stream *gs)
+{
+	gs->state = gs->depth ? GWS_NEXT : GWS_END;
+}
+
+static void gws_feed(struct getwork_stream *gs, const char *p, size_t len)
+{
+	const char *end = p + len;
+
+	while (p < end && gs->state != GWS_FAIL) {
+		char c = *p;
+
+		switch (gs->state) {
+		case GWS_STRING:
+			if (c == '"') {
+				if (gs->in_key) {
+					gws_key(gs);
+					gs->state = GWS_COLON;
+				} else if (gws_string(gs))
+					gws_value_done(gs);
+				else
+					gs->state = GWS_FAIL;
+			} else if (c == '\\') {
+				gs->escaped = true;
+				gs->state = GWS_ESCAPE;
+			} else if (gs->len < sizeof(gs->str) - 1)
+				gs->str[gs->len++] = c;
+			else
+				gs->escaped = true;	/* too long to be of use */
+			break;
+		case GWS_ESCAPE:
+			gs->state = GWS_STRING;
+			break;
+		case GWS_LITERAL:
+			if (isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.') {
+				if (gs->litlen < sizeof(gs->lit) - 1)
+					gs->lit[gs->litlen++] = c;
+				break;
+			}
+			gs->lit[gs->litlen] = '\0';
+			/* "error" has to be null, anything else is a failed call */
+			if (gs->depth == 1 && gs->member == GWM_ERROR &&
+			    strcmp(gs->lit, "null")) {
+				gs->state = GWS_FAIL;
+				break;
+			}
+			gws_value_done(gs);
+			continue;	/* c is the delimiter, look at it again */
+		default:
+			if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+				break;
+			switch (gs->state) {
+			case GWS_VALUE:
+				if (gs->depth == 1 && gs->member == GWM_RESULT && c != '{') {
+					gs->state = GWS_FAIL;
+					break;
+				}
+				if (gs->depth == 1 && gs->member == GWM_ERROR && c != 'n') {
+					gs->state = GWS_FAIL;
+					break;
+				}
+				if (!gs->depth && c != '{') {
+					gs->state = GWS_FAIL;
+					break;
+				}
+				if (c == '{' || c == '[') {
+					if (gs->depth >= GWS_MAXDEPTH) {
+						gs->state = GWS_FAIL;
+						break;
+					}
+					if (gs->depth == 1 && gs->member == GWM_RESULT)
+						gs->seen |= GW_RESULT;
+					gs->nest[gs->depth++] = c;
+					gs->state = c == '{' ? GWS_KEY : GWS_VALUE;
+				} else if (c == ']' && gs->nest[gs->depth - 1] == '[') {
+					gs->depth--;
+					gws_value_done(gs);
+				} else if (c == '"') {
+					gs->in_key = false;
+					gs->escaped = false;
+					gs->len = 0;
+					gs->state = GWS_STRING;
+				} else {
+					if (gs->depth == 2 && gs->member == GWM_RESULT)
+						gs->field = -1;
+					gs->litlen = 0;
+					gs->state = GWS_LITERAL;
+					continue;
+				}
+				break;
+			case GWS_KEY:
+				if (c == '"') {
+					gs->in_key = true;
+					gs->escaped = false;
+					gs->len = 0;
+					gs->state = GWS_STRING;
+				} else if (c == '}') {
+					gs->depth--;
+					gws_value_done(gs);
+				} else
+					gs->state = GWS_FAIL;
+				break;
+			case GWS_COLON:
+				gs->state = c == ':' ? GWS_VALUE : GWS_FAIL;
+				break;
+			case GWS_NEXT:
+				if (c == ',')
+					gs->state = gs->nest[gs->depth - 1] == '{' ? GWS_KEY : GWS_VALUE;
+				else if ((c == '}' && gs->nest[gs->depth - 1] == '{') ||
+					 (c == ']' && gs->nest[gs->depth - 1] == '[')) {
+					gs->depth--;
+					gws_value_done(gs);
+				} else
+					gs->state = GWS_FAIL;
+				break;
+			default:
+				/* Trailing garbage after the reply */
+				gs->state = GWS_FAIL;
+				break;
+			}
+			break;
+		}
+		p++;
+	}
+}
+
+struct rpc_transfer {
+	CURL			*curl;
+	struct pool		*pool;
+	struct data_buffer	all_data;
+	struct header_info	hi;
+	char			curl_err_str[CURL_ERROR_SIZE];
+	bool			probing;
+	struct rpc_stats	*stats;
+	const char		*rpc_req;
+	bool			longpoll;
+	struct getwork_stream	stream;		/* keep last, raw isn't cleared */
+};
+
+/* Write callback for getwork replies. Each chunk is parsed as it arrives and
+ * the work fields decoded straight into the work item, a copy of the raw
+ * reply is only kept in a fixed buffer in case it needs handing to jansson */
+static size_t getwork_stream_cb(const void *ptr, size_t size, size_t nmemb,
+				void *user_data)
+{
+	struct rpc_transfer *rt = user_data;
+	struct getwork_stream *gs = &rt->stream;
+	size_t len = size * nmemb;
+
+	if (gs->spilled)
+		return all_data_cb(ptr, size, nmemb, &rt->all_data);
+
+	if (unlikely(gs->rawlen + len >= sizeof(gs->raw))) {
+		/* Far bigger than any getwork reply, let jansson have it */
+		gs->state = GWS_FAIL;
+		gs->spilled = true;
+		if (gs->rawlen && all_data_cb(gs->raw, 1, gs->rawlen, &rt->all_data) != gs->rawlen)
+			return 0;
+		return all_data_cb(ptr, size, nmemb, &rt->all_data);
+	}
+
+	memcpy(gs->raw + gs->rawlen, ptr, len);
+	gs->rawlen += len;
+	gws_feed(gs, ptr, len);
+	return len;
+}
+
+/* Have the reply of a getwork transfer set up by json_rpc_setup decoded into
+ * 'work' as it streams in. Use json_rpc_finish_work to complete it. */
+void json_rpc_stream_work(struct rpc_transfer *rt, struct work *work)
+{
+	/* The raw reply is wanted for the protocol log */
+	if (opt_protocol)
+		return;
+
+	rt->stream.work = work;
+	curl_easy_setopt(rt->curl, CURLOPT_WRITEFUNCTION, getwork_stream_cb);
+	curl_easy_setopt(rt->curl, CURLOPT_WRITEDATA, rt);
+}
+
+/* Count the transfer in 'stats' rather than the pool's getwork figures */
+void json_rpc_stats(struct rpc_transfer *rt, struct rpc_stats *stats)
+{
+	rt->stats = stats;
+}
+
+static void rpc_stats_add(struct rpc_stats *stats, CURL *curl, bool ok)
+{
+	unsigned int ms;
+	double secs;
+	int i;
+
+	if (ok) {
+		if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &secs) != CURLE_OK)
+			secs = 0;
+		ms = secs * 1000;
+		for (i = 0; i < RPC_LAT_BUCKETS - 1 && ms >= 1U << i; i++)
+			;
+		stats->lat[i]++;
+		stats->replies++;
+	} else
+		stats->errors++;
+
+	if (stats->replies + stats->errors >= RPC_STATS_AGE) {
+		for (i = 0; i < RPC_LAT_BUCKETS; i++)
+			stats->lat[i] /= 2;
+		stats->replies /= 2;
+		stats->errors /= 2;
+	}
+}
+
+/* The latency in ms that 'pct' percent of replies came back within, as the
+ * upper bound of the histogram bucket it falls in. 0 with no replies yet */
+unsigned int rpc_stats_pct(const struct rpc_stats *stats, int pct)
+{
+	unsigned int total = 0, want;
+	int i;
+
+	for (i = 0; i < RPC_LAT_BUCKETS; i++)
+		total += stats->lat[i];
+	if (!total)
+		return 0;
+
+	want = (total * pct + 99) / 100;
+	total = 0;
+	for (i = 0; i < RPC_LAT_BUCKETS - 1; i++) {
+		total += stats->lat[i];
+		if (total >= want)
+			break;
+	}
+	return 1U << i;
+}
+
+/* The histogram as its bucket counts separated by colons, 'buf' needs room
+ * for RPC_LAT_BUCKETS * 11 bytes */
+void rpc_stats_str(char *buf, const struct rpc_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < RPC_LAT_BUCKETS; i++)
+		buf += sprintf(buf, "%s%u", i ? ":" : "", stats->lat[i]);
+}
+
+/* Prepare a JSON-RPC request on 'curl' without performing it so it can be
+ * driven either by curl_easy_perform or by a curl multi handle. 'rpc_req' is
+ * not copied by curl and must stay valid until json_rpc_finish. */
+struct rpc_transfer *json_rpc_setup(CURL *curl, const char *url,
+				    const char *rpc_req, bool probe,
+				    bool longpoll, struct pool *pool)
+{
+	long timeout = longpoll ? (60 * 60) : 60;
+	struct rpc_transfer *rt;
+
+	rt = malloc(sizeof(*rt));
+	if (unlikely(!rt))
+		return NULL;
+	memset(rt, 0, offsetof(struct rpc_transfer, stream.raw));
+	rt->curl = curl;
+	rt->pool = pool;
+	rt->rpc_req = rpc_req;
+	rt->longpoll = longpoll;
+	/* A longpoll is held open by the pool so says nothing of its speed */
+	if (!longpoll)
+		rt->stats = &pool->getwork_stats;
+
+	/* it is assumed that 'curl' came from pool_curl_init() for this pool
+	 * so only the per request options need setting here */
+
+	if (probe) {
+		rt->probing = !pool->probed;
+		/* Probe for only 15 seconds unless given a --probe-time */
+		timeout = 15;
+	}
+	if (probe && pool->probe_time)
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)pool->probe_time);
+	else
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+	/* Handles are reused, so clear any --fail-detect limit a getwork left */
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 0L);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rt->all_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, rt->curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &rt->hi);
 #ifdef CURL_HAS_SOCKOPT
 	if (longpoll)
 		curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, json_rpc_call_sockopt_cb);
 #endif
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
-	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
-	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, rpc_req);
 
-	headers = curl_slist_append(headers,
-		"Content-type: application/json");
-	headers = curl_slist_append(headers,
-		"X-Mining-Extensions: longpoll midstate rollntime");
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
-
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-	if (opt_delaynet) {
-		long long now_msecs, last_msecs;
-		struct timeval now, last;
-
-		gettimeofday(&now, NULL);
-		last_nettime(&last);
-		now_msecs = (long long)now.tv_sec * 1000;
-		now_msecs += now.tv_usec / 1000;
-		last_msecs = (long long)last.tv_sec * 1000;
-		last_msecs += last.tv_usec / 1000;
-		if (now_msecs > last_msecs && now_msecs - last_msecs < 250) {
-			struct timespec rgtp;
-
-			rgtp.tv_sec = 0;
-			rgtp.tv_nsec = (250 - (now_msecs - last_msecs)) * 1000000;
-			nanosleep(&rgtp, NULL);
-		}
-		set_nettime();
+	return rt;
+}
+
+static FILE *capture_file;
+static pthread_mutex_t capture_lock;
+
+static uint64_t capture_now(void)
+{
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* Start recording every JSON-RPC exchange to 'path' for --net-capture */
+bool capture_open(const char *path)
+{
+	if (capture_file)
+		fclose(capture_file);
+	capture_file = fopen(path, "wb");
+	if (!capture_file) {
+		applog(LOG_ERR, "Failed to open capture file %s: %s", path, strerror(errno));
+		return false;
 	}
-	rc = curl_easy_perform(curl);
+	mutex_init(&capture_lock);
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+	return true;
+}
+
+/* Record the exchange of 'rt' that curl completed with 'rc'. Each record is
+ * flushed so a capture of a run that ends badly is still complete */
+static void rpc_capture(struct rpc_transfer *rt, CURLcode rc)
+{
+	struct getwork_stream *gs = &rt->stream;
+	struct capture_rec rec;
+	const void *reply = NULL;
+	double secs;
+	long code;
+
+	memset(&rec, 0, sizeof(rec));
+	if (curl_easy_getinfo(rt->curl, CURLINFO_TOTAL_TIME, &secs) != CURLE_OK)
+		secs = 0;
+	rec.rtt = secs * 1000000;
+	rec.sent = capture_now() - rec.rtt;
+	rec.kind = capture_kind(rt->rpc_req, rt->longpoll);
+	rec.pool_no = rt->pool->pool_no;
+	rec.req_len = strlen(rt->rpc_req);
+
+	if (rc || curl_easy_getinfo(rt->curl, CURLINFO_RESPONSE_CODE, &code) != CURLE_OK ||
+	    code != 200)
+		rec.flags |= CAP_FAILED;
+	else if (gs->work && !gs->spilled) {
+		reply = gs->raw;
+		rec.reply_len = gs->rawlen;
+	} else {
+		reply = rt->all_data.buf;
+		rec.reply_len = rt->all_data.len;
+	}
+	if (rt->hi.lp_path)
+		rec.flags |= CAP_HAS_LP;
+	if (rt->hi.has_rolltime)
+		rec.flags |= CAP_ROLLTIME;
+
+	mutex_lock(&capture_lock);
+	fwrite(&rec, sizeof(rec), 1, capture_file);
+	fwrite(rt->rpc_req, 1, rec.req_len, capture_file);
+	if (rec.reply_len)
+		fwrite(reply, 1, rec.reply_len, capture_file);
+	fflush(capture_file);
+	mutex_unlock(&capture_lock);
+}
+
+/* Decode the reply of a transfer set up by json_rpc_setup once curl has
+ * completed it with result 'rc'. A batch reply must be an array, whose
+ * members the caller checks individually. A streamed getwork reply that
+ * decoded cleanly returns NULL with the GW_ flags of the fields found set in
+ * 'fields'. The transfer is freed. */
+static json_t *__json_rpc_finish(struct rpc_transfer *rt, CURLcode rc,
+				 bool *rolltime, bool batch, bool null_ok,
+				 unsigned int *fields)
+{
+	struct getwork_stream *gs = &rt->stream;
+	struct pool *pool = rt->pool;
+	CURL *curl = rt->curl;
+	json_t *val = NULL, *err_val, *res_val;
+	json_error_t err = { };
+	bool streamed = false;
+	long connects;
+
+	if (capture_file)
+		rpc_capture(rt, rc);
+
 	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+		applog(LOG_INFO, "HTTP request failed: %s", rt->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	/* No new connections means one was reused from the share */
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+		if (connects)
+			pool->curl_fresh++;
+		else
+			pool->curl_reused++;
+	}
+
+	if (gs->work) {
+		if (gs->state == GWS_END &&
+		    (gs->seen & (GW_RESULT | GW_DATA | GW_TARGET)) == (GW_RESULT | GW_DATA | GW_TARGET))
+			streamed = true;
+		else if (!gs->spilled && gs->rawlen) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "Unexpected getwork reply, decoding with jansson");
+			if (unlikely(all_data_cb(gs->raw, 1, gs->rawlen, &rt->all_data) != gs->rawlen))
+				goto err_out;
+		}
+	}
+
+	if (!streamed && !rt->all_data.buf) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
 
-	if (probing) {
+	if (rt->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path)
-			pool->hdr_path = hi.lp_path;
+		if (rt->hi.lp_path)
+			pool->hdr_path = rt->hi.lp_path;
 		else
 			pool->hdr_path = NULL;
 	}
 
-	*rolltime = hi.has_rolltime;
+	*rolltime = rt->hi.has_rolltime;
+
+	if (streamed) {
+		*fields = gs->seen;
+		goto out;
+	}
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(rt->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
 		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", all_data.buf);
+			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)rt->all_data.buf);
 
 		goto err_out;
 	}
@@ -438,13 +980,18 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		free(s);
 	}
 
+	/* The pool answered, so a reply that is not an array is left to the
+	 * caller to take as the pool not understanding batches */
+	if (batch)
+		goto out;
+
 	/* JSON-RPC valid response returns a non-null 'result',
 	 * and a null 'error'.
 	 */
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
-	if (!res_val || json_is_null(res_val) ||
+	if (!res_val || (json_is_null(res_val) && !null_ok) ||
 	    (err_val && !json_is_null(err_val))) {
 		char *s;
 
@@ -456,112 +1003,404 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		applog(LOG_INFO, "JSON-RPC call failed: %s", s);
 
 		free(s);
+		json_decref(val);
 
 		goto err_out;
 	}
 
+out:
+	if (rt->stats)
+		rpc_stats_add(rt->stats, curl, true);
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+	databuf_free(&rt->all_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 0);
+	free(rt);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+	if (rt->stats)
+		rpc_stats_add(rt->stats, curl, false);
+	databuf_free(&rt->all_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
+	free(rt);
 	return NULL;
 }
 
-char *bin2hex(const unsigned char *p, size_t len)
+json_t *json_rpc_finish(struct rpc_transfer *rt, CURLcode rc, bool *rolltime)
 {
-	int i;
-	char *s = malloc((len * 2) + 1);
-	if (!s)
-		return NULL;
-
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	return __json_rpc_finish(rt, rc, rolltime, false, false, NULL);
+}
 
-	return s;
+/* Returns whatever JSON the pool answered a batch with, an array or not */
+json_t *json_rpc_finish_batch(struct rpc_transfer *rt, CURLcode rc, bool *rolltime)
+{
+	return __json_rpc_finish(rt, rc, rolltime, true, false, NULL);
 }
 
-bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+/* submitblock answers a null result for an accepted block */
+json_t *json_rpc_finish_submitblock(struct rpc_transfer *rt, CURLcode rc, bool *rolltime)
 {
-	while (*hexstr && len) {
-		char hex_byte[3];
-		unsigned int v;
+	return __json_rpc_finish(rt, rc, rolltime, false, true, NULL);
+}
 
-		if (!hexstr[1]) {
-			applog(LOG_ERR, "hex2bin str truncated");
-			return false;
-		}
+/* Finish a transfer set up with json_rpc_stream_work. Returns NULL with
+ * 'fields' set if the work was decoded as it streamed in, otherwise returns
+ * the reply as json_rpc_finish would with 'fields' left 0. */
+json_t *json_rpc_finish_work(struct rpc_transfer *rt, CURLcode rc, bool *rolltime,
+			     unsigned int *fields)
+{
+	*fields = 0;
+	return __json_rpc_finish(rt, rc, rolltime, false, false, fields);
+}
 
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-		hex_byte[2] = 0;
+json_t *json_rpc_call(CURL *curl, const char *url, const char *rpc_req,
+		      bool probe, bool longpoll, bool *rolltime,
+		      struct pool *pool)
+{
+	struct rpc_transfer *rt;
+	int delay;
 
-		if (sscanf(hex_byte, "%x", &v) != 1) {
-			applog(LOG_ERR, "hex2bin sscanf '%s' failed", hex_byte);
-			return false;
-		}
+	rt = json_rpc_setup(curl, url, rpc_req, probe, longpoll, pool);
+	if (unlikely(!rt))
+		return NULL;
 
-		*p = (unsigned char) v;
+	/* Longpolls spend their time waiting on the pool, not loading it */
+	while (pool && !longpoll &&
+	       (delay = net_throttle(pool, probe ? NET_PROBE : NET_GETWORK))) {
+		struct timespec rgtp;
 
-		p++;
-		hexstr += 2;
-		len--;
+		rgtp.tv_sec = delay / 1000;
+		rgtp.tv_nsec = (delay % 1000) * 1000000;
+		nanosleep(&rgtp, NULL);
 	}
 
-	return (len == 0 && *hexstr == 0) ? true : false;
+	return json_rpc_finish(rt, curl_easy_perform(curl), rolltime);
 }
 
-/* Subtract the `struct timeval' values X and Y,
-   storing the result in RESULT.
-   Return 1 if the difference is negative, otherwise 0.  */
+static const char hexdigits[16] = "0123456789abcdef";
+
+/* Maps ASCII to nibble value, -1 for anything that is not a hex digit */
+static const signed char hexvals[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
 
-int
-timeval_subtract (
-     struct timeval *result, struct timeval *x, struct timeval *y)
+static void bin2hex_scalar(char *s, const unsigned char *p, size_t len)
 {
-  /* Perform the carry for the later subtraction by updating Y. */
-  if (x->tv_usec < y->tv_usec) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-    y->tv_usec -= 1000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_usec - y->tv_usec > 1000000) {
-    int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-    y->tv_usec += 1000000 * nsec;
-    y->tv_sec -= nsec;
-  }
+	while (len--) {
+		*s++ = hexdigits[*p >> 4];
+		*s++ = hexdigits[*p++ & 0xf];
+	}
+}
 
-  /* Compute the time remaining to wait.
-     `tv_usec' is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_usec = x->tv_usec - y->tv_usec;
+static bool hex2bin_scalar(unsigned char *p, const char *hexstr, size_t len)
+{
+	const unsigned char *h = (const unsigned char *)hexstr;
 
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
+	while (len--) {
+		int hi = hexvals[h[0]], lo = hexvals[h[1]];
+
+		if (unlikely((hi | lo) < 0))
+			return false;
+		*p++ = (hi << 4) | lo;
+		h += 2;
+	}
+	return true;
 }
 
-bool fulltest(const unsigned char *hash, const unsigned char *target)
+#if defined(__SSE2__) && !defined(__AVX2__)
+/* Turn nibbles 0-15 into '0'-'9', 'a'-'f' */
+static inline __m128i nibble_ascii_sse2(__m128i n)
 {
-	unsigned char hash_swap[32], target_swap[32];
-	uint32_t *hash32 = (uint32_t *) hash_swap;
-	uint32_t *target32 = (uint32_t *) target_swap;
-	int i;
-	bool rc = true;
-	char *hash_str, *target_str;
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)),
+				      _mm_set1_epi8('a' - '0' - 10));
 
-	swap256(hash_swap, hash);
-	swap256(target_swap, target);
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), alpha);
+}
 
-	for (i = 0; i < 32/4; i++) {
-		uint32_t h32tmp = swab32(hash32[i]);
+/* Encodes 16 bytes at a time into 32 hex characters */
+static size_t bin2hex_sse2(char *s, const unsigned char *p, size_t len)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + done));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+		__m128i lo = _mm_and_si128(b, mask);
+
+		_mm_storeu_si128((__m128i *)(s + done * 2),
+				 nibble_ascii_sse2(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(s + done * 2 + 16),
+				 nibble_ascii_sse2(_mm_unpackhi_epi8(hi, lo)));
+	}
+	return done;
+}
+
+/* Turns 16 hex characters into nibble values in each byte. Returns a
+ * movemask that is 0xffff only if every character was a hex digit */
+static inline int ascii_nibble_sse2(__m128i c, __m128i *n)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				      _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+	*n = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			  _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+	return _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+}
+
+/* Decodes 32 hex characters at a time into 16 bytes, stopping early at
+ * the first block holding something other than hex digits */
+static size_t hex2bin_sse2(unsigned char *p, const char *hexstr, size_t len)
+{
+	const __m128i lomask = _mm_set1_epi16(0x00ff);
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m128i n0, n1, w0, w1;
+
+		if (ascii_nibble_sse2(_mm_loadu_si128((const __m128i *)(hexstr + done * 2)), &n0) != 0xffff ||
+		    ascii_nibble_sse2(_mm_loadu_si128((const __m128i *)(hexstr + done * 2 + 16)), &n1) != 0xffff)
+			break;
+		/* Each 16 bit lane holds high nibble in its low byte */
+		w0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n0, lomask), 4),
+				  _mm_srli_epi16(n0, 8));
+		w1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n1, lomask), 4),
+				  _mm_srli_epi16(n1, 8));
+		_mm_storeu_si128((__m128i *)(p + done), _mm_packus_epi16(w0, w1));
+	}
+	return done;
+}
+#endif /* __SSE2__ && !__AVX2__ */
+
+#ifdef __AVX2__
+static inline __m256i nibble_ascii_avx2(__m256i n)
+{
+	__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)),
+					 _mm256_set1_epi8('a' - '0' - 10));
+
+	return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), alpha);
+}
+
+/* Encodes 16 bytes at a time, widening each byte to a 16 bit lane so the
+ * two nibbles land in order without crossing the 128 bit lanes */
+static size_t bin2hex_avx2(char *s, const unsigned char *p, size_t len)
+{
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m256i w = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + done)));
+		__m256i n = _mm256_or_si256(_mm256_srli_epi16(w, 4),
+					    _mm256_slli_epi16(_mm256_and_si256(w, _mm256_set1_epi16(0x0f)), 8));
+
+		_mm256_storeu_si256((__m256i *)(s + done * 2), nibble_ascii_avx2(n));
+	}
+	return done;
+}
+
+static size_t hex2bin_avx2(unsigned char *p, const char *hexstr, size_t len)
+{
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(hexstr + done * 2));
+		__m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+		__m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('9')),
+						    _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)));
+		__m256i alpha = _mm256_andnot_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('f')),
+						    _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)));
+		__m256i n, w;
+
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != 0xffffffffU)
+			break;
+		n = _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+				    _mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+		w = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)), 4),
+				    _mm256_srli_epi16(n, 8));
+		/* packus works within 128 bit lanes, gather quadwords 0 and 2 */
+		w = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), 0x08);
+		_mm_storeu_si128((__m128i *)(p + done), _mm256_castsi256_si128(w));
+	}
+	return done;
+}
+#endif /* __AVX2__ */
+
+/* Writes len * 2 hex characters plus a terminating NUL into s, which the
+ * caller must size accordingly */
+void __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	size_t done = 0;
+
+#if defined(__AVX2__)
+	done = bin2hex_avx2(s, p, len);
+#elif defined(__SSE2__)
+	done = bin2hex_sse2(s, p, len);
+#endif
+	bin2hex_scalar(s + done * 2, p + done, len - done);
+	s[len * 2] = '\0';
+}
+
+char *bin2hex(const unsigned char *p, size_t len)
+{
+	char *s = malloc((len * 2) + 1);
+	if (!s)
+		return NULL;
+
+	__bin2hex(s, p, len);
+
+	return s;
+}
+
+/* Decodes len bytes from hexstr. Succeeds only if hexstr is exactly len * 2
+ * hex digits long, but a longer string still has its leading len bytes
+ * decoded into p */
+bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+{
+	size_t slen = strnlen(hexstr, len * 2 + 1), n = slen / 2, done = 0;
+
+	if (n > len)
+		n = len;
+
+#if defined(__AVX2__)
+	done = hex2bin_avx2(p, hexstr, n);
+#elif defined(__SSE2__)
+	done = hex2bin_sse2(p, hexstr, n);
+#endif
+	if (unlikely(!hex2bin_scalar(p + done, hexstr + done * 2, n - done))) {
+		applog(LOG_ERR, "hex2bin invalid hex in '%s'", hexstr);
+		return false;
+	}
+
+	if (unlikely(slen < len * 2)) {
+		applog(LOG_ERR, "hex2bin str truncated");
+		return false;
+	}
+
+	return slen == len * 2;
+}
+
+/* Times the hex codecs on a getwork sized buffer, comparing the
+ * vectorised path (if built) against the byte at a time scalar path */
+void bench_hex(void)
+{
+	unsigned char bin[128], out[128];
+	char hex[sizeof(bin) * 2 + 1];
+	const int rounds = 1000000;
+	struct timeval tv_start, tv_end, diff;
+	double secs;
+	int i, pass;
+
+	for (i = 0; i < (int)sizeof(bin); i++)
+		bin[i] = i * 37 + 11;
+
+	for (pass = 0; pass < 2; pass++) {
+		const char *name = pass ? "scalar" :
+#if defined(__AVX2__)
+			"avx2";
+#elif defined(__SSE2__)
+			"sse2";
+#else
+			"scalar";
+#endif
+
+		gettimeofday(&tv_start, NULL);
+		for (i = 0; i < rounds; i++) {
+			if (pass) {
+				bin2hex_scalar(hex, bin, sizeof(bin));
+				hex[sizeof(bin) * 2] = '\0';
+			} else
+				__bin2hex(hex, bin, sizeof(bin));
+			bin[i & 127] ^= hex[i & 255];
+		}
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+		printf("bin2hex %-6s %8.1f MB/s\n", name, rounds * sizeof(bin) / secs / 1000000);
+
+		gettimeofday(&tv_start, NULL);
+		for (i = 0; i < rounds; i++) {
+			if (pass) {
+				if (!hex2bin_scalar(out, hex, sizeof(out)))
+					break;
+			} else if (!hex2bin(out, hex, sizeof(out)))
+				break;
+			hex[i & 255] = hexdigits[out[i & 127] & 0xf];
+		}
+		gettimeofday(&tv_end, NULL);
+		timeval_subtract(&diff, &tv_end, &tv_start);
+		secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+		printf("hex2bin %-6s %8.1f MB/s\n", name, rounds * sizeof(out) / secs / 1000000);
+	}
+
+	__bin2hex(hex, bin, sizeof(bin));
+	if (!hex2bin(out, hex, sizeof(out)) || memcmp(out, bin, sizeof(bin)))
+		printf("hex codec round trip FAILED\n");
+}
+
+/* Subtract the `struct timeval' values X and Y,
+   storing the result in RESULT.
+   Return 1 if the difference is negative, otherwise 0.  */
+
+int
+timeval_subtract (
+     struct timeval *result, struct timeval *x, struct timeval *y)
+{
+  /* Perform the carry for the later subtraction by updating Y. */
+  if (x->tv_usec < y->tv_usec) {
+    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
+    y->tv_usec -= 1000000 * nsec;
+    y->tv_sec += nsec;
+  }
+  if (x->tv_usec - y->tv_usec > 1000000) {
+    int nsec = (x->tv_usec - y->tv_usec) / 1000000;
+    y->tv_usec += 1000000 * nsec;
+    y->tv_sec -= nsec;
+  }
+
+  /* Compute the time remaining to wait.
+     `tv_usec' is certainly positive. */
+  result->tv_sec = x->tv_sec - y->tv_sec;
+  result->tv_usec = x->tv_usec - y->tv_usec;
+
+  /* Return 1 if result is negative. */
+  return x->tv_sec < y->tv_sec;
+}
+
+bool fulltest(const unsigned char *hash, const unsigned char *target)
+{
+	unsigned char hash_swap[32], target_swap[32];
+	uint32_t *hash32 = (uint32_t *) hash_swap;
+	uint32_t *target32 = (uint32_t *) target_swap;
+	int i;
+	bool rc = true;
+	char hash_str[65], target_str[65];
+
+	swap256(hash_swap, hash);
+	swap256(target_swap, target);
+
+	for (i = 0; i < 32/4; i++) {
+		uint32_t h32tmp = swab32(hash32[i]);
 		uint32_t t32tmp = target32[i];
 
 		target32[i] = swab32(target32[i]);	/* for printing */
@@ -577,8 +1416,8 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 	}
 
 	if (opt_debug) {
-		hash_str = bin2hex(hash_swap, 32);
-		target_str = bin2hex(target_swap, 32);
+		__bin2hex(hash_str, hash_swap, 32);
+		__bin2hex(target_str, target_swap, 32);
 
 		applog(LOG_DEBUG, " Proof: %s\nTarget: %s\nTrgVal? %s",
 			hash_str,
@@ -586,21 +1425,158 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 			rc ? "YES (hash < target)" :
 			     "no (false positive; hash > target)");
 
-		free(hash_str);
-		free(target_str);
 	}
 
 	return rc;
 }
 
+/* Objects allocated and freed at a high rate, such as struct work, come
+ * from slabs of SLAB_OBJS carved out of one malloc and are never given back
+ * to the system. Each thread keeps up to SLAB_MAG freed objects to hand in
+ * a magazine of its own, only taking the cache's lock to swap half of it
+ * with the shared free list, so allocating and freeing in the steady state
+ * takes neither malloc nor a lock. A thread's magazine goes back on the
+ * shared list when it exits */
+#define SLAB_OBJS 64
+#define SLAB_MAG 32
+
+struct slab_mag {
+	struct slab_cache	*sc;
+	int			count;
+	void			*obj[SLAB_MAG];
+};
+
+static void slab_mag_drain(struct slab_mag *mag, int keep)
+{
+	struct slab_cache *sc = mag->sc;
+
+	mutex_lock(&sc->lock);
+	while (mag->count > keep) {
+		void *obj = mag->obj[--mag->count];
+
+		*(void **)obj = sc->free_list;
+		sc->free_list = obj;
+	}
+	mutex_unlock(&sc->lock);
+}
+
+static void slab_mag_exit(void *arg)
+{
+	struct slab_mag *mag = arg;
+
+	slab_mag_drain(mag, 0);
+	free(mag);
+}
+
+static struct slab_mag *slab_mag(struct slab_cache *sc)
+{
+	struct slab_mag *mag = pthread_getspecific(sc->key);
+
+	if (unlikely(!mag)) {
+		mag = calloc(1, sizeof(*mag));
+		if (unlikely(!mag))
+			quit(1, "Failed to calloc slab_mag for %s", sc->name);
+		mag->sc = sc;
+		pthread_setspecific(sc->key, mag);
+	}
+	return mag;
+}
+
+static void slab_mag_fill(struct slab_mag *mag)
+{
+	struct slab_cache *sc = mag->sc;
+	char *slab;
+	int i;
+
+	mutex_lock(&sc->lock);
+	if (!sc->free_list) {
+		slab = malloc(sc->size * SLAB_OBJS);
+		if (unlikely(!slab))
+			quit(1, "Failed to malloc slab for %s", sc->name);
+		for (i = SLAB_OBJS - 1; i >= 0; i--) {
+			*(void **)(slab + i * sc->size) = sc->free_list;
+			sc->free_list = slab + i * sc->size;
+		}
+		sc->slabs++;
+	}
+	while (sc->free_list && mag->count < SLAB_MAG / 2) {
+		mag->obj[mag->count++] = sc->free_list;
+		sc->free_list = *(void **)sc->free_list;
+	}
+	mutex_unlock(&sc->lock);
+}
+
+void slab_init(struct slab_cache *sc, const char *name, size_t size)
+{
+	sc->name = name;
+	/* Round up to a cache line so objects on different threads never
+	 * share one */
+	sc->size = (size + 63) & ~(size_t)63;
+	sc->free_list = NULL;
+	sc->slabs = 0;
+	sc->allocs = sc->frees = 0;
+	mutex_init(&sc->lock);
+	if (unlikely(pthread_key_create(&sc->key, slab_mag_exit)))
+		quit(1, "Failed to create slab key for %s", name);
+}
+
+/* Returns a zeroed object, never NULL */
+void *slab_alloc(struct slab_cache *sc)
+{
+	struct slab_mag *mag = slab_mag(sc);
+	void *obj;
+
+	if (unlikely(!mag->count))
+		slab_mag_fill(mag);
+	obj = mag->obj[--mag->count];
+	__atomic_add_fetch(&sc->allocs, 1, __ATOMIC_RELAXED);
+	memset(obj, 0, sc->size);
+	return obj;
+}
+
+void slab_free(struct slab_cache *sc, void *obj)
+{
+	struct slab_mag *mag;
+
+	if (unlikely(!obj))
+		return;
+	mag = slab_mag(sc);
+	if (unlikely(mag->count == SLAB_MAG))
+		slab_mag_drain(mag, SLAB_MAG / 2);
+	mag->obj[mag->count++] = obj;
+	__atomic_add_fetch(&sc->frees, 1, __ATOMIC_RELAXED);
+}
+
+/* Thread queues hand messages over through a bounded lock-free ring
+ * (Dmitry Vyukov's MPMC design), so neither pushing nor popping takes a
+ * lock. Should a consumer fall more than TQ_RING messages behind, further
+ * messages go on the locked overflow list until it has drained, which
+ * keeps the queue unbounded and in order. Consumers sleep on an event
+ * count; a futex on linux, the queue's own condition variable elsewhere */
+#define TQ_RING 1024
+
+struct tq_cell {
+	unsigned long	seq;
+	void		*data;
+};
+
 struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
+	unsigned long i;
 
 	tq = calloc(1, sizeof(*tq));
 	if (!tq)
 		return NULL;
 
+	tq->ring = calloc(TQ_RING, sizeof(*tq->ring));
+	if (!tq->ring) {
+		free(tq);
+		return NULL;
+	}
+	for (i = 0; i < TQ_RING; i++)
+		tq->ring[i].seq = i;
+
 	INIT_LIST_HEAD(&tq->q);
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
@@ -622,19 +1598,123 @@ void tq_free(struct thread_q *tq)
 
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
+	free(tq->ring);
 
 	memset(tq, 0, sizeof(*tq));	/* poison */
 	free(tq);
 }
 
+static bool tq_ring_push(struct thread_q *tq, void *data)
+{
+	unsigned long pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
+	long dif;
+
+	while (42) {
+		cell = &tq->ring[pos & (TQ_RING - 1)];
+		dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->tail, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;	/* full */
+		else
+			pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+	}
+
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void *tq_ring_pop(struct thread_q *tq)
+{
+	unsigned long pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
+	void *data;
+	long dif;
+
+	while (42) {
+		cell = &tq->ring[pos & (TQ_RING - 1)];
+		dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;	/* empty */
+		else
+			pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	}
+
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + TQ_RING, __ATOMIC_RELEASE);
+	return data;
+}
+
+/* The event count moves on by two with every push, freeze or thaw; its low
+ * bit says a consumer may be asleep on it. Whoever moves it on clears that
+ * bit and wakes the sleepers, so a burst of pushes costs one wakeup, and a
+ * consumer that set the bit can never sleep through it being cleared since
+ * the futex word has changed under it */
+static void tq_wake(struct thread_q *tq)
+{
+	unsigned int event = __atomic_load_n(&tq->event, __ATOMIC_SEQ_CST);
+
+	while (!__atomic_compare_exchange_n(&tq->event, &event, (event + 2) & ~1U, true,
+					    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+	if (!(event & 1))
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, &tq->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	mutex_lock(&tq->mutex);
+	pthread_cond_broadcast(&tq->cond);
+	mutex_unlock(&tq->mutex);
+#endif
+}
+
+/* Sleep while the event count still reads 'event'. Returns false once
+ * abstime has passed */
+static bool tq_wait(struct thread_q *tq, unsigned int event, const struct timespec *abstime)
+{
+#ifdef __linux__
+	if (syscall(SYS_futex, &tq->event, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+		    event, abstime, NULL, FUTEX_BITSET_MATCH_ANY) && errno == ETIMEDOUT)
+		return false;
+	return true;
+#else
+	int rc = 0;
+
+	mutex_lock(&tq->mutex);
+	while (!rc && __atomic_load_n(&tq->event, __ATOMIC_SEQ_CST) == event) {
+		if (abstime)
+			rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+		else
+			rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+	}
+	mutex_unlock(&tq->mutex);
+	return !rc;
+#endif
+}
+
 static void tq_freezethaw(struct thread_q *tq, bool frozen)
 {
 	mutex_lock(&tq->mutex);
 
-	tq->frozen = frozen;
+	__atomic_store_n(&tq->frozen, frozen, __ATOMIC_SEQ_CST);
 
 	pthread_cond_signal(&tq->cond);
 	mutex_unlock(&tq->mutex);
+
+	/* A push that read frozen before it was set lands before this
+	 * returns, so nothing is queued once the queue is frozen */
+	while (frozen && __atomic_load_n(&tq->pushers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	tq_wake(tq);
 }
 
 void tq_freeze(struct thread_q *tq)
@@ -650,60 +1730,206 @@ void tq_thaw(struct thread_q *tq)
 bool tq_push(struct thread_q *tq, void *data)
 {
 	struct tq_ent *ent;
-	bool rc = true;
+	bool ret = false;
+
+	/* Counted before looking at frozen so tq_freeze can wait for us */
+	__atomic_add_fetch(&tq->pushers, 1, __ATOMIC_SEQ_CST);
+	if (unlikely(__atomic_load_n(&tq->frozen, __ATOMIC_SEQ_CST)))
+		goto out;
+
+	if (likely(!__atomic_load_n(&tq->overflow, __ATOMIC_ACQUIRE)) &&
+	    tq_ring_push(tq, data)) {
+		ret = true;
+		goto out;
+	}
 
 	ent = calloc(1, sizeof(*ent));
 	if (!ent)
-		return false;
+		goto out;
 
 	ent->data = data;
 	INIT_LIST_HEAD(&ent->q_node);
 
 	mutex_lock(&tq->mutex);
+	list_add_tail(&ent->q_node, &tq->q);
+	__atomic_add_fetch(&tq->overflow, 1, __ATOMIC_RELEASE);
+	mutex_unlock(&tq->mutex);
+	ret = true;
 
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
+out:
+	__atomic_sub_fetch(&tq->pushers, 1, __ATOMIC_SEQ_CST);
+	if (ret)
+		tq_wake(tq);
+	return ret;
+}
+
+static void *tq_take(struct thread_q *tq)
+{
+	struct tq_ent *ent;
+	void *rval;
+
+	rval = tq_ring_pop(tq);
+	if (rval || !__atomic_load_n(&tq->overflow, __ATOMIC_ACQUIRE))
+		return rval;
+
+	mutex_lock(&tq->mutex);
+	if (!list_empty(&tq->q)) {
+		ent = list_entry(tq->q.next, struct tq_ent, q_node);
+		rval = ent->data;
+
+		list_del(&ent->q_node);
 		free(ent);
-		rc = false;
+		__atomic_sub_fetch(&tq->overflow, 1, __ATOMIC_RELEASE);
 	}
-
-	pthread_cond_signal(&tq->cond);
 	mutex_unlock(&tq->mutex);
 
-	return rc;
+	return rval;
 }
 
+/* Pop the oldest message, sleeping for one if the queue is empty. Returns
+ * NULL once abstime passes, or when woken to find the queue frozen */
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
+{
+	bool waited = false;
+	unsigned int event;
+	void *rval;
+
+	while (42) {
+		rval = tq_take(tq);
+		if (rval)
+			return rval;
+		if (waited && __atomic_load_n(&tq->frozen, __ATOMIC_SEQ_CST))
+			return NULL;
+
+		/* Announce ourselves, then look once more before sleeping */
+		event = __atomic_load_n(&tq->event, __ATOMIC_SEQ_CST);
+		if (!(event & 1) &&
+		    !__atomic_compare_exchange_n(&tq->event, &event, event | 1, false,
+						 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+		event |= 1;
+		rval = tq_take(tq);
+		if (rval)
+			return rval;
+
+		if (!tq_wait(tq, event, abstime))
+			return tq_take(tq);
+		waited = true;
+	}
+}
+
+/* The mutex and condition variable queue that thread_q used to be, kept
+ * as the baseline for bench_tq */
+struct bench_lq {
+	struct list_head	q;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+};
+
+static void bench_lq_push(struct bench_lq *lq, void *data)
+{
+	struct tq_ent *ent = calloc(1, sizeof(*ent));
+
+	if (unlikely(!ent))
+		quit(1, "Failed to calloc ent in bench_lq_push");
+	ent->data = data;
+
+	mutex_lock(&lq->mutex);
+	list_add_tail(&ent->q_node, &lq->q);
+	pthread_cond_signal(&lq->cond);
+	mutex_unlock(&lq->mutex);
+}
+
+static void *bench_lq_pop(struct bench_lq *lq)
 {
 	struct tq_ent *ent;
 	void *rval = NULL;
-	int rc;
 
-	mutex_lock(&tq->mutex);
+	mutex_lock(&lq->mutex);
+	if (list_empty(&lq->q))
+		pthread_cond_wait(&lq->cond, &lq->mutex);
+	if (!list_empty(&lq->q)) {
+		ent = list_entry(lq->q.next, struct tq_ent, q_node);
+		rval = ent->data;
+		list_del(&ent->q_node);
+		free(ent);
+	}
+	mutex_unlock(&lq->mutex);
 
-	if (!list_empty(&tq->q))
-		goto pop;
+	return rval;
+}
 
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
+struct bench_tq_arg {
+	struct thread_q		*tq;
+	struct bench_lq		*lq;
+	int			count;
+};
 
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
+static void *bench_tq_producer(void *userdata)
+{
+	struct bench_tq_arg *arg = userdata;
+	int i;
 
-	list_del(&ent->q_node);
-	free(ent);
+	for (i = 1; i <= arg->count; i++) {
+		if (arg->tq)
+			tq_push(arg->tq, (void *)(intptr_t)i);
+		else
+			bench_lq_push(arg->lq, (void *)(intptr_t)i);
+	}
+	return NULL;
+}
 
-out:
-	mutex_unlock(&tq->mutex);
-	return rval;
+/* Pushes a million messages from 1 to 64 producer threads into a single
+ * consumer, comparing the lock-free ring against the locked list */
+void bench_tq(void)
+{
+	static const int producers[] = { 1, 2, 4, 8, 16, 32, 64 };
+	const int msgs = 1 << 20;
+	struct timeval tv_start, tv_end, diff;
+	struct bench_tq_arg arg;
+	struct bench_lq lq;
+	pthread_t pth[64];
+	double rate[2];
+	int i, n, pass, got, total;
+
+	for (n = 0; n < (int)(sizeof(producers) / sizeof(producers[0])); n++) {
+		for (pass = 0; pass < 2; pass++) {
+			arg.tq = NULL;
+			arg.lq = &lq;
+			if (pass) {
+				INIT_LIST_HEAD(&lq.q);
+				pthread_mutex_init(&lq.mutex, NULL);
+				pthread_cond_init(&lq.cond, NULL);
+			} else if (unlikely(!(arg.tq = tq_new())))
+				quit(1, "Failed to tq_new in bench_tq");
+			arg.count = msgs / producers[n];
+			total = arg.count * producers[n];
+
+			gettimeofday(&tv_start, NULL);
+			for (i = 0; i < producers[n]; i++) {
+				if (unlikely(pthread_create(&pth[i], NULL, bench_tq_producer, &arg)))
+					quit(1, "Failed to create bench_tq producer");
+			}
+			for (got = 0; got < total; ) {
+				if (pass ? bench_lq_pop(&lq) : tq_pop(arg.tq, NULL))
+					got++;
+			}
+			for (i = 0; i < producers[n]; i++)
+				pthread_join(pth[i], NULL);
+			gettimeofday(&tv_end, NULL);
+
+			timeval_subtract(&diff, &tv_end, &tv_start);
+			rate[pass] = total / (diff.tv_sec + diff.tv_usec / 1000000.0) / 1000000;
+
+			if (pass) {
+				pthread_cond_destroy(&lq.cond);
+				pthread_mutex_destroy(&lq.mutex);
+			} else
+				tq_free(arg.tq);
+		}
+		printf("thread_q %2d producers: ring %6.2f Mmsg/s, mutex %6.2f Mmsg/s\n",
+		       producers[n], rate[0], rate[1]);
+	}
 }
 
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
@@ -778,3 +2004,1043 @@ err_out:
 	curl_easy_cleanup(curl);
 	return false;
 }
+
+#define RECVSIZE 8192
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Send a line to a stratum pool, serialised against other senders */
+bool stratum_send(struct pool *pool, char *s, size_t len)
+{
+	size_t sent = 0;
+	bool ret = true;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "SEND: %s", s);
+
+	mutex_lock(&pool->send_lock);
+	while (sent < len) {
+		ssize_t n = send(pool->sock, s + sent, len - sent, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = false;
+			break;
+		}
+		sent += n;
+	}
+	mutex_unlock(&pool->send_lock);
+
+	if (!ret)
+		applog(LOG_DEBUG, "Failed to send in stratum_send");
+	return ret;
+}
+
+/* Send a message built with json_pack as one line, taking the reference to
+ * it so calls can be nested */
+bool stratum_send_json(struct pool *pool, json_t *val)
+{
+	char *s, *line;
+	bool ret;
+
+	if (unlikely(!val))
+		quit(1, "Failed to json_pack stratum message");
+	s = json_dumps(val, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	if (unlikely(!s))
+		quit(1, "Failed to json_dumps stratum message");
+	line = realloc(s, strlen(s) + 2);
+	if (unlikely(!line))
+		quit(1, "Failed to realloc in stratum_send_json");
+	strcat(line, "\n");
+	ret = stratum_send(pool, line, strlen(line));
+	free(line);
+	return ret;
+}
+
+/* Is there a whole line buffered, or data arriving on the socket within
+ * 'wait' seconds */
+bool sock_full(struct pool *pool, int wait)
+{
+	struct timeval timeout;
+	fd_set rd;
+
+	if (pool->sockbuf && strchr(pool->sockbuf, '\n'))
+		return true;
+
+	FD_ZERO(&rd);
+	FD_SET(pool->sock, &rd);
+	timeout.tv_usec = 0;
+	timeout.tv_sec = wait;
+	return select(pool->sock + 1, &rd, NULL, NULL, &timeout) > 0;
+}
+
+/* Return the next newline terminated message from the pool, which the
+ * caller must free, or NULL if the connection failed or went quiet */
+static char *recv_line(struct pool *pool)
+{
+	char *tok, *sret = NULL;
+	size_t buflen;
+
+	while (!strchr(pool->sockbuf, '\n')) {
+		char s[RECVSIZE];
+		ssize_t n;
+
+		if (!sock_full(pool, 60)) {
+			applog(LOG_DEBUG, "Timed out waiting for data on socket");
+			goto out;
+		}
+		n = recv(pool->sock, s, RECVSIZE - 1, 0);
+		if (n <= 0) {
+			applog(LOG_DEBUG, "Failed to recv in recv_line");
+			goto out;
+		}
+		s[n] = '\0';
+
+		buflen = strlen(pool->sockbuf);
+		if (buflen + n + 1 > pool->sockbuf_size) {
+			char *newbuf = realloc(pool->sockbuf, buflen + n + 1);
+
+			if (unlikely(!newbuf))
+				quit(1, "Failed to realloc sockbuf in recv_line");
+			pool->sockbuf = newbuf;
+			pool->sockbuf_size = buflen + n + 1;
+		}
+		strcpy(pool->sockbuf + buflen, s);
+	}
+
+	tok = strchr(pool->sockbuf, '\n');
+	*tok++ = '\0';
+	sret = strdup(pool->sockbuf);
+	memmove(pool->sockbuf, tok, strlen(tok) + 1);
+
+	if (opt_protocol && sret)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+out:
+	return sret;
+}
+
+static char *json_array_string(json_t *val, unsigned int entry)
+{
+	json_t *arr_entry;
+
+	if (json_is_null(val) || !json_is_array(val))
+		return NULL;
+	if (entry >= json_array_size(val))
+		return NULL;
+	arr_entry = json_array_get(val, entry);
+	if (!json_is_string(arr_entry))
+		return NULL;
+	return strdup(json_string_value(arr_entry));
+}
+
+static void clear_swork(struct stratum_work *sw)
+{
+	free(sw->job_id);
+	free(sw->prev_hash);
+	free(sw->bbversion);
+	free(sw->nbit);
+	free(sw->ntime);
+	free(sw->coinbase);
+	free(sw->merkle);
+	free(sw->txns);
+	free(sw->workid);
+	sw->job_id = sw->prev_hash = sw->bbversion = sw->nbit = sw->ntime = NULL;
+	sw->coinbase = NULL;
+	sw->merkle = NULL;
+	sw->merkles = 0;
+	sw->txns = sw->workid = NULL;
+	sw->txn_count = 0;
+	sw->witness = false;
+}
+
+/* mining.notify: job_id, prevhash, coinb1, coinb2, [merkle branch],
+ * version, nbits, ntime, clean_jobs */
+static bool parse_notify(struct pool *pool, json_t *val)
+{
+	char *job_id = NULL, *prev_hash = NULL, *coinbase1 = NULL, *coinbase2 = NULL;
+	char *bbversion = NULL, *nbit = NULL, *ntime = NULL;
+	size_t cb1_len, cb2_len, n1_len, cb_len;
+	unsigned char (*merkle)[32] = NULL;
+	unsigned char *coinbase = NULL;
+	json_t *arr;
+	bool clean, ret = false;
+	int merkles, i;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		goto out;
+	merkles = json_array_size(arr);
+
+	job_id = json_array_string(val, 0);
+	prev_hash = json_array_string(val, 1);
+	coinbase1 = json_array_string(val, 2);
+	coinbase2 = json_array_string(val, 3);
+	bbversion = json_array_string(val, 5);
+	nbit = json_array_string(val, 6);
+	ntime = json_array_string(val, 7);
+	clean = json_is_true(json_array_get(val, 8));
+
+	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion ||
+	    !nbit || !ntime || strlen(prev_hash) != 64 || strlen(bbversion) != 8 ||
+	    strlen(nbit) != 8 || strlen(ntime) != 8)
+		goto out;
+
+	/* Assemble the binary coinbase once here so generating work only has
+	 * to drop extranonce2 into it */
+	cb1_len = strlen(coinbase1) / 2;
+	cb2_len = strlen(coinbase2) / 2;
+	n1_len = strlen(pool->nonce1) / 2;
+	cb_len = cb1_len + n1_len + pool->n2size + cb2_len;
+	coinbase = calloc(cb_len, 1);
+	if (unlikely(!coinbase))
+		quit(1, "Failed to calloc coinbase in parse_notify");
+	if (!hex2bin(coinbase, coinbase1, cb1_len) ||
+	    !hex2bin(coinbase + cb1_len, pool->nonce1, n1_len) ||
+	    !hex2bin(coinbase + cb1_len + n1_len + pool->n2size, coinbase2, cb2_len))
+		goto out;
+
+	if (merkles) {
+		merkle = malloc(merkles * 32);
+		if (unlikely(!merkle))
+			quit(1, "Failed to malloc merkle in parse_notify");
+		for (i = 0; i < merkles; i++) {
+			json_t *m = json_array_get(arr, i);
+
+			if (!json_is_string(m) || !hex2bin(merkle[i], json_string_value(m), 32))
+				goto out;
+		}
+	}
+
+	mutex_lock(&pool->stratum_lock);
+	/* A new previous block hash means the old jobs are useless too */
+	if (!pool->swork.prev_hash || strcmp(prev_hash, pool->swork.prev_hash))
+		clean = true;
+	clear_swork(&pool->swork);
+	pool->swork.job_id = job_id;
+	pool->swork.prev_hash = prev_hash;
+	pool->swork.bbversion = bbversion;
+	pool->swork.nbit = nbit;
+	pool->swork.ntime = ntime;
+	pool->swork.clean |= clean;
+	pool->swork.coinbase = coinbase;
+	pool->swork.cb_len = cb_len;
+	pool->swork.nonce2_offset = cb1_len + n1_len;
+	pool->swork.merkle = merkle;
+	pool->swork.merkles = merkles;
+	pool->stratum_notify = true;
+	pool->stratum_jobs++;
+	mutex_unlock(&pool->stratum_lock);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Pool %d stratum job %s with %d merkle branches%s",
+		       pool->pool_no, job_id, merkles, clean ? ", clean" : "");
+	ret = true;
+	job_id = prev_hash = bbversion = nbit = ntime = NULL;
+	coinbase = NULL;
+	merkle = NULL;
+out:
+	if (!ret)
+		applog(LOG_INFO, "Pool %d sent an invalid mining.notify", pool->pool_no);
+	free(job_id);
+	free(prev_hash);
+	free(coinbase1);
+	free(coinbase2);
+	free(bbversion);
+	free(nbit);
+	free(ntime);
+	free(coinbase);
+	free(merkle);
+	return ret;
+}
+
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	double diff;
+
+	diff = json_number_value(json_array_get(val, 0));
+	if (diff <= 0)
+		return false;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->swork.diff = diff;
+	mutex_unlock(&pool->stratum_lock);
+
+	applog(LOG_INFO, "Pool %d stratum difficulty set to %g", pool->pool_no, diff);
+	return true;
+}
+
+static bool send_version(struct pool *pool, json_t *val)
+{
+	json_t *id = json_object_get(val, "id");
+
+	if (!id || json_is_null(id))
+		return false;
+
+	return stratum_send_json(pool, json_pack("{s:O,s:s,s:n}", "id", id,
+						 "result", PACKAGE_STRING, "error"));
+}
+
+/* Handle a message the pool sent on its own accord. Returns false if it is
+ * not a method call, i.e. the reply to one of ours */
+static bool parse_method(struct pool *pool, json_t *val)
+{
+	json_t *method, *params;
+	const char *buf;
+
+	method = json_object_get(val, "method");
+	if (!method || !json_is_string(method))
+		return false;
+	buf = json_string_value(method);
+	params = json_object_get(val, "params");
+
+	if (!strcasecmp(buf, "mining.notify"))
+		parse_notify(pool, params);
+	else if (!strcasecmp(buf, "mining.set_difficulty"))
+		parse_diff(pool, params);
+	else if (!strcasecmp(buf, "client.get_version"))
+		send_version(pool, val);
+	else
+		applog(LOG_INFO, "Pool %d sent unhandled stratum method %s", pool->pool_no, buf);
+	return true;
+}
+
+/* Read one message from the pool. Method calls are handled here and leave
+ * 'reply' NULL, anything else is returned in 'reply' for the caller to
+ * decref. Returns false if the connection failed. */
+bool recv_stratum(struct pool *pool, json_t **reply)
+{
+	json_error_t err;
+	json_t *val;
+	char *s;
+
+	*reply = NULL;
+	s = recv_line(pool);
+	if (!s)
+		return false;
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
+		free(s);
+		return true;
+	}
+	free(s);
+	if (parse_method(pool, val))
+		json_decref(val);
+	else
+		*reply = val;
+	return true;
+}
+
+/* Read messages until the reply with 'id' arrives. Returns the reply which
+ * the caller must decref, or NULL on failure. Replies without an integer id
+ * cannot be matched to a request and are dropped. */
+static json_t *stratum_reply(struct pool *pool, int id)
+{
+	json_t *val, *id_val;
+
+	while (42) {
+		if (!recv_stratum(pool, &val))
+			return NULL;
+		if (!val)
+			continue;
+		id_val = json_object_get(val, "id");
+		if (json_is_integer(id_val) && json_integer_value(id_val) == id)
+			return val;
+		if (!json_is_integer(id_val))
+			applog(LOG_INFO, "Pool %d sent a stratum reply without an id", pool->pool_no);
+		json_decref(val);
+	}
+}
+
+bool auth_stratum(struct pool *pool)
+{
+	json_t *val, *res_val, *err_val;
+	const char *pass = pool->rpc_pass;
+	int id = ++pool->stratum_id;
+	bool ret = false;
+
+	if (!pass) {
+		pass = strchr(pool->rpc_userpass, ':');
+		pass = pass ? pass + 1 : "";
+	}
+	if (!stratum_send_json(pool, json_pack("{s:i,s:s,s:[s,s]}", "id", id,
+					       "method", "mining.authorize",
+					       "params", pool->rpc_user, pass)))
+		return ret;
+
+	val = stratum_reply(pool, id);
+	if (!val)
+		return ret;
+	res_val = json_object_get(val, "result");
+	err_val = json_object_get(val, "error");
+	if (!json_is_true(res_val) || (err_val && !json_is_null(err_val))) {
+		char *ss;
+
+		if (err_val)
+			ss = json_dumps(err_val, JSON_INDENT(3));
+		else
+			ss = strdup("(unknown reason)");
+		applog(LOG_WARNING, "Pool %d stratum authorisation failed: %s", pool->pool_no, ss);
+		free(ss);
+		goto out;
+	}
+	ret = true;
+	pool->stratum_auth = true;
+	applog(LOG_INFO, "Stratum authorisation success for pool %d", pool->pool_no);
+out:
+	json_decref(val);
+	return ret;
+}
+
+/* Connect to a stratum pool and subscribe. The connection is made through
+ * curl so the proxy settings apply, then the socket is driven directly. */
+bool initiate_stratum(struct pool *pool)
+{
+	json_t *val = NULL, *res_val, *err_val;
+	char *nonce1;
+	CURL *curl;
+	bool ret = false;
+	int n2size;
+
+	suspend_stratum(pool);
+
+	curl = curl_easy_init();
+	if (unlikely(!curl))
+		quit(1, "Failed to curl_easy_init in initiate_stratum");
+	pool->stratum_curl = curl;
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
+	curl_easy_setopt(curl, CURLOPT_URL, pool->stratum_url);
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
+	curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1);
+	if (opt_socks_proxy) {
+		curl_easy_setopt(curl, CURLOPT_PROXY, opt_socks_proxy);
+		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, CURLPROXY_SOCKS4);
+	}
+	if (curl_easy_perform(curl)) {
+		applog(LOG_INFO, "Stratum connect failed to pool %d %s", pool->pool_no, pool->rpc_url);
+		goto out;
+	}
+#if LIBCURL_VERSION_NUM >= 0x072d00
+	curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &pool->sock);
+#else
+	{
+		long sock;
+
+		curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, &sock);
+		pool->sock = sock;
+	}
+#endif
+
+	if (!pool->sockbuf) {
+		pool->sockbuf = calloc(RECVSIZE, 1);
+		if (unlikely(!pool->sockbuf))
+			quit(1, "Failed to calloc sockbuf in initiate_stratum");
+		pool->sockbuf_size = RECVSIZE;
+	}
+	pool->sockbuf[0] = '\0';
+
+	/* Ids start at 1 so a reply with a missing id never matches */
+	pool->stratum_id = 1;
+	if (!stratum_send_json(pool, json_pack("{s:i,s:s,s:[]}", "id", pool->stratum_id,
+					       "method", "mining.subscribe", "params")))
+		goto out;
+
+	val = stratum_reply(pool, pool->stratum_id);
+	if (!val)
+		goto out;
+
+	res_val = json_object_get(val, "result");
+	err_val = json_object_get(val, "error");
+	if (!res_val || json_is_null(res_val) || (err_val && !json_is_null(err_val))) {
+		applog(LOG_INFO, "Pool %d stratum subscribe failed", pool->pool_no);
+		goto out;
+	}
+
+	/* [[subscription details], extranonce1, extranonce2_size] */
+	nonce1 = json_array_string(res_val, 1);
+	n2size = json_integer_value(json_array_get(res_val, 2));
+	if (!nonce1 || n2size < 1 || n2size > 8) {
+		applog(LOG_INFO, "Pool %d sent an invalid stratum subscribe reply", pool->pool_no);
+		free(nonce1);
+		goto out;
+	}
+	mutex_lock(&pool->stratum_lock);
+	free(pool->nonce1);
+	pool->nonce1 = nonce1;
+	pool->n2size = n2size;
+	pool->nonce2 = 0;
+	pool->stratum_session++;
+	pool->swork.diff = 1;
+	mutex_unlock(&pool->stratum_lock);
+
+	ret = true;
+	pool->stratum_active = true;
+	applog(LOG_INFO, "Pool %d stratum extranonce1 %s extranonce2 size %d",
+	       pool->pool_no, pool->nonce1, n2size);
+out:
+	if (val)
+		json_decref(val);
+	if (!ret)
+		suspend_stratum(pool);
+	return ret;
+}
+
+/* Drop the stratum connection, the current job goes with it */
+void suspend_stratum(struct pool *pool)
+{
+	pool->stratum_active = false;
+	pool->stratum_auth = false;
+	if (pool->stratum_curl) {
+		curl_easy_cleanup(pool->stratum_curl);
+		pool->stratum_curl = NULL;
+	}
+	pool->sock = CURL_SOCKET_BAD;
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_notify = false;
+	clear_swork(&pool->swork);
+	mutex_unlock(&pool->stratum_lock);
+}
+
+void gen_hash(const unsigned char *data, unsigned char *hash, int len)
+{
+	unsigned char hash1[32];
+
+	sha2(data, len, hash1, false);
+	sha2(hash1, 32, hash, false);
+}
+
+static const char b58digits[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+/* Turn a base58check pay to pubkey hash or script hash address into the
+ * output script paying it. Returns the script length, 0 for an address
+ * that isn't valid */
+size_t address_to_script(unsigned char *script, const char *addr)
+{
+	unsigned char bin[25], hash[32];
+	const char *digit;
+	int i;
+
+	memset(bin, 0, sizeof(bin));
+	for (; *addr; addr++) {
+		unsigned int carry;
+
+		digit = strchr(b58digits, *addr);
+		if (!digit)
+			return 0;
+		carry = digit - b58digits;
+		for (i = sizeof(bin) - 1; i >= 0; i--) {
+			carry += 58 * bin[i];
+			bin[i] = carry & 0xff;
+			carry >>= 8;
+		}
+		if (carry)
+			return 0;
+	}
+	gen_hash(bin, hash, 21);
+	if (memcmp(hash, bin + 21, 4))
+		return 0;
+
+	switch (bin[0]) {
+		case 0x00:	/* mainnet and testnet P2PKH */
+		case 0x6f:
+			script[0] = 0x76;	/* OP_DUP */
+			script[1] = 0xa9;	/* OP_HASH160 */
+			script[2] = 0x14;
+			memcpy(script + 3, bin + 1, 20);
+			script[23] = 0x88;	/* OP_EQUALVERIFY */
+			script[24] = 0xac;	/* OP_CHECKSIG */
+			return 25;
+		case 0x05:	/* mainnet and testnet P2SH */
+		case 0xc4:
+			script[0] = 0xa9;	/* OP_HASH160 */
+			script[1] = 0x14;
+			memcpy(script + 2, bin + 1, 20);
+			script[22] = 0x87;	/* OP_EQUAL */
+			return 23;
+		default:
+			return 0;
+	}
+}
+
+static size_t ser_varint(unsigned char *p, uint64_t n)
+{
+	int i, len;
+
+	if (n < 0xfd) {
+		p[0] = n;
+		return 1;
+	}
+	if (n <= 0xffff) {
+		p[0] = 0xfd;
+		len = 2;
+	} else if (n <= 0xffffffff) {
+		p[0] = 0xfe;
+		len = 4;
+	} else {
+		p[0] = 0xff;
+		len = 8;
+	}
+	for (i = 0; i < len; i++)
+		p[1 + i] = n >> (8 * i);
+	return 1 + len;
+}
+
+/* The block height as BIP 34 wants it at the start of the coinbase script */
+static size_t ser_height(unsigned char *p, int64_t height)
+{
+	size_t len = 0;
+
+	if (height <= 16) {
+		p[0] = height ? 0x50 + height : 0;
+		return 1;
+	}
+	while (height) {
+		p[1 + len++] = height & 0xff;
+		height >>= 8;
+	}
+	/* Keep the number positive */
+	if (p[len] & 0x80)
+		p[1 + len++] = 0;
+	p[0] = len;
+	return 1 + len;
+}
+
+static const char *gbt_string(json_t *val, const char *key, size_t len)
+{
+	const char *s = json_string_value(json_object_get(val, key));
+
+	if (s && len && strlen(s) != len)
+		return NULL;
+	return s;
+}
+
+/* Build the coinbase for a template paying btc_script, leaving 4 zero
+ * bytes of extranonce at *nonce2_offset */
+static unsigned char *gbt_coinbase(json_t *res_val, int64_t height,
+				   const char *commit, size_t *cb_len,
+				   size_t *nonce2_offset)
+{
+	unsigned char *cb, *p, script[100], flags[32];
+	const char *flags_hex = NULL;
+	size_t slen, flen = 0, commit_len = commit ? strlen(commit) / 2 : 0;
+	json_t *aux;
+	int64_t value;
+	int i;
+
+	value = json_integer_value(json_object_get(res_val, "coinbasevalue"));
+	aux = json_object_get(res_val, "coinbaseaux");
+	if (aux)
+		flags_hex = json_string_value(json_object_get(aux, "flags"));
+	if (flags_hex && strlen(flags_hex) <= sizeof(flags) * 2 &&
+	    hex2bin(flags, flags_hex, strlen(flags_hex) / 2))
+		flen = strlen(flags_hex) / 2;
+
+	slen = ser_height(script, height);
+	script[slen++] = 4;
+	*nonce2_offset = slen;
+	memset(script + slen, 0, 4);
+	slen += 4;
+	memcpy(script + slen, flags, flen);
+	slen += flen;
+	script[slen++] = 7;
+	memcpy(script + slen, "cgminer", 7);
+	slen += 7;
+
+	cb = calloc(128 + slen + btc_script_len + commit_len, 1);
+	if (unlikely(!cb))
+		quit(1, "Failed to calloc coinbase in gbt_coinbase");
+	p = cb;
+	*p++ = 1;			/* version */
+	p += 3;
+	*p++ = 1;			/* one input spending nothing */
+	p += 32;
+	memset(p, 0xff, 4);
+	p += 4;
+	p += ser_varint(p, slen);
+	*nonce2_offset += p - cb;
+	memcpy(p, script, slen);
+	p += slen;
+	memset(p, 0xff, 4);		/* sequence */
+	p += 4;
+	*p++ = commit ? 2 : 1;
+	for (i = 0; i < 8; i++)
+		*p++ = value >> (8 * i);
+	p += ser_varint(p, btc_script_len);
+	memcpy(p, btc_script, btc_script_len);
+	p += btc_script_len;
+	if (commit) {
+		p += 8;			/* zero value witness commitment */
+		p += ser_varint(p, commit_len);
+		if (!hex2bin(p, commit, commit_len)) {
+			free(cb);
+			return NULL;
+		}
+		p += commit_len;
+	}
+	p += 4;				/* lock time */
+	*cb_len = p - cb;
+	return cb;
+}
+
+/* Decode a getblocktemplate result into the pool's current job. The
+ * coinbase pays btc_script and the merkle branch is built here so work is
+ * generated exactly as it is for a stratum job. The template replaced is
+ * kept unless this one is on a new block. */
+bool gbt_decode(struct pool *pool, json_t *res_val)
+{
+	const char *previousblockhash, *bits, *target, *commit, *workid, *lpid;
+	char *prev_hash = NULL, *bbversion = NULL, *nbit = NULL, *ntime = NULL;
+	char *txns = NULL, *job_id = NULL;
+	unsigned char (*hashes)[32] = NULL, (*merkle)[32] = NULL;
+	unsigned char *coinbase = NULL, bin[32], pair[64];
+	size_t cb_len, nonce2_offset, txns_len = 0;
+	int txn_count, merkles = 0, n, i, j;
+	int64_t height;
+	json_t *arr;
+	bool clean, ret = false;
+
+	if (!res_val || !json_is_object(res_val))
+		goto out;
+	previousblockhash = gbt_string(res_val, "previousblockhash", 64);
+	bits = gbt_string(res_val, "bits", 8);
+	target = gbt_string(res_val, "target", 64);
+	commit = gbt_string(res_val, "default_witness_commitment", 0);
+	workid = gbt_string(res_val, "workid", 0);
+	lpid = gbt_string(res_val, "longpollid", 0);
+	height = json_integer_value(json_object_get(res_val, "height"));
+	arr = json_object_get(res_val, "transactions");
+	if (!previousblockhash || !bits || !target || !arr || !json_is_array(arr) ||
+	    !json_is_integer(json_object_get(res_val, "coinbasevalue")))
+		goto out;
+	txn_count = json_array_size(arr);
+
+	/* The header wants the previous hash in the word order getwork uses,
+	 * which is the displayed hash with its words reversed */
+	prev_hash = malloc(65);
+	bbversion = malloc(9);
+	nbit = strdup(bits);
+	ntime = malloc(9);
+	job_id = malloc(12);
+	if (unlikely(!prev_hash || !bbversion || !nbit || !ntime || !job_id))
+		quit(1, "Failed to malloc template in gbt_decode");
+	for (i = 0; i < 8; i++)
+		memcpy(prev_hash + i * 8, previousblockhash + (7 - i) * 8, 8);
+	prev_hash[64] = '\0';
+	sprintf(bbversion, "%08x", (uint32_t)json_integer_value(json_object_get(res_val, "version")));
+	sprintf(ntime, "%08x", (uint32_t)json_integer_value(json_object_get(res_val, "curtime")));
+	if (!hex2bin(bin, target, 32))
+		goto out;
+
+	/* Transactions go into a found block as they are, their ids into the
+	 * merkle branch. Room is left for the coinbase at hashes[0] and for
+	 * doubling up the last hash of an odd row. */
+	hashes = calloc(txn_count + 2, 32);
+	merkle = calloc(32, 32);
+	if (unlikely(!hashes || !merkle))
+		quit(1, "Failed to calloc merkle in gbt_decode");
+	for (i = 0; i < txn_count; i++) {
+		json_t *txn = json_array_get(arr, i);
+		const char *data = gbt_string(txn, "data", 0);
+		const char *txid = gbt_string(txn, "txid", 64);
+
+		if (!txid)
+			txid = gbt_string(txn, "hash", 64);
+		if (!data || !txid || !hex2bin(pair, txid, 32))
+			goto out;
+		for (j = 0; j < 32; j++)
+			hashes[i + 1][j] = pair[31 - j];
+		txns_len += strlen(data);
+	}
+	txns = malloc(txns_len + 1);
+	if (unlikely(!txns))
+		quit(1, "Failed to malloc txns in gbt_decode");
+	txns_len = 0;
+	for (i = 0; i < txn_count; i++) {
+		const char *data = gbt_string(json_array_get(arr, i), "data", 0);
+
+		strcpy(txns + txns_len, data);
+		txns_len += strlen(data);
+	}
+	txns[txns_len] = '\0';
+
+	for (n = txn_count + 1; n > 1; n = j) {
+		memcpy(merkle[merkles++], hashes[1], 32);
+		if (n % 2) {
+			memcpy(hashes[n], hashes[n - 1], 32);
+			n++;
+		}
+		for (i = 2, j = 1; i < n; i += 2, j++) {
+			memcpy(pair, hashes[i], 32);
+			memcpy(pair + 32, hashes[i + 1], 32);
+			gen_hash(pair, hashes[j], 64);
+		}
+	}
+
+	coinbase = gbt_coinbase(res_val, height, commit, &cb_len, &nonce2_offset);
+	if (!coinbase)
+		goto out;
+
+	mutex_lock(&pool->stratum_lock);
+	clean = !pool->swork.prev_hash || strcmp(prev_hash, pool->swork.prev_hash);
+	if (clean) {
+		for (i = 0; i < GBT_JOBS; i++)
+			clear_swork(&pool->gbt_jobs[i]);
+		clear_swork(&pool->swork);
+	} else {
+		struct stratum_work *old = &pool->gbt_jobs[pool->gbt_templates % GBT_JOBS];
+
+		clear_swork(old);
+		memcpy(old, &pool->swork, sizeof(*old));
+		memset(&pool->swork, 0, sizeof(pool->swork));
+	}
+	sprintf(job_id, "%u", ++pool->gbt_templates);
+	pool->swork.job_id = job_id;
+	pool->swork.prev_hash = prev_hash;
+	pool->swork.bbversion = bbversion;
+	pool->swork.nbit = nbit;
+	pool->swork.ntime = ntime;
+	pool->swork.clean = clean;
+	pool->swork.coinbase = coinbase;
+	pool->swork.cb_len = cb_len;
+	pool->swork.nonce2_offset = nonce2_offset;
+	pool->swork.merkle = merkle;
+	pool->swork.merkles = merkles;
+	for (i = 0; i < 32; i++)
+		pool->swork.target[i] = bin[31 - i];
+	pool->swork.txns = txns;
+	pool->swork.txn_count = txn_count;
+	pool->swork.workid = workid ? strdup(workid) : NULL;
+	pool->swork.witness = commit != NULL;
+	pool->n2size = 4;
+	/* Lets gen_stratum_work use the template */
+	pool->stratum_notify = true;
+	free(pool->longpollid);
+	pool->longpollid = lpid ? strdup(lpid) : NULL;
+	mutex_unlock(&pool->stratum_lock);
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "Pool %d template %s at height %lld with %d transactions%s",
+		       pool->pool_no, job_id, (long long)height, txn_count,
+		       clean ? ", new block" : "");
+	ret = true;
+	prev_hash = bbversion = nbit = ntime = txns = job_id = NULL;
+	coinbase = NULL;
+	merkle = NULL;
+out:
+	if (!ret)
+		applog(LOG_INFO, "Pool %d sent an invalid block template", pool->pool_no);
+	free(prev_hash);
+	free(bbversion);
+	free(nbit);
+	free(ntime);
+	free(job_id);
+	free(txns);
+	free(hashes);
+	free(merkle);
+	free(coinbase);
+	return ret;
+}
+
+/* The block a solved getblocktemplate work item completes, as hex for
+ * submitblock, or NULL if its template is no longer held. A workid the
+ * template came with is returned for the submission. */
+char *gbt_block(struct pool *pool, const struct work *work, char **workid)
+{
+	struct stratum_work *sw = NULL;
+	unsigned char *bin, *p;
+	size_t txns_len, len;
+	uint32_t *data32;
+	char *ret;
+	int i;
+
+	*workid = NULL;
+	mutex_lock(&pool->stratum_lock);
+	if (pool->swork.job_id && !strcmp(pool->swork.job_id, work->job_id))
+		sw = &pool->swork;
+	for (i = 0; !sw && i < GBT_JOBS; i++) {
+		if (pool->gbt_jobs[i].job_id && !strcmp(pool->gbt_jobs[i].job_id, work->job_id))
+			sw = &pool->gbt_jobs[i];
+	}
+	if (!sw) {
+		mutex_unlock(&pool->stratum_lock);
+		return NULL;
+	}
+
+	txns_len = strlen(sw->txns);
+	bin = malloc(80 + 9 + sw->cb_len + 2 + 34);
+	ret = malloc((80 + 9 + sw->cb_len + 2 + 34) * 2 + txns_len + 1);
+	if (unlikely(!bin || !ret))
+		quit(1, "Failed to malloc block in gbt_block");
+
+	/* work->data holds the header with its words byte swapped */
+	data32 = (uint32_t *)bin;
+	for (i = 0; i < 20; i++)
+		data32[i] = swab32(((uint32_t *)work->data)[i]);
+	p = bin + 80;
+	p += ser_varint(p, sw->txn_count + 1);
+
+	/* The coinbase with this work's extranonce, given the marker, flag
+	 * and the all zero witness reserved value if the block commits to
+	 * witnesses */
+	memcpy(p, sw->coinbase, 4);
+	p += 4;
+	if (sw->witness) {
+		*p++ = 0;
+		*p++ = 1;
+	}
+	memcpy(p, sw->coinbase + 4, sw->cb_len - 8);
+	for (i = 0; i < 4; i++)
+		p[sw->nonce2_offset - 4 + i] = work->nonce2 >> (8 * i);
+	p += sw->cb_len - 8;
+	if (sw->witness) {
+		*p++ = 1;
+		*p++ = 32;
+		memset(p, 0, 32);
+		p += 32;
+	}
+	memcpy(p, sw->coinbase + sw->cb_len - 4, 4);
+	p += 4;
+
+	len = p - bin;
+	__bin2hex(ret, bin, len);
+	strcpy(ret + len * 2, sw->txns);
+	if (sw->workid)
+		*workid = strdup(sw->workid);
+	mutex_unlock(&pool->stratum_lock);
+
+	free(bin);
+	return ret;
+}
+
+#if defined(unix)
+/* Map the share journal for this pool in 'dir', 'size' bytes of it. The file
+ * is named after the pool's URL and user so it is found again on the next
+ * start, and any shares left in it are then replayed. A pool already mapped
+ * is left as it is */
+bool spool_open(struct pool *pool, const char *dir, size_t size)
+{
+	unsigned char hash[32];
+	char *id, *path;
+	unsigned int i;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (pool->spool)
+		return true;
+	pool->spool_slots = size / sizeof(struct spool_rec);
+	if (!pool->spool_slots)
+		return false;
+
+	id = malloc(strlen(pool->rpc_url) + strlen(pool->rpc_user) + 2);
+	path = malloc(strlen(dir) + 32);
+	if (unlikely(!id || !path))
+		quit(1, "Failed to malloc in spool_open");
+	sprintf(id, "%s %s", pool->rpc_url, pool->rpc_user);
+	gen_hash((unsigned char *)id, hash, strlen(id));
+	sprintf(path, "%s/cgminer-%02x%02x%02x%02x.spool", dir,
+		hash[0], hash[1], hash[2], hash[3]);
+	free(id);
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		applog(LOG_ERR, "Failed to open share spool %s: %s", path, strerror(errno));
+		goto out_free;
+	}
+	size = pool->spool_slots * sizeof(struct spool_rec);
+	/* A file from a run with a larger --spool-size keeps its length */
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size > size) {
+		pool->spool_slots = st.st_size / sizeof(struct spool_rec);
+		size = pool->spool_slots * sizeof(struct spool_rec);
+	}
+	if (ftruncate(fd, size)) {
+		applog(LOG_ERR, "Failed to size share spool %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		applog(LOG_ERR, "Failed to map share spool %s: %s", path, strerror(errno));
+		goto out_close;
+	}
+	pool->spool_fd = fd;
+	pool->spool = map;
+
+	/* The journal ends at the first record never completely written */
+	for (i = 0; i < pool->spool_slots; i++) {
+		if (pool->spool[i].magic != SPOOL_MAGIC)
+			break;
+	}
+	pool->spool_tail = i;
+	pool->spool_head = pool->spool_next = 0;
+	spool_done(pool, pool->spool_slots);
+	if (pool->spool_tail)
+		applog(LOG_WARNING, "Pool %d has %u shares spooled from an earlier run",
+		       pool->pool_no, pool->spool_tail - pool->spool_head);
+	free(path);
+	return true;
+
+out_close:
+	close(fd);
+out_free:
+	free(path);
+	pool->spool_slots = 0;
+	return false;
+}
+
+/* Append a share to the journal. Returns its slot, or -1 if the spool is
+ * full. Room is made by moving the shares not yet dealt with to the front,
+ * which is only done with none of them being replayed */
+int spool_add(struct pool *pool, const struct work *work)
+{
+	struct spool_rec *rec;
+	unsigned int n;
+	char *page;
+
+	if (pool->spool_tail >= pool->spool_slots) {
+		if (!pool->spool_head || pool->spool_inflight)
+			return -1;
+		/* A crash part way through leaves some shares twice, which the
+		 * pool rejects as duplicates, but never loses any */
+		n = pool->spool_tail - pool->spool_head;
+		memmove(pool->spool, pool->spool + pool->spool_head, n * sizeof(*rec));
+		memset(pool->spool + n, 0, pool->spool_head * sizeof(*rec));
+		pool->spool_next -= pool->spool_head;
+		pool->spool_tail = n;
+		pool->spool_head = 0;
+	}
+
+	rec = &pool->spool[pool->spool_tail];
+	memcpy(rec->data, work->data, sizeof(rec->data));
+	rec->thr_id = work->thr_id;
+	rec->time = work->tv_staged.tv_sec;
+	rec->done = 0;
+	__sync_synchronize();
+	rec->magic = SPOOL_MAGIC;
+	page = (char *)((unsigned long)rec & ~(sysconf(_SC_PAGESIZE) - 1));
+	msync(page, (char *)(rec + 1) - page, MS_ASYNC);
+	pool->spooled++;
+	return pool->spool_tail++;
+}
+
+/* Mark the share in 'slot' dealt with and move the head past all those that
+ * are. Once every share has been, the journal starts again from empty */
+void spool_done(struct pool *pool, unsigned int slot)
+{
+	if (slot < pool->spool_tail)
+		pool->spool[slot].done = 1;
+	while (pool->spool_head < pool->spool_tail && pool->spool[pool->spool_head].done)
+		pool->spool_head++;
+	if (pool->spool_next < pool->spool_head)
+		pool->spool_next = pool->spool_head;
+	if (pool->spool_tail && pool->spool_head == pool->spool_tail) {
+		memset(pool->spool, 0, pool->spool_tail * sizeof(struct spool_rec));
+		pool->spool_head = pool->spool_next = pool->spool_tail = 0;
+	}
+}
+
+#endif /* defined(unix) */